@@ -0,0 +1,356 @@
+#include "edges.h"
+#include "indexed.h"
+#include "kernels.h"
+#include "perf.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * bench.cpp
+ * Time every kernel table this CPU supports and check each against the scalar kernels, then
+ *      measure the indexed frame format on a posterized frame.
+ */
+
+using namespace std::chrono;
+
+/**
+ * Synthetic inputs for one frame
+ */
+struct BenchFrame {
+    size_t width, height, pixels;
+    int k;
+    std::vector<uint8_t> src; // BGR pixels
+    std::vector<uint8_t> gray;
+    std::vector<uint8_t> edges;
+    std::vector<uint8_t> halftone;
+    std::vector<uint8_t> posterized;
+    std::vector<float> centers; // k-means output, on the fixed point grid as snap_means() leaves it
+    std::vector<int16_t> palette; // centers in fixed point
+    std::vector<uint8_t> indices; // Palette indices
+    std::vector<uint8_t> colors; // 256 palette colors of 4 bytes
+};
+
+/**
+ * Outputs of one kernel table
+ */
+struct BenchOutput {
+    std::vector<uint8_t> posterized;
+    std::vector<uint32_t> cell_sums;
+    std::vector<uint8_t> overlay;
+    std::vector<uint32_t> sums;
+    std::vector<int32_t> counts;
+    std::vector<uint8_t> sobel;
+    std::vector<uint8_t> dog;
+    std::vector<uint8_t> expanded;
+};
+
+/**
+ * Build a frame of random pixels with sparse edges and halftone dots
+ */
+static BenchFrame make_frame(size_t width, size_t height, int k)
+{
+    BenchFrame frame;
+    frame.width = width;
+    frame.height = height;
+    frame.pixels = width * height;
+    frame.k = k;
+
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::uniform_int_distribution<int> percent(0, 99);
+    std::uniform_real_distribution<float> color(0.0f, 255.0f);
+
+    frame.src.resize(3 * frame.pixels);
+    frame.halftone.resize(3 * frame.pixels);
+    frame.posterized.resize(3 * frame.pixels);
+    frame.gray.resize(frame.pixels);
+    frame.edges.resize(frame.pixels);
+    for (size_t i = 0; i < frame.pixels; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            frame.src[3 * i + c] = byte(rng);
+            frame.posterized[3 * i + c] = byte(rng);
+            // Mostly black with some dots and some near black pixels around the dot threshold
+            int roll = percent(rng);
+            frame.halftone[3 * i + c] = roll < 60 ? 0 : roll < 80 ? byte(rng) % 4 : byte(rng);
+        }
+        frame.gray[i] = byte(rng);
+        frame.edges[i] = percent(rng) < 10 ? 255 : 0;
+    }
+    for (int i = 0; i < 3 * k; ++i) {
+        frame.centers.push_back(std::round(color(rng) * KERNEL_CENTER_SCALE) / KERNEL_CENTER_SCALE);
+        frame.palette.push_back(std::lround(frame.centers[i] * KERNEL_CENTER_SCALE));
+    }
+    frame.indices.resize(frame.pixels);
+    for (size_t i = 0; i < frame.pixels; ++i) {
+        frame.indices[i] = byte(rng);
+    }
+    frame.colors.resize(4 * INDEXED_MAX_COLORS);
+    for (size_t i = 0; i < frame.colors.size(); ++i) {
+        frame.colors[i] = byte(rng);
+    }
+    return frame;
+}
+
+/**
+ * Run a row kernel over every row of the gray plane, repeating the edge rows at the top and bottom
+ * @param radius Rows above and below each output row the kernel reads
+ */
+template <typename Kernel>
+static void each_row(const BenchFrame& frame, int radius, Kernel kernel)
+{
+    const uint8_t* rows[5];
+    for (size_t y = 0; y < frame.height; ++y) {
+        for (int i = -radius; i <= radius; ++i) {
+            const long row = std::min(std::max((long)y + i, 0L), (long)frame.height - 1);
+            rows[i + radius] = frame.gray.data() + row * frame.width;
+        }
+        kernel(rows, y);
+    }
+}
+
+/**
+ * Run every kernel of a table once per repeat, counting each kernel towards its stage with VRVISOR_PERF
+ */
+static void run_kernels(
+    const KernelTable& table, const BenchFrame& frame, BenchOutput& out, double* times, int repeats, const char* const* stages)
+{
+    const int cell = 9;
+    const int cells = (frame.width - 1) / cell;
+    out.posterized.assign(3 * frame.pixels, 0);
+    out.cell_sums.assign(cells * (frame.height / cell), 0);
+    out.overlay.assign(3 * frame.pixels, 0);
+    out.sobel.assign(frame.pixels, 0);
+    out.dog.assign(frame.pixels, 0);
+    out.expanded.assign(3 * frame.pixels, 0);
+
+    for (int r = 0; r < repeats; ++r) {
+        auto start = steady_clock::now();
+        {
+            PerfScope scope(stages[0], frame.pixels);
+            table.posterize(frame.src.data(), out.posterized.data(), frame.pixels, frame.palette.data(), frame.k);
+        }
+        auto posterized = steady_clock::now();
+        {
+            PerfScope scope(stages[1], frame.pixels);
+            for (size_t band = 0; band < frame.height / cell; ++band) {
+                table.cell_sums(
+                    frame.gray.data() + band * cell * frame.width, frame.width, cells, cell, out.cell_sums.data() + band * cells);
+            }
+        }
+        auto summed = steady_clock::now();
+        {
+            PerfScope scope(stages[2], frame.pixels);
+            table.overlay(frame.edges.data(), frame.halftone.data(), frame.posterized.data(), out.overlay.data(), frame.pixels);
+        }
+        auto overlaid = steady_clock::now();
+        out.sums.assign(3 * frame.k, 0);
+        out.counts.assign(frame.k, 0);
+        {
+            PerfScope scope(stages[3], frame.pixels);
+            table.assign(frame.src.data(), frame.pixels, frame.palette.data(), frame.k, out.sums.data(), out.counts.data());
+        }
+        auto assigned = steady_clock::now();
+        {
+            PerfScope scope(stages[4], frame.pixels);
+            each_row(frame, 1, [&](const uint8_t* const* rows, size_t y) {
+                table.sobel(rows, out.sobel.data() + y * frame.width, frame.width, SOBEL_THRESHOLD);
+            });
+        }
+        auto sobel = steady_clock::now();
+        {
+            PerfScope scope(stages[5], frame.pixels);
+            each_row(frame, 2, [&](const uint8_t* const* rows, size_t y) {
+                table.dog(rows, out.dog.data() + y * frame.width, frame.width, DOG_THRESHOLD);
+            });
+        }
+        auto dog = steady_clock::now();
+        {
+            PerfScope scope(stages[6], frame.pixels);
+            table.expand(frame.indices.data(), out.expanded.data(), frame.pixels, frame.colors.data());
+        }
+        auto expanded = steady_clock::now();
+
+        times[0] += duration<double, std::milli>(posterized - start).count() / repeats;
+        times[1] += duration<double, std::milli>(summed - posterized).count() / repeats;
+        times[2] += duration<double, std::milli>(overlaid - summed).count() / repeats;
+        times[3] += duration<double, std::milli>(assigned - overlaid).count() / repeats;
+        times[4] += duration<double, std::milli>(sobel - assigned).count() / repeats;
+        times[5] += duration<double, std::milli>(dog - sobel).count() / repeats;
+        times[6] += duration<double, std::milli>(expanded - dog).count() / repeats;
+    }
+}
+
+/**
+ * Count pixels the fixed point posterize maps to a different color than float distances to
+ *      the centers would. Doubles hold these distances exactly, so any count but 0 is a bug. A
+ *      pixel exactly as far from two centers may take the color of either.
+ * @param ties Set to the number of pixels exactly as far from two or more nearest centers
+ */
+static size_t float_disagreements(const BenchFrame& frame, const std::vector<uint8_t>& posterized, size_t& ties)
+{
+    uint8_t colors[3 * KERNEL_MAX_COLORS];
+    center_colors(frame.palette.data(), frame.k, colors);
+    size_t count = 0;
+    ties = 0;
+    for (size_t i = 0; i < frame.pixels; ++i) {
+        double distances[KERNEL_MAX_COLORS];
+        double best_distance = DBL_MAX;
+        for (int cluster = 0; cluster < frame.k; ++cluster) {
+            distances[cluster] = 0;
+            for (int c = 0; c < 3; ++c) {
+                const double d = frame.src[3 * i + c] - (double)frame.centers[3 * cluster + c];
+                distances[cluster] += d * d;
+            }
+            best_distance = std::min(best_distance, distances[cluster]);
+        }
+        int nearest = 0;
+        bool agrees = false;
+        for (int cluster = 0; cluster < frame.k; ++cluster) {
+            if (distances[cluster] == best_distance) {
+                nearest += 1;
+                agrees = agrees || std::memcmp(&posterized[3 * i], &colors[3 * cluster], 3) == 0;
+            }
+        }
+        ties += nearest > 1;
+        count += !agrees;
+    }
+    return count;
+}
+
+/**
+ * Encode a posterized frame of smooth shapes, then the same frame moved two pixels to the
+ *      right as a delta frame, and check both decode to the exact pixels
+ * @return False if a frame did not decode to its pixels
+ */
+static bool measure_indexed(const BenchFrame& frame, const KernelTable& table, int repeats)
+{
+    const size_t width = frame.width, height = frame.height;
+    std::vector<uint8_t> smooth(3 * (width + 2) * height);
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width + 2; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                const double wave = std::sin(x * (0.011 + 0.004 * c) + y * 0.007) + std::cos(y * (0.013 - 0.003 * c) - x * 0.005);
+                smooth[3 * (y * (width + 2) + x) + c] = std::lround(127.5 + 63.5 * wave);
+            }
+        }
+    }
+    std::vector<uint8_t> posterized(smooth.size());
+    table.posterize(smooth.data(), posterized.data(), (width + 2) * height, frame.palette.data(), frame.k);
+
+    const size_t step = 3 * (width + 2);
+    const uint8_t* frames[2] = { posterized.data() + 6, posterized.data() };
+    std::vector<uint8_t> encoded[2];
+    std::vector<uint8_t> decoded(3 * width * height);
+    double encode_ms = 0, decode_ms = 0;
+    bool exact = true;
+    for (int r = 0; r < repeats; ++r) {
+        IndexedEncoder encoder;
+        IndexedDecoder decoder;
+        for (int f = 0; f < 2; ++f) {
+            auto start = steady_clock::now();
+            encoder.encode(frames[f], height, width, step, true, encoded[f]);
+            auto encoded_at = steady_clock::now();
+            exact = decoder.decode(encoded[f].data(), encoded[f].size(), decoded.data(), height, width, 3 * width) && exact;
+            auto decoded_at = steady_clock::now();
+            encode_ms += duration<double, std::milli>(encoded_at - start).count() / (2 * repeats);
+            decode_ms += duration<double, std::milli>(decoded_at - encoded_at).count() / (2 * repeats);
+            for (size_t y = 0; y < height; ++y) {
+                exact = exact && std::memcmp(decoded.data() + 3 * y * width, frames[f] + y * step, 3 * width) == 0;
+            }
+        }
+    }
+    const double raw = 3.0 * width * height;
+    std::cout << "indexed posterized frame: key " << encoded[0].size() << " bytes (" << raw / encoded[0].size() << "x), delta "
+              << encoded[1].size() << " bytes (" << raw / encoded[1].size() << "x), encode " << encode_ms << " decode " << decode_ms
+              << " ms" << (exact ? "" : " MISMATCH") << std::endl;
+    return exact;
+}
+
+/**
+ * Compare two buffers byte for byte
+ */
+template <typename T>
+static bool same(const std::vector<T>& a, const std::vector<T>& b)
+{
+    return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(T)) == 0;
+}
+
+int main(int argc, char** argv)
+{
+    size_t width = 640, height = 480;
+    int k = 8, repeats = 20;
+    if (argc > 2) {
+        width = std::atoi(argv[1]);
+        height = std::atoi(argv[2]);
+    }
+    if (argc > 3) {
+        k = std::atoi(argv[3]);
+    }
+    if (argc > 4) {
+        repeats = std::atoi(argv[4]);
+    }
+    if (k < 1 || k > KERNEL_MAX_COLORS || repeats < 1) {
+        std::cerr << "usage: [width height] [k] [repeats]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    BenchFrame frame = make_frame(width, height, k);
+    const KernelTable* tables[8];
+    size_t count = supported_kernels(tables, 8);
+
+    const char* names[] = { "posterize", "cell_sums", "overlay", "assign", "sobel", "dog", "expand" };
+    BenchOutput reference;
+    bool all_match = true;
+    std::cout << width << "x" << height << ", k=" << k << ", " << repeats << " repeats, ms per frame" << std::endl;
+    for (size_t t = 0; t < count; ++t) {
+        BenchOutput out;
+        double times[7] = { 0, 0, 0, 0, 0, 0, 0 };
+        std::vector<std::string> stage_names;
+        const char* stages[7];
+        for (int i = 0; i < 7; ++i) {
+            stage_names.push_back(std::string(tables[t]->name) + " " + names[i]);
+        }
+        for (int i = 0; i < 7; ++i) {
+            stages[i] = stage_names[i].c_str();
+        }
+        run_kernels(*tables[t], frame, t == 0 ? reference : out, times, repeats, stages);
+
+        bool match[7] = { true, true, true, true, true, true, true };
+        if (t > 0) {
+            match[0] = same(out.posterized, reference.posterized);
+            match[1] = same(out.cell_sums, reference.cell_sums);
+            match[2] = same(out.overlay, reference.overlay);
+            match[3] = same(out.sums, reference.sums) && same(out.counts, reference.counts);
+            match[4] = same(out.sobel, reference.sobel);
+            match[5] = same(out.dog, reference.dog);
+            match[6] = same(out.expanded, reference.expanded);
+        }
+        std::cout << tables[t]->name << ":";
+        for (int i = 0; i < 7; ++i) {
+            std::cout << " " << names[i] << " " << times[i] << (match[i] ? "" : " MISMATCH");
+            all_match = all_match && match[i];
+        }
+        std::cout << std::endl;
+    }
+    size_t ties;
+    size_t disagreements = float_disagreements(frame, reference.posterized, ties);
+    std::cout << "posterize pixels not at the center float distances pick: " << disagreements << " of " << frame.pixels << ", "
+              << ties << " exact ties" << (disagreements == 0 ? "" : " MISMATCH") << std::endl;
+    all_match = all_match && disagreements == 0;
+    all_match = measure_indexed(frame, kernels(), repeats) && all_match;
+
+    // Every table ran each kernel once per repeat, so a frame is one repeat
+    for (int r = 0; r < repeats; ++r) {
+        Perf::countFrame();
+    }
+    Perf::report(std::cout);
+    return all_match ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,4 +1,11 @@
 #include "capture.h"
+#include "perf.h"
+#include "placement.h"
+
+#include <algorithm>
+#include <thread>
+
+using namespace std::chrono;
 
 /**
  * Internal thread for ImageCapture to continuous capture images
@@ -8,65 +15,290 @@
 void* capture_thread(void* arg)
 {
     ImageCapture* capture = (ImageCapture*)arg;
+    Placement::apply(ROLE_CAPTURE);
+
     pthread_mutex_lock(&(capture->mutex));
     bool stop = capture->stopped;
     pthread_mutex_unlock(&(capture->mutex));
 
-    // Continuously process until stopped
+    // Continuously capture until stopped. Frames are only grabbed and decoded here,
+    // resizing and flipping is left to the consumers that actually use a frame.
+    cv::Mat back;
+    size_t replay_index = 0;
+    int retry_ms = 0; // Back off while the camera fails, it may come back
     while (!stop) {
-        cv::Mat image;
-        capture->cap >> image;
+        bool grabbed;
+        steady_clock::time_point now;
+        if (capture->replay != NULL) {
+            // Raw replayed frames point into the recording, only indexed frames are decoded
+            int64_t capture_ns = 0;
+            grabbed = capture->replay->frame(capture->id, replay_index, back, capture_ns);
+            if (grabbed && capture->replay->mode() == REPLAY_REALTIME) {
+                capture->replay->waitUntil(capture_ns);
+            }
+            replay_index += grabbed;
+            now = steady_clock::now();
+        } else {
+            // Reuse the previous buffer unless a consumer is still converting from it or the recorder has it queued
+            if (back.u != NULL && back.u->refcount > 1) {
+                back.release();
+            }
+            grabbed = capture->cap.grab() && capture->cap.retrieve(back) && !back.empty();
+            now = steady_clock::now();
+            retry_ms = grabbed ? 0 : std::min(std::max(2 * retry_ms, 1), 100);
+            if (grabbed && capture->recorder != NULL) {
+                capture->recorder->submit(capture->id, back, now);
+            }
+        }
 
-        cv::resize(image, image, cv::Size(640, 480));
-        cv::flip(image, image, -1);
-
-        // Lock mutex before copying new frame to ImageCapture
+        // Lock mutex before swapping new frame into ImageCapture
         pthread_mutex_lock(&(capture->mutex));
-        image.copyTo(capture->image);
-        capture->frame_num += 1;
-        stop = capture->stopped;
-        pthread_cond_broadcast(&(capture->cond)); // Signal any waiting threads
+        if (grabbed && capture->replay != NULL && capture->replay->mode() == REPLAY_FAST) {
+            // Hand every frame to every gating consumer, so a replay renders the same frames each run
+            while (!capture->consumersCaughtUp() && !capture->stopped) {
+                pthread_cond_wait(&(capture->cond), &(capture->mutex));
+            }
+        }
+        if (grabbed && !capture->stopped) {
+            std::swap(capture->image, back);
+            capture->captured = now;
+            capture->frame_num += 1;
+            capture->captured_count += 1;
+            pthread_cond_broadcast(&(capture->cond)); // Signal any waiting threads
+        } else if (capture->replay != NULL && !grabbed) {
+            capture->ended = true;
+            pthread_cond_broadcast(&(capture->cond));
+        }
+        stop = capture->stopped || capture->ended;
         pthread_mutex_unlock(&(capture->mutex));
+        if (!grabbed && !stop && retry_ms > 0) {
+            std::this_thread::sleep_for(milliseconds(retry_ms));
+        }
     }
     return NULL;
 }
 
+/**
+ * Convert a camera frame to the size and orientation the effects expect
+ * @param raw Camera frame
+ * @param image Buffer to convert into, allocated if empty
+ */
+static void convert_frame(const cv::Mat& raw, cv::Mat& image)
+{
+    PerfScope scope("convert", raw.total());
+    if (image.empty()) {
+        Placement::allocateFrame(image, cv::Size(640, 480), CV_8UC3);
+    }
+    cv::resize(raw, image, cv::Size(640, 480));
+    cv::flip(image, image, -1);
+}
+
 /**
  * Construct with a given camera id
- * @param id Camera id
+ * @param id Camera id, also the stream of the camera in recordings
+ * @param replay Recording to replay instead of opening the camera, or NULL
+ * @param recorder Recording to append raw camera frames to, or NULL
  */
-ImageCapture::ImageCapture(int id)
-    : cap(id)
+ImageCapture::ImageCapture(int id, ReplayFile* replay, FrameRecorder* recorder)
+    : id(id)
+    , replay(replay)
+    , recorder(recorder)
     , frame_num(0)
+    , captured_count(0)
+    , converted_num(0)
+    , converted_count(0)
+    , converting(false)
+    , ended(false)
     , stopped(false)
 {
+    if (replay == NULL) {
+        cap.open(id);
+    }
     pthread_mutex_init(&mutex, NULL);
     pthread_cond_init(&cond, NULL);
     pthread_create(&thread, NULL, &capture_thread, this);
 
     // Set camera image capture FPS
-    cap.set(cv::CAP_PROP_FPS, 30);
+    if (replay == NULL) {
+        cap.set(cv::CAP_PROP_FPS, 30);
+    }
 }
 
 ImageCapture::~ImageCapture() { stop(); }
 
+/**
+ * Register a consumer so its deliveries are counted separately
+ * @param name Name used in reports
+ * @param gating Whether a fast replay waits for this consumer to take every frame
+ * @return Consumer id to pass to getFrame
+ */
+int ImageCapture::addConsumer(const std::string& name, bool gating)
+{
+    pthread_mutex_lock(&mutex);
+    Consumer consumer = {};
+    consumer.stats.name = name;
+    consumer.gating = gating;
+    consumer.last_frame = frame_num; // Frames captured before it registered are not skipped
+    consumers.push_back(consumer);
+    int id = consumers.size() - 1;
+    pthread_cond_broadcast(&cond); // A fast replay may be waiting for its first consumer
+    pthread_mutex_unlock(&mutex);
+    return id;
+}
+
+/**
+ * Stop waiting for a consumer that went away, its counters are still reported
+ * @param consumer Consumer id from addConsumer
+ */
+void ImageCapture::removeConsumer(int consumer)
+{
+    pthread_mutex_lock(&mutex);
+    consumers[consumer].gating = false;
+    pthread_cond_broadcast(&cond); // A fast replay may be waiting for it
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Check whether every gating consumer has taken the latest frame, call with mutex held
+ * @return True if a fast replay may publish the next frame
+ */
+bool ImageCapture::consumersCaughtUp()
+{
+    bool any = false;
+    for (const Consumer& consumer : consumers) {
+        if (consumer.gating) {
+            any = true;
+            if (consumer.last_frame < frame_num) {
+                return false;
+            }
+        }
+    }
+    return any;
+}
+
 /**
  * Return the latest frame. Only block if a new frame isn't available.
+ *      The image is shared with other consumers and must not be modified.
  * @param lastFrame Frame id of last image returned
+ * @param consumer Consumer id from addConsumer, or -1 to not count the delivery
  * @return Next frame
  */
-struct Frame ImageCapture::getFrame(size_t last_frame)
+struct Frame ImageCapture::getFrame(size_t last_frame, int consumer)
 {
     pthread_mutex_lock(&mutex);
-    // Block if current frame matches last_frame
-    while (last_frame == frame_num) {
+    // Block if current frame matches last_frame, a finished replay or stopped capture keeps returning its last frame
+    while (last_frame == frame_num && !ended && !stopped) {
+        pthread_cond_wait(&cond, &mutex);
+    }
+
+    // Convert the newest frame once, consumers arriving meanwhile wait for that conversion
+    while (converted_num != frame_num && converting) {
         pthread_cond_wait(&cond, &mutex);
     }
-    cv::Mat latest;
-    image.copyTo(latest);
-    size_t frame = frame_num;
+    if (converted_num != frame_num && !image.empty()) {
+        converting = true;
+        cv::Mat raw = image;
+        size_t raw_num = frame_num;
+        auto raw_captured = captured;
+        // Spare frames are never handed out again, so one only this capture holds stays free
+        cv::Mat fresh;
+        for (size_t i = 0; i < spare.size(); ++i) {
+            if (spare[i].u != NULL && spare[i].u->refcount == 1) {
+                fresh = spare[i];
+                spare.erase(spare.begin() + i);
+                break;
+            }
+        }
+        pthread_mutex_unlock(&mutex);
+
+        convert_frame(raw, fresh);
+
+        pthread_mutex_lock(&mutex);
+        converting = false;
+        if (!converted.empty()) {
+            spare.push_back(converted);
+            if (spare.size() > CAPTURE_SPARE_FRAMES) {
+                spare.erase(spare.begin());
+            }
+        }
+        converted = fresh;
+        converted_num = raw_num;
+        converted_captured = raw_captured;
+        converted_count += 1;
+        pthread_cond_broadcast(&cond);
+    }
+    struct Frame frame = { converted, converted_num, converted_captured };
+    if (converted_num != frame_num) {
+        frame.frame_num = frame_num; // Stopped before any frame was captured
+    }
+
+    if (consumer >= 0) {
+        ConsumerStats& stats = consumers[consumer].stats;
+        double age = duration<double, std::milli>(steady_clock::now() - frame.captured).count();
+        stats.delivered += 1;
+        if (frame.frame_num > consumers[consumer].last_frame) {
+            stats.skipped += frame.frame_num - consumers[consumer].last_frame - 1;
+        }
+        stats.stale += frame.frame_num < frame_num;
+        stats.max_age_ms = std::max(stats.max_age_ms, age);
+        consumers[consumer].age_sum_ms += age;
+        consumers[consumer].last_frame = frame.frame_num;
+        pthread_cond_broadcast(&cond); // A fast replay waits for deliveries
+    }
+    pthread_mutex_unlock(&mutex);
+    return frame;
+}
+
+/**
+ * Check whether a replay has handed out its last frame
+ * @return True once the replay is over and every gating consumer has its last frame, always false for a camera
+ */
+bool ImageCapture::finished()
+{
+    pthread_mutex_lock(&mutex);
+    bool over = ended;
+    for (const Consumer& consumer : consumers) {
+        over = over && (!consumer.gating || consumer.last_frame == frame_num);
+    }
+    pthread_mutex_unlock(&mutex);
+    return over;
+}
+
+/**
+ * Get the delivery counters of every consumer
+ * @return Counters in addConsumer order
+ */
+std::vector<ConsumerStats> ImageCapture::consumerStats()
+{
+    std::vector<ConsumerStats> stats;
+    pthread_mutex_lock(&mutex);
+    for (const Consumer& consumer : consumers) {
+        stats.push_back(consumer.stats);
+        if (consumer.stats.delivered > 0) {
+            stats.back().mean_age_ms = consumer.age_sum_ms / consumer.stats.delivered;
+        }
+    }
     pthread_mutex_unlock(&mutex);
-    return { latest, frame };
+    return stats;
+}
+
+/**
+ * Print captured and converted frame counts and the counters of every consumer
+ * @param out Stream to print to
+ */
+void ImageCapture::report(std::ostream& out)
+{
+    pthread_mutex_lock(&mutex);
+    size_t captured_total = captured_count;
+    size_t converted_total = converted_count;
+    pthread_mutex_unlock(&mutex);
+
+    out << "capture: " << captured_total << " frames captured, " << converted_total << " converted, "
+        << (captured_total > converted_total ? captured_total - converted_total : 0) << " never used" << std::endl;
+    for (const ConsumerStats& stats : consumerStats()) {
+        out << "capture:   " << stats.name << ": " << stats.delivered << " delivered, " << stats.skipped << " skipped, " << stats.stale
+            << " stale, age " << stats.mean_age_ms << " ms mean, " << stats.max_age_ms << " ms max" << std::endl;
+    }
 }
 
 /**
@@ -77,6 +309,7 @@ void ImageCapture::stop()
     pthread_mutex_lock(&mutex);
     if (!stopped) {
         stopped = true;
+        pthread_cond_broadcast(&cond); // A fast replay may be waiting for consumers
         pthread_mutex_unlock(&mutex);
         pthread_join(thread, NULL);
         pthread_mutex_lock(&mutex);
@@ -85,4 +318,4 @@ void ImageCapture::stop()
         pthread_cond_broadcast(&cond); // Wakeup anybody waiting
     }
     pthread_mutex_unlock(&mutex);
-}
\ No newline at end of file
+}
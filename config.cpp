@@ -0,0 +1,78 @@
+#include "config.h"
+
+#include <cstdlib>
+#include <strings.h>
+
+/**
+ * Read a string setting from the environment
+ * @param name Environment variable name
+ * @param fallback Value used if the variable is unset or empty
+ * @return Setting value
+ */
+std::string config_string(const char* name, const std::string& fallback)
+{
+    const char* value = std::getenv(name);
+    if (value == NULL || *value == '\0') {
+        return fallback;
+    }
+    return value;
+}
+
+/**
+ * Read an integer setting from the environment
+ * @param name Environment variable name
+ * @param fallback Value used if the variable is unset or not a number
+ * @return Setting value
+ */
+int config_int(const char* name, int fallback)
+{
+    const char* value = std::getenv(name);
+    if (value == NULL || *value == '\0') {
+        return fallback;
+    }
+    char* end;
+    long parsed = std::strtol(value, &end, 0);
+    return *end == '\0' ? (int)parsed : fallback;
+}
+
+/**
+ * Read a floating point setting from the environment
+ * @param name Environment variable name
+ * @param fallback Value used if the variable is unset or not a number
+ * @return Setting value
+ */
+double config_double(const char* name, double fallback)
+{
+    const char* value = std::getenv(name);
+    if (value == NULL || *value == '\0') {
+        return fallback;
+    }
+    char* end;
+    double parsed = std::strtod(value, &end);
+    return *end == '\0' ? parsed : fallback;
+}
+
+/**
+ * Read a boolean setting from the environment. Accepts 1/0, true/false, yes/no and on/off.
+ * @param name Environment variable name
+ * @param fallback Value used if the variable is unset or not recognized
+ * @return Setting value
+ */
+bool config_bool(const char* name, bool fallback)
+{
+    const char* value = std::getenv(name);
+    if (value == NULL || *value == '\0') {
+        return fallback;
+    }
+    const char* yes[] = { "1", "true", "yes", "on" };
+    const char* no[] = { "0", "false", "no", "off" };
+    for (size_t i = 0; i < 4; ++i) {
+        if (strcasecmp(value, yes[i]) == 0) {
+            return true;
+        }
+        if (strcasecmp(value, no[i]) == 0) {
+            return false;
+        }
+    }
+    return fallback;
+}
@@ -1,8 +1,14 @@
 #include "capture.h"
 #include "kmeans.h"
+#include "perf.h"
 #include "pipeline.h"
+#include "placement.h"
+#include "presenter.h"
+#include "recording.h"
+#include "shmring.h"
 #include "timing.h"
 
+#include <algorithm>
 #include <csignal>
 #include <opencv2/opencv.hpp>
 
@@ -26,17 +32,34 @@ int main(int argc, char** argv)
     sigIntHandler.sa_flags = 0;
     sigaction(SIGINT, &sigIntHandler, NULL);
 
-    ImageCapture left_cap(0);
-    ImageCapture right_cap(1);
+    Placement::configure(Placement::fromEnvironment());
+    Placement::report(std::cout);
+
+    // Replay a recording in place of the cameras, or record both cameras into one file.
+    // Left and right frames are paired by their index within each stream.
+    ReplayFile replay;
+    FrameRecorder recorder;
+    bool replaying = replay.openFromEnvironment();
+    bool recording = !replaying && recorder.openFromEnvironment();
+
+    ImageCapture left_cap(0, replaying ? &replay : NULL, recording ? &recorder : NULL);
+    ImageCapture right_cap(1, replaying ? &replay : NULL, recording ? &recorder : NULL);
 
     Kmeans kmeans_src(8, 100, &left_cap);
 
-    Pipeline left_pipeline(&left_cap, &kmeans_src);
-    Pipeline right_pipeline(&right_cap, &kmeans_src);
+    // Each stream steps down to cheaper edges on its own, both share the effect worker pool
+    EffectOptions options = EffectOptions::fromEnvironment();
+    Pipeline left_pipeline(&left_cap, &kmeans_src, QualityController::fromEnvironment(), options);
+    Pipeline right_pipeline(&right_cap, &kmeans_src, QualityController::fromEnvironment(), options);
+
+    // The presenter thread owns the window, so display never stalls the next Pipeline::start
+    Presenter presenter("Window", Presenter::fromEnvironment());
 
-    // Make window show up fullscreen
-    namedWindow("Window", cv::WINDOW_NORMAL);
-    setWindowProperty("Window", cv::WND_PROP_FULLSCREEN, cv::WINDOW_FULLSCREEN);
+    // Finished frames can also go to other processes through shared memory, and be recorded per camera
+    ShmRingWriter shm;
+    shm.openFromEnvironment();
+    FrameRecorder output;
+    output.openOutputFromEnvironment();
 
     while (!stop) {
         START_TIMING();
@@ -51,7 +74,18 @@ int main(int argc, char** argv)
 
             Mat final;
             cv::hconcat(array, 2, final);
-            imshow("Window", final);
+            presenter.submit(final);
+
+            std::chrono::steady_clock::time_point left_captured, right_captured;
+            double left_ms, right_ms;
+            size_t frame_num = left_pipeline.lastFrame(left_captured, left_ms);
+            right_pipeline.lastFrame(right_captured, right_ms);
+            output.submit(0, left_image, left_captured);
+            output.submit(1, right_image, right_captured);
+            if (shm.isOpen()) {
+                // Stamp the pair with the older of its two capture times
+                shm.publish(final, frame_num, std::min(left_captured, right_captured), { { "left", left_ms }, { "right", right_ms } });
+            }
         } catch (Exception& e) {
             std::cout << e.what() << std::endl;
             break;
@@ -59,13 +93,25 @@ int main(int argc, char** argv)
             break;
         }
         STOP_TIMING("Frame Time");
+        Perf::countFrame();
 
-        if (waitKey(1) == 27)
+        if (presenter.closed())
             break; // stop capturing by pressing ESC
+        if (left_cap.finished() || right_cap.finished())
+            break; // replay is over
     }
     left_cap.stop();
     right_cap.stop();
+    recorder.close();
+    output.close();
     kmeans_src.stop();
+    presenter.stop();
+    presenter.report(std::cout);
+    left_cap.report(std::cout);
+    right_cap.report(std::cout);
+    shm.report(std::cout);
+    shm.close();
+    Perf::report(std::cout);
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,101 @@
+#include "edges.h"
+#include "config.h"
+
+#include <iostream>
+
+// Weight of the newest frame in the smoothed frame time
+#define FRAME_TIME_SMOOTHING 0.1
+
+// Frames to wait after switching engines before switching again
+#define ENGINE_HOLD_FRAMES 60
+
+// Fraction of the budget the smoothed frame time must drop below to step back up
+#define UPGRADE_FRACTION 0.75
+
+static const char* engine_names[EDGES_COUNT] = { "sobel", "xdog", "canny" };
+
+/**
+ * Get the name of an edge engine
+ * @param engine Edge engine
+ * @return Name used by VRVISOR_EDGES
+ */
+const char* edge_engine_name(EdgeEngine engine) { return engine_names[engine]; }
+
+/**
+ * Look up an edge engine by name
+ * @param name canny, sobel or xdog
+ * @param fallback Engine used if the name is not recognized
+ * @return Edge engine
+ */
+EdgeEngine edge_engine_from_name(const std::string& name, EdgeEngine fallback)
+{
+    for (int engine = 0; engine < EDGES_COUNT; ++engine) {
+        if (name == engine_names[engine]) {
+            return (EdgeEngine)engine;
+        }
+    }
+    std::cerr << "edges: unknown engine " << name << ", using " << edge_engine_name(fallback) << std::endl;
+    return fallback;
+}
+
+/**
+ * Read the edge engine from VRVISOR_EDGES, defaulting to Canny
+ * @return Edge engine
+ */
+EdgeEngine edge_engine_from_environment() { return edge_engine_from_name(config_string("VRVISOR_EDGES", "canny"), EDGES_CANNY); }
+
+/**
+ * @param preferred Engine to use while there is time for it
+ * @param budget_ms Frame time budget, 0 to always use the preferred engine
+ */
+QualityController::QualityController(EdgeEngine preferred, double budget_ms)
+    : preferred(preferred)
+    , current(preferred)
+    , budget_ms(budget_ms)
+    , average_ms(0)
+    , frames_since_change(0)
+{
+}
+
+/**
+ * Create a controller from VRVISOR_EDGES and VRVISOR_FRAME_BUDGET_MS
+ * @return Quality controller
+ */
+QualityController QualityController::fromEnvironment()
+{
+    return QualityController(edge_engine_from_environment(), config_double("VRVISOR_FRAME_BUDGET_MS", 0));
+}
+
+/**
+ * Get the engine to use for the next frame
+ * @return Edge engine
+ */
+EdgeEngine QualityController::engine() const { return current; }
+
+/**
+ * Record the time of a frame and pick the engine for the next one
+ * @param frame_ms Frame time
+ */
+void QualityController::update(double frame_ms)
+{
+    if (budget_ms <= 0) {
+        return;
+    }
+    average_ms = frames_since_change == 0 ? frame_ms : (1 - FRAME_TIME_SMOOTHING) * average_ms + FRAME_TIME_SMOOTHING * frame_ms;
+    if (++frames_since_change < ENGINE_HOLD_FRAMES) {
+        return;
+    }
+
+    EdgeEngine next = current;
+    if (average_ms > budget_ms && current > EDGES_SOBEL) {
+        next = (EdgeEngine)(current - 1);
+    } else if (average_ms < UPGRADE_FRACTION * budget_ms && current < preferred) {
+        next = (EdgeEngine)(current + 1);
+    }
+    if (next != current) {
+        std::cout << "edges: " << edge_engine_name(current) << " -> " << edge_engine_name(next) << " at " << average_ms << " ms, budget "
+                  << budget_ms << " ms" << std::endl;
+        current = next;
+        frames_since_change = 0;
+    }
+}
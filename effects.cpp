@@ -1,16 +1,32 @@
 #include "effects.h"
+#include "kernels.h"
+#include "perf.h"
 #include "timing.h"
+#include "workers.h"
+
+/**
+ * Convert an image to gray once for every effect that needs it
+ * @param src Source Image
+ * @return Gray image
+ */
+Mat Effects::gray(Mat src)
+{
+    Mat src_gray;
+    cvtColor(src, src_gray, COLOR_BGR2GRAY);
+    return src_gray;
+}
 
 /**
  * Perform canny edge detection
  * @param src Source Image
+ * @param gray Gray src, or an empty Mat to convert src here
  * @return Mat with detected edges
  */
-Mat Effects::canny(Mat src)
+Mat Effects::canny(Mat src, Mat gray)
 {
     START_TIMING();
-    Mat src_gray, detected_edges;
-    cvtColor(src, src_gray, COLOR_BGR2GRAY);
+    Mat src_gray = gray.empty() ? Effects::gray(src) : gray;
+    Mat detected_edges;
 
     cv::blur(src_gray, detected_edges, Size(3, 3));
     Canny(detected_edges, detected_edges, 30, 60, 3);
@@ -19,6 +35,120 @@ Mat Effects::canny(Mat src)
     return detected_edges;
 }
 
+/**
+ * Perform single pass Sobel magnitude edge detection
+ * @param src Source Image
+ * @return Mat with detected edges
+ */
+Mat Effects::sobel(Mat src)
+{
+    START_TIMING();
+    Mat detected_edges = threshold_edges(src, EDGES_SOBEL, Mat());
+    STOP_TIMING("Sobel");
+    return detected_edges;
+}
+
+/**
+ * Perform single pass difference of Gaussians edge detection
+ * @param src Source Image
+ * @return Mat with detected edges
+ */
+Mat Effects::xdog(Mat src)
+{
+    START_TIMING();
+    Mat detected_edges = threshold_edges(src, EDGES_XDOG, Mat());
+    STOP_TIMING("XDoG");
+    return detected_edges;
+}
+
+/**
+ * Perform edge detection with the chosen engine
+ * @param src Source Image
+ * @param engine Edge engine
+ * @param gray Gray src, or an empty Mat to convert src here
+ * @return Mat with detected edges
+ */
+Mat Effects::edges(Mat src, EdgeEngine engine, Mat gray)
+{
+    if (gray.empty()) {
+        switch (engine) {
+        case EDGES_SOBEL:
+            return sobel(src);
+        case EDGES_XDOG:
+            return xdog(src);
+        default:
+            return canny(src);
+        }
+    }
+    return engine == EDGES_CANNY ? canny(src, gray) : threshold_edges(src, engine, gray);
+}
+
+/**
+ * Run a single pass edge engine over bands of rows in parallel
+ * @param src Source Image
+ * @param engine EDGES_SOBEL or EDGES_XDOG
+ * @param gray Gray src, or an empty Mat to convert each band
+ * @return Mat with detected edges
+ */
+Mat Effects::threshold_edges(Mat src, EdgeEngine engine, Mat gray)
+{
+    Mat new_image(src.size(), CV_8UC1);
+
+    struct edge_args args[NUM_THREADS];
+    for (size_t i = 0; i < NUM_THREADS; ++i) {
+        // Divide rows up evenly between threads
+        args[i].start_index = i * src.rows / NUM_THREADS;
+        args[i].end_index = (i + 1) * src.rows / NUM_THREADS;
+        args[i].engine = engine;
+        args[i].src = &src;
+        args[i].gray = &gray;
+        args[i].new_image = &new_image;
+    }
+    WorkerPool::shared().run(&edge_thread, args, NUM_THREADS);
+    return new_image;
+}
+
+/**
+ * Thread to threshold the edges of a band of rows
+ * @param arg edge_args*
+ * @return NULL
+ */
+void* Effects::edge_thread(void* arg)
+{
+    auto args = (struct edge_args*)arg;
+    if (args->start_index >= args->end_index) {
+        return nullptr;
+    }
+    PerfScope scope("edges");
+    const int rows = args->src->rows;
+    const int radius = args->engine == EDGES_SOBEL ? 1 : 2;
+
+    // Only this band and the rows the kernel reads around it are converted to gray, so they stay in cache
+    int first = std::max(args->start_index - radius, 0);
+    const int last = std::min(args->end_index + radius, rows);
+    Mat gray;
+    if (args->gray->empty()) {
+        cvtColor(args->src->rowRange(first, last), gray, COLOR_BGR2GRAY);
+    } else {
+        gray = *(args->gray); // Already converted for other effects
+        first = 0;
+    }
+
+    const uint8_t* window[5];
+    for (int row = args->start_index; row < args->end_index; ++row) {
+        // Repeat the first and last rows past the top and bottom of the image
+        for (int i = -radius; i <= radius; ++i) {
+            window[i + radius] = gray.ptr<uint8_t>(std::min(std::max(row + i, 0), rows - 1) - first);
+        }
+        if (args->engine == EDGES_SOBEL) {
+            kernels().sobel(window, args->new_image->ptr<uint8_t>(row), args->src->cols, SOBEL_THRESHOLD);
+        } else {
+            kernels().dog(window, args->new_image->ptr<uint8_t>(row), args->src->cols, DOG_THRESHOLD);
+        }
+    }
+    return nullptr;
+}
+
 /**
  * Helper method for blurring an image
  * @param src Source Image
@@ -38,17 +168,12 @@ Mat Effects::blur(Mat src)
 Mat Effects::overlay(Mat canny_overlay, Mat halftone_overlay, Mat posterized_image)
 {
     START_TIMING();
-    Mat fore;
-    Mat halftone_mask;
-    cvtColor(halftone_overlay, halftone_mask, COLOR_BGR2GRAY);
-
-    cv::threshold(halftone_mask, halftone_mask, 1, 255, cv::THRESH_BINARY);
-    add(canny_overlay, halftone_mask, fore);
-    bitwise_not(fore, fore);
-
-    Mat out;
-    posterized_image.copyTo(out, fore);
-    add(halftone_overlay, out, out);
+    // Posterized pixels only show where there is no edge and no halftone dot, in a single pass
+    Mat out(posterized_image.size(), posterized_image.type());
+    for (int row = 0; row < out.rows; ++row) {
+        kernels().overlay(canny_overlay.ptr<uint8_t>(row), halftone_overlay.ptr<uint8_t>(row), posterized_image.ptr<uint8_t>(row),
+            out.ptr<uint8_t>(row), out.cols);
+    }
 
     STOP_TIMING("Overlay");
     return out;
@@ -62,34 +187,52 @@ Mat Effects::overlay(Mat canny_overlay, Mat halftone_overlay, Mat posterized_ima
  */
 Mat Effects::posterize(Mat src, Mat centers)
 {
-    START_TIMING();
-    Mat img;
-    src.convertTo(img, CV_32FC3);
-    img = img.reshape(3, img.total());
-    centers = centers.t();
-    centers = centers.reshape(3, centers.rows);
+    // Pixels stay 8 bit, only the palette is converted
+    return posterize_packed(src, palette(centers));
+}
 
-    Mat new_image(src.total(), 1, src.type());
+/**
+ * Color an image using a packed palette
+ * @param src Source image
+ * @param colors 1 x k fixed point palette from palette()
+ * @return Posterized image
+ */
+Mat Effects::posterize_packed(Mat src, Mat colors)
+{
+    START_TIMING();
+    Mat new_image(src.size(), src.type());
 
-    pthread_t threads[NUM_THREADS];
     struct posterize_args args[NUM_THREADS];
     for (size_t i = 0; i < NUM_THREADS; ++i) {
-        args[i].start_index = i * src.total() / NUM_THREADS;
-        args[i].end_index = min(src.total(), (i + 1) * src.total() / NUM_THREADS);
-        args[i].img = &img;
-        args[i].centers = &centers;
+        // Divide rows up evenly between threads
+        args[i].start_index = i * src.rows / NUM_THREADS;
+        args[i].end_index = (i + 1) * src.rows / NUM_THREADS;
+        args[i].img = &src;
+        args[i].centers = &colors;
         args[i].new_image = &new_image;
-        pthread_create(&threads[i], NULL, &posterize_thread, &args[i]);
-    }
-    for (int i = 0; i < NUM_THREADS; ++i) {
-        pthread_join(threads[i], NULL);
     }
-    new_image = new_image.reshape(3, src.rows);
+    WorkerPool::shared().run(&posterize_thread, args, NUM_THREADS);
     new_image = Effects::blur(new_image);
     STOP_TIMING("Posterize");
     return new_image;
 }
 
+/**
+ * Convert k-means centers to a packed fixed point palette. Centers on the grid of
+ *      snap_means() convert exactly, so each pixel goes to the center float distances pick.
+ * @param centers 3 x k float centers, one color per column
+ * @return 1 x k palette of KERNEL_CENTER_SCALE steps per level, CV_16SC3
+ */
+Mat Effects::palette(Mat centers)
+{
+    CV_Assert(centers.cols <= KERNEL_MAX_COLORS);
+    Mat colors;
+    Mat(centers.t()).convertTo(colors, CV_16S, KERNEL_CENTER_SCALE);
+    colors = cv::max(colors, 0.0); // Kernels rely on the range
+    colors = cv::min(colors, (double)KERNEL_CENTER_MAX);
+    return colors.reshape(3, 1);
+}
+
 /**
  * Thread to posterize a subset of an image
  * @param arg posterize_args*
@@ -98,23 +241,10 @@ Mat Effects::posterize(Mat src, Mat centers)
 void* Effects::posterize_thread(void* arg)
 {
     auto args = (struct posterize_args*)arg;
-    for (int i = args->start_index; i < args->end_index; ++i) {
-        Vec3f value = args->img->at<Vec3f>(i, 0);
-        float best_distance = FLT_MAX;
-        int32_t best_cluster = 0;
-        for (int32_t cluster = 0; cluster < args->centers->rows; ++cluster) {
-            Vec3f center = args->centers->at<Vec3f>(cluster, 0);
-            const float distance = (value[0] - center[0]) * (value[0] - center[0]) + (value[1] - center[1]) * (value[1] - center[1])
-                + (value[1] - center[1]) * (value[1] - center[1]);
-            if (distance < best_distance) {
-                best_distance = distance;
-                best_cluster = cluster;
-            }
-        }
-
-        args->new_image->at<Vec3b>(i, 0)[0] = args->centers->at<Vec3f>(best_cluster, 0)[0];
-        args->new_image->at<Vec3b>(i, 0)[1] = args->centers->at<Vec3f>(best_cluster, 0)[1];
-        args->new_image->at<Vec3b>(i, 0)[2] = args->centers->at<Vec3f>(best_cluster, 0)[2];
+    PerfScope scope("posterize");
+    for (int row = args->start_index; row < args->end_index; ++row) {
+        kernels().posterize(args->img->ptr<uint8_t>(row), args->new_image->ptr<uint8_t>(row), args->img->cols,
+            args->centers->ptr<int16_t>(0), args->centers->cols);
     }
     return nullptr;
 }
@@ -122,16 +252,15 @@ void* Effects::posterize_thread(void* arg)
 /**
  * Create halftone effect from an image
  * @param src Source image
+ * @param gray Gray src, or an empty Mat to convert src here
  * @return Image with halftone dots
  */
-Mat Effects::halftone(Mat src)
+Mat Effects::halftone(Mat src, Mat gray)
 {
     START_TIMING();
-    Mat gray_src;
-    cvtColor(src, gray_src, COLOR_BGR2GRAY);
+    Mat gray_src = gray.empty() ? Effects::gray(src) : gray;
     Mat new_image = cv::Mat::zeros(src.size(), src.type());
 
-    pthread_t threads[NUM_THREADS];
     struct halftone_args args[NUM_THREADS];
     for (size_t i = 0; i < NUM_THREADS; ++i) {
         // Divide picture up evenly between threads
@@ -140,11 +269,8 @@ Mat Effects::halftone(Mat src)
         args[i].src = &src;
         args[i].gray_img = &gray_src;
         args[i].new_image = &new_image;
-        pthread_create(&threads[i], NULL, &halftone_thread, &args[i]);
-    }
-    for (int i = 0; i < NUM_THREADS; ++i) {
-        pthread_join(threads[i], NULL);
     }
+    WorkerPool::shared().run(&halftone_thread, args, NUM_THREADS);
     STOP_TIMING("Halftone");
     return new_image;
 }
@@ -157,18 +283,21 @@ Mat Effects::halftone(Mat src)
 void* Effects::halftone_thread(void* arg)
 {
     auto args = (struct halftone_args*)arg;
+    PerfScope scope("halftone");
+
+    // Neighborhoods that fit with at least one column to spare
+    const int cells = (args->src->cols - 1) / NBHD_SIZE;
+    std::vector<uint32_t> sums(cells);
 
     for (int i = NBHD_SIZE * args->start_index; i < NBHD_SIZE * args->end_index; i += NBHD_SIZE) {
-        for (int j = 0; j + NBHD_SIZE < args->src->cols; j += NBHD_SIZE) {
-            // Sum the intensity of the neighborhood
-            double nbhdSum = 0;
-            for (int k = 0; k < NBHD_SIZE; k++) {
-                Mat nbhdRow = args->gray_img->row(i + k).colRange(j, j + NBHD_SIZE).clone();
-                nbhdSum += sum(nbhdRow)[0];
-            }
+        // Sum the intensity of every neighborhood in this row
+        kernels().cell_sums(args->gray_img->ptr<uint8_t>(i), args->gray_img->step, cells, NBHD_SIZE, sums.data());
+
+        for (int cell = 0; cell < cells; ++cell) {
+            const int j = cell * NBHD_SIZE;
 
             // Average
-            double average = nbhdSum / NBHD_SIZE;
+            double average = (double)sums[cell] / NBHD_SIZE;
 
             // Scale average into a circle radius intensity
             double max = (2.0 / 3) * 0.5 * NBHD_SIZE;
@@ -0,0 +1,272 @@
+#include "graph.h"
+#include "config.h"
+#include "effects.h"
+#include "perf.h"
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+#define NODE_BIT(node) (1u << (node))
+
+static const char* node_names[NODE_COUNT] = { "gray", "edges", "halftone", "palette", "posterize", "overlay", "output" };
+
+/**
+ * Get the name of an effect node
+ * @param node Effect node
+ * @return Short lowercase name
+ */
+const char* effect_node_name(EffectNode node) { return node_names[node]; }
+
+/**
+ * Every effect, output at source size
+ */
+EffectOptions::EffectOptions()
+    : edges(true)
+    , halftone(true)
+    , posterize(true)
+    , scale(1)
+    , interpolation(cv::INTER_LINEAR)
+{
+}
+
+/**
+ * Read the enabled effects from VRVISOR_EFFECTS, a comma separated list of edges,
+ *      halftone and posterize, all by default
+ * @return Options
+ */
+EffectOptions EffectOptions::fromEnvironment()
+{
+    EffectOptions options;
+    std::string list = config_string("VRVISOR_EFFECTS", "edges,halftone,posterize");
+    options.edges = options.halftone = options.posterize = false;
+
+    std::stringstream stream(list);
+    std::string name;
+    while (std::getline(stream, name, ',')) {
+        if (name == "edges") {
+            options.edges = true;
+        } else if (name == "halftone") {
+            options.halftone = true;
+        } else if (name == "posterize") {
+            options.posterize = true;
+        } else if (!name.empty()) {
+            std::cerr << "graph: unknown effect " << name << std::endl;
+        }
+    }
+    return options;
+}
+
+/**
+ * Internal task for EffectGraph to run one node
+ * @param arg node_args*
+ * @return NULL
+ */
+void* node_thread(void* arg)
+{
+    auto args = (struct EffectGraph::node_args*)arg;
+    EffectGraph* graph = args->graph;
+
+    auto begin = std::chrono::steady_clock::now();
+    bool failed = false;
+    cv::Exception error;
+    try {
+        PerfScope scope(effect_node_name(args->node), graph->src.total());
+        graph->compute(args->node);
+    } catch (cv::Exception& e) {
+        // Pool threads must not throw, run() rethrows to the caller instead
+        failed = true;
+        error = e;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+    pthread_mutex_lock(&(graph->mutex));
+    graph->node_ms[args->node] = ms;
+    graph->finished |= NODE_BIT(args->node);
+    if (failed && !graph->failed) {
+        graph->failed = true;
+        graph->error = error;
+    }
+    if (!graph->failed) {
+        graph->release(args->node);
+    }
+    pthread_mutex_unlock(&(graph->mutex));
+    return NULL;
+}
+
+/**
+ * @param options Enabled effects
+ */
+EffectGraph::EffectGraph(EffectOptions options)
+    : effect_options(options)
+    , finished(0)
+    , queued(0)
+    , failed(false)
+    , engine(EDGES_CANNY)
+{
+    pthread_mutex_init(&mutex, NULL);
+
+    // Prune the nodes of disabled effects, and gray if nothing reads it
+    active[NODE_EDGES] = options.edges;
+    active[NODE_HALFTONE] = options.halftone;
+    active[NODE_GRAY] = options.edges || options.halftone;
+    active[NODE_PALETTE] = active[NODE_POSTERIZE] = options.posterize;
+    active[NODE_OVERLAY] = active[NODE_OUTPUT] = true;
+
+    inputs[NODE_GRAY] = 0;
+    inputs[NODE_EDGES] = NODE_BIT(NODE_GRAY);
+    inputs[NODE_HALFTONE] = NODE_BIT(NODE_GRAY);
+    inputs[NODE_PALETTE] = 0;
+    inputs[NODE_POSTERIZE] = NODE_BIT(NODE_PALETTE);
+    inputs[NODE_OVERLAY] = NODE_BIT(NODE_EDGES) | NODE_BIT(NODE_HALFTONE) | NODE_BIT(NODE_POSTERIZE);
+    inputs[NODE_OUTPUT] = NODE_BIT(NODE_OVERLAY);
+
+    unsigned active_mask = 0;
+    for (int node = 0; node < NODE_COUNT; ++node) {
+        active_mask |= active[node] ? NODE_BIT(node) : 0;
+        args[node] = { this, (EffectNode)node };
+        node_ms[node] = 0;
+    }
+    for (int node = 0; node < NODE_COUNT; ++node) {
+        inputs[node] &= active_mask; // Pruned inputs are never waited for
+    }
+}
+
+EffectGraph::~EffectGraph() { pthread_mutex_destroy(&mutex); }
+
+/**
+ * Process one image. Not reentrant, use one graph per stream.
+ * @param src Source image
+ * @param means 3 x k k-means centers
+ * @param engine Edge engine for this frame
+ * @return Comic book image
+ */
+cv::Mat EffectGraph::run(cv::Mat src, cv::Mat means, EdgeEngine engine)
+{
+    pthread_mutex_lock(&mutex);
+    this->src = src;
+    this->means = means;
+    this->engine = engine;
+    finished = 0;
+    queued = 0;
+    failed = false;
+    for (int node = 0; node < NODE_COUNT; ++node) {
+        results[node].release();
+    }
+    release(NODE_COUNT);
+    pthread_mutex_unlock(&mutex);
+
+    // The calling thread runs nodes too while it waits
+    WorkerPool::shared().wait(group);
+    if (Perf::enabled()) {
+        // Wall clock latency of each node, reported next to the CPU time of its PerfScope
+        for (int node = 0; node < NODE_COUNT; ++node) {
+            if (finished & NODE_BIT(node)) {
+                Perf::recordLatency(effect_node_name((EffectNode)node), node_ms[node]);
+            }
+        }
+    }
+
+    cv::Mat output = results[NODE_OUTPUT];
+    for (int node = 0; node < NODE_COUNT; ++node) {
+        results[node].release(); // Do not hold on to frames between runs
+    }
+    this->src.release();
+    if (failed) {
+        throw error;
+    }
+    return output;
+}
+
+/**
+ * Queue the nodes whose inputs are all ready, call with mutex held
+ * @param done Node that just finished, or NODE_COUNT to start a run
+ */
+void EffectGraph::release(EffectNode done)
+{
+    for (int node = 0; node < NODE_COUNT; ++node) {
+        bool waiting = active[node] && !(queued & NODE_BIT(node));
+        bool ready = (inputs[node] & ~finished) == 0;
+        if (waiting && ready && (done == NODE_COUNT || (inputs[node] & NODE_BIT(done)))) {
+            queued |= NODE_BIT(node);
+            WorkerPool::shared().submit(group, &node_thread, &args[node]);
+        }
+    }
+}
+
+/**
+ * Compute one node from its inputs
+ * @param node Effect node
+ */
+void EffectGraph::compute(EffectNode node)
+{
+    // Inputs are finished and no longer written, so they are read without the mutex
+    cv::Mat result;
+    switch (node) {
+    case NODE_GRAY:
+        result = Effects::gray(src);
+        break;
+    case NODE_EDGES:
+        result = Effects::edges(src, engine, results[NODE_GRAY]);
+        break;
+    case NODE_HALFTONE:
+        result = Effects::halftone(src, results[NODE_GRAY]);
+        break;
+    case NODE_PALETTE:
+        result = Effects::palette(means);
+        break;
+    case NODE_POSTERIZE:
+        result = Effects::posterize_packed(src, results[NODE_PALETTE]);
+        break;
+    case NODE_OVERLAY: {
+        cv::Mat base = active[NODE_POSTERIZE] ? results[NODE_POSTERIZE] : src;
+        if (!active[NODE_EDGES] && !active[NODE_HALFTONE]) {
+            result = base;
+            break;
+        }
+        // Blank overlays stand in for disabled effects, kept across runs of the same size
+        if (no_edges.size() != src.size()) {
+            no_edges = cv::Mat::zeros(src.size(), CV_8UC1);
+            no_dots = cv::Mat::zeros(src.size(), CV_8UC3);
+        }
+        result = Effects::overlay(active[NODE_EDGES] ? results[NODE_EDGES] : no_edges,
+            active[NODE_HALFTONE] ? results[NODE_HALFTONE] : no_dots, base);
+        break;
+    }
+    case NODE_OUTPUT:
+        if (effect_options.scale == 1) {
+            result = results[NODE_OVERLAY];
+        } else {
+            cv::Mat overlay = results[NODE_OVERLAY];
+            cv::Size size(overlay.cols * effect_options.scale, overlay.rows * effect_options.scale);
+            cv::resize(overlay, result, size, 0, 0, effect_options.interpolation);
+        }
+        break;
+    default:
+        break;
+    }
+
+    pthread_mutex_lock(&mutex);
+    results[node] = result;
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Check whether a node runs with the current options
+ * @param node Effect node
+ * @return True unless pruned
+ */
+bool EffectGraph::enabled(EffectNode node) const { return active[node]; }
+
+/**
+ * Get the time a node took in the last run
+ * @param node Effect node
+ * @return Milliseconds, 0 for pruned nodes
+ */
+double EffectGraph::nodeMs(EffectNode node) const { return node_ms[node]; }
+
+/**
+ * Get the options
+ * @return Enabled effects
+ */
+const EffectOptions& EffectGraph::options() const { return effect_options; }
@@ -1,8 +1,18 @@
 #ifndef VRVISOR_CAPTURE_H
 #define VRVISOR_CAPTURE_H
 
+#include "recording.h"
+
 #include <opencv2/opencv.hpp>
 
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Earlier converted frames kept for reuse, so frame buffers are allocated and NUMA bound only at start
+#define CAPTURE_SPARE_FRAMES 3
+
 /**
  * Internal thread for ImageCapture to continuous capture images
  * @param arg ImageCapture* to parent object
@@ -16,28 +26,79 @@ static void* capture_thread(void* arg);
 struct Frame {
     cv::Mat image;
     size_t frame_num;
+    std::chrono::steady_clock::time_point captured; // When the camera frame was grabbed
+};
+
+/**
+ * Delivery counters of one consumer of an ImageCapture
+ */
+struct ConsumerStats {
+    std::string name;
+    size_t delivered; // Frames returned to this consumer
+    size_t skipped; // Frames captured between two deliveries that this consumer never saw
+    size_t stale; // Frames returned after a newer frame had already been captured
+    double mean_age_ms; // Mean time from capture to delivery
+    double max_age_ms; // Longest time from capture to delivery
 };
 
 /**
  * Object for continuously taking images from a VideoCapture
- *      and returning the latest image without blocking.
+ *      and returning the latest image without blocking. Camera frames are
+ *      stored raw and only converted when a consumer asks for them.
+ *      Frames can be recorded, or replayed from a recording in place of the camera.
  */
 class ImageCapture {
 public:
     /**
      * Construct with a given camera id
-     * @param id Camera id
+     * @param id Camera id, also the stream of the camera in recordings
+     * @param replay Recording to replay instead of opening the camera, or NULL
+     * @param recorder Recording to append raw camera frames to, or NULL
      */
-    ImageCapture(int id);
+    ImageCapture(int id, ReplayFile* replay = NULL, FrameRecorder* recorder = NULL);
 
     ~ImageCapture();
 
+    /**
+     * Register a consumer so its deliveries are counted separately
+     * @param name Name used in reports
+     * @param gating Whether a fast replay waits for this consumer to take every frame
+     * @return Consumer id to pass to getFrame
+     */
+    int addConsumer(const std::string& name, bool gating = true);
+
+    /**
+     * Stop waiting for a consumer that went away, its counters are still reported
+     * @param consumer Consumer id from addConsumer
+     */
+    void removeConsumer(int consumer);
+
     /**
      * Return the latest frame. Only block if a new frame isn't available.
+     *      The image is shared with other consumers and must not be modified.
      * @param lastFrame Frame id of last image returned
+     * @param consumer Consumer id from addConsumer, or -1 to not count the delivery
      * @return Next frame
      */
-    struct Frame getFrame(size_t lastFrame);
+    struct Frame getFrame(size_t lastFrame, int consumer = -1);
+
+    /**
+     * Check whether a replay has handed out its last frame
+     * @return True once the replay is over and every gating consumer has its last frame, always false for a camera
+     */
+    bool finished();
+
+    /**
+     * Get the delivery counters of every consumer
+     * @return Counters in addConsumer order
+     */
+    std::vector<ConsumerStats> consumerStats();
+
+    /**
+     * Print captured and converted frame counts and the counters of every consumer
+     * @param out Stream to print to
+     */
+    void report(std::ostream& out);
 
     /**
      * Stop internal thread and free VideoCapture
@@ -48,11 +109,38 @@ private:
     pthread_t thread;
 
 protected:
+    // Delivery counters and running age totals of one consumer
+    struct Consumer {
+        ConsumerStats stats;
+        size_t last_frame;
+        double age_sum_ms;
+        bool gating; // Paces a fast replay
+    };
+
+    /**
+     * Check whether every gating consumer has taken the latest frame, call with mutex held
+     * @return True if a fast replay may publish the next frame
+     */
+    bool consumersCaughtUp();
+
+    int id;
     cv::VideoCapture cap;
+    ReplayFile* replay;
+    FrameRecorder* recorder;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
-    cv::Mat image;
+    cv::Mat image; // Latest camera frame, not converted
+    std::chrono::steady_clock::time_point captured;
     size_t frame_num;
+    size_t captured_count; // Number of camera frames captured so far
+    cv::Mat converted; // Latest converted frame
+    std::vector<cv::Mat> spare; // Earlier converted frames, reused once no consumer holds them
+    size_t converted_num; // Frame id of converted
+    std::chrono::steady_clock::time_point converted_captured; // When converted was grabbed
+    size_t converted_count; // Number of frames converted so far
+    bool converting; // A consumer is converting a frame right now
+    std::vector<Consumer> consumers;
+    bool ended; // Replay ran out of frames
     bool stopped;
 
     friend void* capture_thread(void* arg);
@@ -0,0 +1,38 @@
+#ifndef VRVISOR_CONFIG_H
+#define VRVISOR_CONFIG_H
+
+#include <string>
+
+/**
+ * Read a string setting from the environment
+ * @param name Environment variable name
+ * @param fallback Value used if the variable is unset or empty
+ * @return Setting value
+ */
+std::string config_string(const char* name, const std::string& fallback);
+
+/**
+ * Read an integer setting from the environment
+ * @param name Environment variable name
+ * @param fallback Value used if the variable is unset or not a number
+ * @return Setting value
+ */
+int config_int(const char* name, int fallback);
+
+/**
+ * Read a floating point setting from the environment
+ * @param name Environment variable name
+ * @param fallback Value used if the variable is unset or not a number
+ * @return Setting value
+ */
+double config_double(const char* name, double fallback);
+
+/**
+ * Read a boolean setting from the environment. Accepts 1/0, true/false, yes/no and on/off.
+ * @param name Environment variable name
+ * @param fallback Value used if the variable is unset or not recognized
+ * @return Setting value
+ */
+bool config_bool(const char* name, bool fallback);
+
+#endif // VRVISOR_CONFIG_H
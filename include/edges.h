@@ -0,0 +1,82 @@
+#ifndef VRVISOR_EDGES_H
+#define VRVISOR_EDGES_H
+
+#include <string>
+
+// Sobel magnitude (|gx| + |gy|) a pixel must exceed to be an edge, out of 2040
+#define SOBEL_THRESHOLD 120
+
+// Difference of Gaussians a pixel must exceed to be an edge, in 1/256 gray levels
+#define DOG_THRESHOLD 768
+
+/**
+ * Edge detection engines, ordered from cheapest to most expensive
+ */
+enum EdgeEngine {
+    EDGES_SOBEL, // Single pass Sobel magnitude threshold
+    EDGES_XDOG, // Single pass difference of Gaussians threshold
+    EDGES_CANNY, // Blur and full Canny with hysteresis
+    EDGES_COUNT
+};
+
+/**
+ * Get the name of an edge engine
+ * @param engine Edge engine
+ * @return Name used by VRVISOR_EDGES
+ */
+const char* edge_engine_name(EdgeEngine engine);
+
+/**
+ * Look up an edge engine by name
+ * @param name canny, sobel or xdog
+ * @param fallback Engine used if the name is not recognized
+ * @return Edge engine
+ */
+EdgeEngine edge_engine_from_name(const std::string& name, EdgeEngine fallback);
+
+/**
+ * Read the edge engine from VRVISOR_EDGES, defaulting to Canny
+ * @return Edge engine
+ */
+EdgeEngine edge_engine_from_environment();
+
+/**
+ * Picks the edge engine for each frame of one stream. Uses the preferred engine while the
+ *      smoothed frame time fits the budget and steps down to cheaper engines while it does not.
+ *      Not thread safe, each stream owns its own controller.
+ */
+class QualityController {
+public:
+    /**
+     * @param preferred Engine to use while there is time for it
+     * @param budget_ms Frame time budget, 0 to always use the preferred engine
+     */
+    QualityController(EdgeEngine preferred, double budget_ms);
+
+    /**
+     * Create a controller from VRVISOR_EDGES and VRVISOR_FRAME_BUDGET_MS
+     * @return Quality controller
+     */
+    static QualityController fromEnvironment();
+
+    /**
+     * Get the engine to use for the next frame
+     * @return Edge engine
+     */
+    EdgeEngine engine() const;
+
+    /**
+     * Record the time of a frame and pick the engine for the next one
+     * @param frame_ms Frame time
+     */
+    void update(double frame_ms);
+
+private:
+    EdgeEngine preferred;
+    EdgeEngine current;
+    double budget_ms;
+    double average_ms;
+    int frames_since_change;
+};
+
+#endif // VRVISOR_EDGES_H
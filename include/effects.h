@@ -4,18 +4,68 @@
 #define NBHD_SIZE 9
 #define NUM_THREADS 4
 
+#include "edges.h"
+
 #include <opencv2/opencv.hpp>
 
 using namespace cv;
 
 class Effects {
 public:
+    /**
+     * Convert an image to gray once for every effect that needs it
+     * @param src Source Image
+     * @return Gray image
+     */
+    static Mat gray(Mat src);
+
     /**
      * Perform canny edge detection
      * @param src Source Image
+     * @param gray Gray src, or an empty Mat to convert src here
+     * @return Mat with detected edges
+     */
+    static Mat canny(Mat src, Mat gray = Mat());
+
+    /**
+     * Perform single pass Sobel magnitude edge detection
+     * @param src Source Image
+     * @return Mat with detected edges
+     */
+    static Mat sobel(Mat src);
+
+    /**
+     * Perform single pass difference of Gaussians edge detection
+     * @param src Source Image
      * @return Mat with detected edges
      */
-    static Mat canny(Mat src);
+    static Mat xdog(Mat src);
+
+    /**
+     * Perform edge detection with the chosen engine
+     * @param src Source Image
+     * @param engine Edge engine
+     * @param gray Gray src, or an empty Mat to convert src here
+     * @return Mat with detected edges
+     */
+    static Mat edges(Mat src, EdgeEngine engine, Mat gray = Mat());
+
+    // Struct to pass arguments to edge_thread
+    struct edge_args {
+        int start_index; // First row
+        int end_index; // Row after the last
+        EdgeEngine engine; // EDGES_SOBEL or EDGES_XDOG
+        Mat* src;
+        Mat* gray; // Gray src, or empty to convert each band
+        Mat* new_image;
+    };
+
+    /**
+     * Thread to threshold the edges of a band of rows
+     * @param arg edge_args*
+     * @return NULL
+     */
+    static void* edge_thread(void* arg);
 
     /**
      * Helper method for blurring an image
@@ -38,12 +88,28 @@ public:
      */
     static Mat posterize(Mat src, Mat centers);
 
+    /**
+     * Color an image using a packed palette
+     * @param src Source image
+     * @param colors 1 x k fixed point palette from palette()
+     * @return Posterized image
+     */
+    static Mat posterize_packed(Mat src, Mat colors);
+
+    /**
+     * Convert k-means centers to a packed fixed point palette. Centers on the grid of
+     *      snap_means() convert exactly, so each pixel goes to the center float distances pick.
+     * @param centers 3 x k float centers, one color per column
+     * @return 1 x k palette of KERNEL_CENTER_SCALE steps per level, CV_16SC3
+     */
+    static Mat palette(Mat centers);
+
     // Struct to pass arguments to posterize_thread
     struct posterize_args {
-        int start_index;
-        int end_index;
+        int start_index; // First row
+        int end_index; // Row after the last
         Mat* img;
-        Mat* centers;
+        Mat* centers; // Packed fixed point palette
         Mat* new_image;
     };
 
@@ -57,9 +123,10 @@ public:
     /**
      * Create halftone effect from an image
      * @param src Source image
+     * @param gray Gray src, or an empty Mat to convert src here
      * @return Image with halftone dots
      */
-    static Mat halftone(Mat src);
+    static Mat halftone(Mat src, Mat gray = Mat());
 
     // Struct to pass argument to halftone_thread
     struct halftone_args {
@@ -76,6 +143,16 @@ public:
      * @return NULL
      */
     static void* halftone_thread(void* arg);
+
+private:
+    /**
+     * Run a single pass edge engine over bands of rows in parallel
+     * @param src Source Image
+     * @param engine EDGES_SOBEL or EDGES_XDOG
+     * @param gray Gray src, or an empty Mat to convert each band
+     * @return Mat with detected edges
+     */
+    static Mat threshold_edges(Mat src, EdgeEngine engine, Mat gray);
 };
 
 #endif // VRVISOR_EFFECTS_H
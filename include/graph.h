@@ -0,0 +1,139 @@
+#ifndef VRVISOR_GRAPH_H
+#define VRVISOR_GRAPH_H
+
+#include "edges.h"
+#include "workers.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <string>
+
+/**
+ * Nodes of the effect graph, inputs always come before the nodes that read them
+ */
+enum EffectNode {
+    NODE_GRAY, // Source converted to gray, shared by edges and halftone
+    NODE_EDGES, // Edge overlay from the chosen engine
+    NODE_HALFTONE, // Halftone dots
+    NODE_PALETTE, // k-means centers rounded to a packed palette
+    NODE_POSTERIZE, // Source colored with the palette
+    NODE_OVERLAY, // Edges and dots drawn over the posterized source
+    NODE_OUTPUT, // Overlay scaled to the output size
+    NODE_COUNT
+};
+
+/**
+ * Get the name of an effect node
+ * @param node Effect node
+ * @return Short lowercase name
+ */
+const char* effect_node_name(EffectNode node);
+
+/**
+ * Which effects an EffectGraph runs and how
+ */
+struct EffectOptions {
+    bool edges;
+    bool halftone;
+    bool posterize;
+    double scale; // Output size relative to the source
+    int interpolation; // cv::resize interpolation for scale, INTER_NEAREST adds no colors
+
+    /**
+     * Every effect, output at source size
+     */
+    EffectOptions();
+
+    /**
+     * Read the enabled effects from VRVISOR_EFFECTS, a comma separated list of edges,
+     *      halftone and posterize, all by default
+     * @return Options
+     */
+    static EffectOptions fromEnvironment();
+};
+
+/**
+ * Dataflow graph of the comic book effects. Each node runs on the shared WorkerPool
+ *      as soon as its inputs are ready, nodes of disabled effects are never run and
+ *      the gray source is converted once for every effect that reads it.
+ */
+class EffectGraph {
+public:
+    /**
+     * @param options Enabled effects
+     */
+    EffectGraph(EffectOptions options);
+
+    ~EffectGraph();
+
+    /**
+     * Process one image. Not reentrant, use one graph per stream.
+     * @param src Source image
+     * @param means 3 x k k-means centers
+     * @param engine Edge engine for this frame
+     * @return Comic book image
+     * @throws cv::Exception thrown by any node
+     */
+    cv::Mat run(cv::Mat src, cv::Mat means, EdgeEngine engine);
+
+    /**
+     * Check whether a node runs with the current options
+     * @param node Effect node
+     * @return True unless pruned
+     */
+    bool enabled(EffectNode node) const;
+
+    /**
+     * Get the time a node took in the last run
+     * @param node Effect node
+     * @return Milliseconds, 0 for pruned nodes
+     */
+    double nodeMs(EffectNode node) const;
+
+    /**
+     * Get the options
+     * @return Enabled effects
+     */
+    const EffectOptions& options() const;
+
+private:
+    // Argument of node_thread
+    struct node_args {
+        EffectGraph* graph;
+        EffectNode node;
+    };
+
+    /**
+     * Compute one node from its inputs
+     * @param node Effect node
+     */
+    void compute(EffectNode node);
+
+    /**
+     * Queue the nodes whose inputs are all ready, call with mutex held
+     * @param done Node that just finished, or NODE_COUNT to start a run
+     */
+    void release(EffectNode done);
+
+    EffectOptions effect_options;
+    unsigned inputs[NODE_COUNT]; // Bit mask of the nodes each node reads
+    bool active[NODE_COUNT]; // Not pruned
+    struct node_args args[NODE_COUNT];
+
+    // State of the current run
+    pthread_mutex_t mutex;
+    TaskGroup group;
+    unsigned finished; // Bit mask of finished nodes
+    unsigned queued; // Bit mask of queued nodes
+    bool failed; // A node threw, nothing after it runs
+    cv::Exception error;
+    cv::Mat src, means;
+    EdgeEngine engine;
+    cv::Mat results[NODE_COUNT];
+    double node_ms[NODE_COUNT];
+    cv::Mat no_edges, no_dots; // Stand ins for disabled overlays
+
+    friend void* node_thread(void* arg);
+};
+
+#endif // VRVISOR_GRAPH_H
@@ -0,0 +1,156 @@
+#ifndef VRVISOR_INDEXED_H
+#define VRVISOR_INDEXED_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Compact palette indexed frame format for recording and transport. A finished frame
+ *      holds few colors: the k posterize colors, black edges and the halftone dots. Each
+ *      frame is stored as a palette of up to 256 colors and one index per pixel, with
+ *      the indices run length coded against the row above and the previous frame:
+ *
+ *      IndexedHeader
+ *      Palette, colors x BGR bytes
+ *      Ops, stream_size bytes      (pixels in raster order)
+ *
+ *      Every op is one byte, the top two bits pick the op and the low six bits hold the
+ *      pixel count minus one. A count field of 63 means 64 plus a LEB128 number that follows.
+ *      The palette holds the most common colors of the frame, so the posterized colors are
+ *      always exact; only frames with more than 256 colors map their rarest colors, usually
+ *      halftone dots, to the nearest palette color.
+ */
+
+#define INDEXED_MAGIC "VRVPAL1"
+#define INDEXED_MAX_COLORS 256
+
+// Ops, in the top two bits of each op byte
+#define INDEXED_OP_RUN 0 // Count pixels of the index in the next byte
+#define INDEXED_OP_LITERAL 1 // Count indices follow
+#define INDEXED_OP_ABOVE 2 // Count pixels repeat the indices of the row above
+#define INDEXED_OP_PREVIOUS 3 // Count pixels keep the indices of the previous frame
+
+// Bits of IndexedHeader::flags
+#define INDEXED_DELTA 1 // Uses INDEXED_OP_PREVIOUS, the previous frame must have been decoded
+#define INDEXED_EXACT 2 // Every pixel has its exact color
+
+struct IndexedHeader {
+    char magic[8];
+    int32_t rows, cols;
+    uint32_t colors; // Palette entries, 1 to 256
+    uint32_t flags;
+    uint64_t stream_size; // Bytes of ops after the palette
+};
+
+static_assert(sizeof(IndexedHeader) == 32, "headers are stored as is");
+
+/**
+ * Turns BGR frames into palette indexed frames. Palette slots of colors that stay in
+ *      the picture are kept from frame to frame, so unchanged pixels keep their index
+ *      and delta frames only code what moved.
+ */
+class IndexedEncoder {
+public:
+    IndexedEncoder();
+
+    /**
+     * Encode a frame
+     * @param bgr Top left BGR pixel
+     * @param rows Frame height
+     * @param cols Frame width
+     * @param step Bytes between rows
+     * @param delta Code against the previous frame of this encoder if it has the same size
+     * @param out Set to the encoded frame
+     * @return True if every pixel kept its exact color
+     */
+    bool encode(const uint8_t* bgr, int rows, int cols, size_t step, bool delta, std::vector<uint8_t>& out);
+
+    /**
+     * Forget the previous frame and palette
+     */
+    void reset();
+
+    /**
+     * Get the largest possible encoded size of a frame
+     * @param rows Frame height
+     * @param cols Frame width
+     * @return Bytes
+     */
+    static size_t maxSize(int rows, int cols);
+
+private:
+    /**
+     * Find a color in the hash table, adding it if there is room
+     * @param color Packed BGR color
+     * @param insert Add the color if it is missing
+     * @return Table position, or -1 if missing
+     */
+    long find(uint32_t color, bool insert);
+
+    /**
+     * Count the colors of a frame and choose the palette
+     * @return True if the palette holds every color
+     */
+    bool choosePalette(const uint8_t* bgr, int rows, int cols, size_t step);
+
+    /**
+     * Find the nearest palette color, the lowest index wins ties
+     * @param color Packed BGR color
+     * @return Palette index
+     */
+    uint8_t nearest(uint32_t color) const;
+
+    // Open addressing table of the colors of the current frame
+    std::vector<uint32_t> keys; // Color + 1, 0 for empty
+    std::vector<uint32_t> counts;
+    std::vector<uint16_t> slots; // Palette index of each color
+    std::vector<uint32_t> used; // Positions filled this frame
+
+    uint32_t palette[INDEXED_MAX_COLORS]; // Packed BGR colors
+    int palette_size;
+    std::vector<uint8_t> indices, previous;
+    int previous_rows, previous_cols; // Size of previous, 0 without one
+};
+
+/**
+ * Turns palette indexed frames back into BGR. Keeps the indices of the last frame for
+ *      delta frames; expanding indices to colors uses the SIMD kernels.
+ */
+class IndexedDecoder {
+public:
+    IndexedDecoder();
+
+    /**
+     * Read the header of an encoded frame
+     * @param data Encoded frame
+     * @param size Bytes available
+     * @param header Set to the header
+     * @return False if this is not a complete encoded frame
+     */
+    static bool peek(const uint8_t* data, size_t size, IndexedHeader& header);
+
+    /**
+     * Decode a frame
+     * @param data Encoded frame
+     * @param size Bytes available
+     * @param bgr Top left BGR pixel of a bgr_rows x bgr_cols frame, or NULL to only follow a delta chain
+     * @param bgr_rows Height of bgr, the frame must have this size
+     * @param bgr_cols Width of bgr
+     * @param step Bytes between rows of bgr
+     * @return False if the frame is corrupt, has another size, or is a delta frame without its previous frame
+     */
+    bool decode(const uint8_t* data, size_t size, uint8_t* bgr, int bgr_rows, int bgr_cols, size_t step);
+
+    /**
+     * Forget the previous frame, only frames without INDEXED_DELTA decode until the next one
+     */
+    void reset();
+
+private:
+    std::vector<uint8_t> indices;
+    int rows, cols; // Size of indices, 0 without a previous frame
+    alignas(64) uint8_t palette[4 * INDEXED_MAX_COLORS]; // BGR and one unused byte per color, for the expand kernel
+};
+
+#endif // VRVISOR_INDEXED_H
@@ -0,0 +1,138 @@
+#ifndef VRVISOR_KERNELS_H
+#define VRVISOR_KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Table of the hot per-pixel kernels for one instruction set. Pixels stay 8 bit and all
+ *      arithmetic is integer, so every table produces bit-identical results to the scalar table.
+ */
+struct KernelTable {
+    // Name used for reporting and by the VRVISOR_KERNELS override
+    const char* name;
+
+    /**
+     * Replace each pixel with the color of the nearest center. Distances are exact integers and the
+     *      lowest index wins ties.
+     * @param src n BGR pixels
+     * @param dst n BGR pixels, each the center_colors() color of its center
+     * @param n Number of pixels
+     * @param centers k fixed point BGR centers, 0 to KERNEL_CENTER_MAX
+     * @param k Number of centers
+     */
+    void (*posterize)(const uint8_t* src, uint8_t* dst, size_t n, const int16_t* centers, int k);
+
+    /**
+     * Sum the intensity of a row of square cells
+     * @param gray Top left pixel of the first cell
+     * @param step Bytes between image rows
+     * @param cells Number of cells side by side
+     * @param size Width and height of a cell in pixels
+     * @param sums Sum of each cell
+     */
+    void (*cell_sums)(const uint8_t* gray, size_t step, int cells, int size, uint32_t* sums);
+
+    /**
+     * Combine edges, halftone dots and posterized pixels. Posterized pixels only show
+     *      where there is no edge and no dot.
+     * @param edges n edge mask values, non-zero on an edge
+     * @param halftone n BGR halftone pixels
+     * @param posterized n BGR posterized pixels
+     * @param dst n BGR combined pixels
+     * @param n Number of pixels
+     */
+    void (*overlay)(const uint8_t* edges, const uint8_t* halftone, const uint8_t* posterized, uint8_t* dst, size_t n);
+
+    /**
+     * k-means assignment step: add each sample to the sum of its nearest center
+     * @param samples n BGR samples
+     * @param n Number of samples
+     * @param centers k fixed point BGR centers, 0 to KERNEL_CENTER_MAX
+     * @param k Number of centers
+     * @param sums k sums of 3 channels to add to
+     * @param counts k sample counts to add to
+     */
+    void (*assign)(const uint8_t* samples, size_t n, const int16_t* centers, int k, uint32_t* sums, int32_t* counts);
+
+    /**
+     * Threshold the 3x3 Sobel gradient magnitude |gx| + |gy| of one row, the same magnitude Canny uses
+     * @param rows Three gray rows, the middle one is the row to threshold
+     * @param dst n edge mask values, 255 on an edge. The first and last pixel are never edges.
+     * @param n Row width in pixels
+     * @param threshold Magnitude threshold, 0 to 2040
+     */
+    void (*sobel)(const uint8_t* const* rows, uint8_t* dst, size_t n, int threshold);
+
+    /**
+     * Threshold the difference of Gaussians of one row. A pixel is an edge where its 5x5 binomial blur
+     *      is brighter than its 3x3 binomial blur by more than threshold, which marks the dark side of edges.
+     * @param rows Five gray rows, the middle one is the row to threshold
+     * @param dst n edge mask values, 255 on an edge. The first and last two pixels are never edges.
+     * @param n Row width in pixels
+     * @param threshold Difference threshold in 1/256 gray levels, at least 0
+     */
+    void (*dog)(const uint8_t* const* rows, uint8_t* dst, size_t n, int threshold);
+
+    /**
+     * Look up the color of each palette index, for decoding indexed frames
+     * @param indices n palette indices
+     * @param dst n BGR pixels
+     * @param n Number of pixels
+     * @param palette 256 colors of 4 bytes, BGR and one unused byte
+     */
+    void (*expand)(const uint8_t* indices, uint8_t* dst, size_t n, const uint8_t* palette);
+};
+
+// Largest number of colors the kernels support
+#define KERNEL_MAX_COLORS 64
+
+// Centers are fixed point with 4 fractional bits. Pixels are scaled to match, so differences fit
+//      16 bits and squared distances 32 bits, and are exact for any center on this grid.
+#define KERNEL_CENTER_BITS 4
+#define KERNEL_CENTER_SCALE (1 << KERNEL_CENTER_BITS)
+#define KERNEL_CENTER_MAX (255 * KERNEL_CENTER_SCALE)
+
+// Fixed point weights cvtColor uses for BGR to gray, gray = (b * B + g * G + r * R + 2^13) >> 14
+#define GRAY_WEIGHT_B 1868
+#define GRAY_WEIGHT_G 9617
+#define GRAY_WEIGHT_R 4899
+
+// A halftone pixel is a dot if its gray value is above 1, i.e. its weighted sum reaches 24576
+#define DOT_WEIGHT_THRESHOLD 24576
+
+extern const KernelTable scalar_kernels;
+#ifdef VRVISOR_HAVE_AVX2
+extern const KernelTable avx2_kernels;
+#endif
+#ifdef VRVISOR_HAVE_AVX512
+extern const KernelTable avx512_kernels;
+#endif
+#ifdef VRVISOR_HAVE_NEON
+extern const KernelTable neon_kernels;
+#endif
+
+/**
+ * Round fixed point centers to the colors posterize writes
+ * @param centers k fixed point BGR centers
+ * @param k Number of centers
+ * @param colors k BGR colors
+ */
+void center_colors(const int16_t* centers, int k, uint8_t* colors);
+
+/**
+ * Get the kernels for this CPU. The best supported table is chosen on first use
+ *      unless VRVISOR_KERNELS names another supported table.
+ * @return Selected kernels
+ */
+const KernelTable& kernels();
+
+/**
+ * Get every kernel table this CPU can run, scalar first
+ * @param tables Array to fill
+ * @param max_tables Size of tables
+ * @return Number of tables
+ */
+size_t supported_kernels(const KernelTable** tables, size_t max_tables);
+
+#endif // VRVISOR_KERNELS_H
@@ -4,6 +4,7 @@
 #include "capture.h"
 
 #include <opencv2/opencv.hpp>
+#include <string>
 
 /**
  * Forward definition of kmeans algorithm to allow multiple implementations
@@ -15,6 +16,15 @@
  */
 extern cv::Mat kmeans(cv::Mat src, cv::Mat means, size_t k, size_t max_iterations);
 
+/**
+ * Round means to the fixed point grid of the posterize kernels, KERNEL_CENTER_SCALE steps
+ *      per level, and clamp them to 0 to 255. Posterize then assigns every pixel to the
+ *      mean float distances would pick.
+ * @param means 3 x k float means
+ * @return 3 x k float means on the grid
+ */
+cv::Mat snap_means(cv::Mat means);
+
 /**
  * Thread to continuously calculate color set
  * @param arg Kmeans* to parent object
@@ -22,20 +32,43 @@ extern cv::Mat kmeans(cv::Mat src, cv::Mat means, size_t k, size_t max_iteration
  */
 static void* kmeans_thread(void* arg);
 
+/**
+ * Where the means returned by Kmeans::getMeans came from
+ */
+enum PaletteSource {
+    PALETTE_FALLBACK, // Fixed gray ramp, nothing else is available yet
+    PALETTE_CACHED, // Saved by a previous run
+    PALETTE_FRESH, // Calculated from this run's frames
+};
+
 class Kmeans {
 public:
+    /**
+     * Start with the cached palette, or a fallback palette if there is none, and start
+     *      calculating fresh means in the background
+     * @param k Number of discrete colors
+     * @param num_iterations Iterations per frame
+     * @param src Source of frames
+     */
     Kmeans(int k, int num_iterations, ImageCapture* src);
 
     ~Kmeans();
 
     /**
-     * Get latest calculated means
+     * Get latest calculated means without blocking. Until the first means are calculated
+     *      this is the cached or fallback palette.
      * @return Latest means
      */
     cv::Mat getMeans();
 
     /**
-     * Stop internal thread
+     * Get where the latest means came from
+     * @return Palette source
+     */
+    PaletteSource getSource();
+
+    /**
+     * Stop internal thread and save fresh means to the palette cache
      */
     void stop();
 
@@ -46,10 +79,13 @@ protected:
     const int k;
     const int num_iterations;
     ImageCapture* src;
+    const int consumer; // Consumer id in src
 
     pthread_mutex_t mutex;
     pthread_cond_t cond;
     cv::Mat means;
+    PaletteSource source;
+    std::string cache_path;
     bool stopped;
 
     friend void* kmeans_thread(void* arg);
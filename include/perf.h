@@ -0,0 +1,121 @@
+#ifndef VRVISOR_PERF_H
+#define VRVISOR_PERF_H
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+
+/**
+ * Hardware events counted for each stage
+ */
+enum PerfEvent { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_LLC_MISSES, PERF_BRANCH_MISSES, PERF_EVENT_COUNT };
+
+/**
+ * Event counts and CPU time of one thread over some interval
+ */
+struct PerfCounts {
+    uint64_t events[PERF_EVENT_COUNT];
+    double ms; // CPU time of the thread, time it waits or is preempted does not count
+    uint64_t enabled, running; // Nanoseconds the counters were enabled and actually counting, for multiplexing
+};
+
+/**
+ * Totals of one stage over every thread and frame
+ */
+struct PerfStage {
+    size_t calls;
+    size_t pixels; // Pixels the stage was called for, for per pixel rates
+    PerfCounts counts;
+    size_t runs; // Runs with a wall clock latency, for effect graph nodes
+    double latency_ms; // Their total latency, from start to finish including waits
+};
+
+/**
+ * Optional hardware counter profiling, enabled with VRVISOR_PERF. Every thread opens
+ *      its own perf_event_open group the first time it enters a PerfScope. Where
+ *      counters cannot be opened, for example in containers, only CPU time is recorded.
+ */
+class Perf {
+public:
+    /**
+     * Check whether profiling is on
+     * @return True if VRVISOR_PERF is set
+     */
+    static bool enabled();
+
+    /**
+     * Count a finished frame, stage totals are reported per frame
+     */
+    static void countFrame();
+
+    /**
+     * Add the counts of one scope to a stage, called by PerfScope
+     * @param stage Stage name
+     * @param pixels Pixels processed, 0 if counted by another scope of the stage
+     * @param counts Event counts and time of the scope
+     */
+    static void record(const char* stage, size_t pixels, const PerfCounts& counts);
+
+    /**
+     * Add the wall clock latency of one run of a stage, reported next to its CPU time
+     * @param stage Stage name
+     * @param ms Milliseconds from start to finish of the run
+     */
+    static void recordLatency(const char* stage, double ms);
+
+    /**
+     * Read the counters of the calling thread. Events are raw, unscaled totals: scale the
+     *      difference of two reads by the differences of enabled and running.
+     * @param counts Set to the running totals of this thread
+     * @return False if this thread has no counters, counts then only has the CPU time
+     */
+    static bool read(PerfCounts& counts);
+
+    /**
+     * Print CPU time, latency, IPC and misses per pixel of every stage
+     * @param out Stream to print to
+     */
+    static void report(std::ostream& out);
+
+private:
+    static pthread_mutex_t mutex;
+    static std::map<std::string, PerfStage> stages;
+    static size_t frames;
+    static bool counters_seen; // Some thread opened counters
+};
+
+/**
+ * Counts the events of the calling thread from construction to destruction towards a
+ *      stage. Scopes nest: while an inner scope is open the outer one is paused, so each
+ *      event is counted towards exactly one stage.
+ */
+class PerfScope {
+public:
+    /**
+     * Start counting
+     * @param stage Stage name, must outlive the scope
+     * @param pixels Pixels processed, 0 if counted by another scope of the stage
+     */
+    PerfScope(const char* stage, size_t pixels = 0);
+
+    ~PerfScope();
+
+private:
+    /**
+     * Add the counts since the last mark to this scope and move the mark to now
+     */
+    void pause();
+
+    const char* stage;
+    size_t pixels;
+    bool active;
+    PerfCounts mark; // Thread counts when this scope last resumed
+    PerfCounts total; // Counts of this scope so far
+    PerfScope* parent; // Enclosing scope on this thread
+};
+
+#endif // VRVISOR_PERF_H
@@ -2,58 +2,11 @@
 #define VRVISOR_PIPELINE_H
 
 #include "capture.h"
+#include "edges.h"
+#include "graph.h"
 #include "kmeans.h"
 #include <opencv2/opencv.hpp>
 
-static cv::Mat process_image(cv::Mat src);
-
-static void* pipeline_thread(void* arg);
-
-struct canny_thread_args {
-    cv::Mat* src;
-    cv::Mat* result;
-};
-
-/**
- * Thread for performing Canny edge detection asynchronously
- * @param arg canny_thread_args*
- * @return NULL
- */
-static void* canny_thread(void* arg);
-
-struct halftone_thread_args {
-    cv::Mat* src;
-    cv::Mat* result;
-};
-
-/**
- * Thread for performing Halftone asynchronously
- * @param arg halftone_thread_args*
- * @return NULL
- */
-static void* halftone_thread(void* arg);
-
-struct posterized_thread_args {
-    cv::Mat* src;
-    cv::Mat* centers;
-    cv::Mat* result;
-};
-
-/**
- * Thread for performing posterize asynchronously
- * @param arg posterized_thread_args*
- * @return NULL
- */
-static void* posterized_thread(void* arg);
-
-/**
- * Process image with Canny, Halftone, and Posterize all asynchronously
- * @param src Source Image
- * @param means Discrete colors
- * @return Comicbook image
- */
-static cv::Mat process_image(cv::Mat src, cv::Mat means);
-
 /**
  * Thread for processing an image asynchronously
  * @param arg Pipeline* to parent object
@@ -66,7 +19,13 @@ static void* pipeline_thread(void* arg);
  */
 class Pipeline {
 public:
-    Pipeline(ImageCapture* capture, Kmeans* kmeans_src);
+    /**
+     * @param capture Source of frames
+     * @param kmeans_src Source of discrete colors
+     * @param quality Chooses the edge engine of this stream
+     * @param options Enabled effects
+     */
+    Pipeline(ImageCapture* capture, Kmeans* kmeans_src, QualityController quality, EffectOptions options);
 
     ~Pipeline();
 
@@ -76,21 +35,44 @@ public:
     void start();
 
     /**
-     * Wait for latest processing image
+     * Wait for latest processing image. Throws the exception processing it raised, once.
      * @return Processed image
      */
     cv::Mat join();
 
+    /**
+     * Get what the latest processed image was made from, call after join
+     * @param captured Set to when its camera frame was grabbed
+     * @param process_ms Set to the time spent processing it
+     * @param node_ms Set to the time each effect node took on it, NODE_COUNT entries, 0 for pruned nodes, may be NULL
+     * @return Its capture frame number
+     */
+    size_t lastFrame(std::chrono::steady_clock::time_point& captured, double& process_ms, double* node_ms = NULL);
+
 private:
+    /**
+     * Process the latest frame and hand the result to join(), called by the pipeline thread
+     */
+    void process();
+
     ImageCapture* capture;
+    int consumer; // Consumer id in capture
     Kmeans* kmeans_src;
+    QualityController quality;
+    EffectGraph graph;
     cv::Mat result;
     int last_frame;
+    std::chrono::steady_clock::time_point captured; // When the camera frame of result was grabbed
+    double process_ms; // Time spent processing result
+    double node_ms[NODE_COUNT]; // Time each effect node spent on result
 
     pthread_t thread;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
-    bool running;
+    bool running; // A frame is asked for or being processed
+    bool stopped; // Thread exits once no frame is asked for
+    bool failed; // Processing threw error, join() rethrows it
+    cv::Exception error;
 
     friend void* pipeline_thread(void* arg);
 };
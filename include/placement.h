@@ -0,0 +1,72 @@
+#ifndef VRVISOR_PLACEMENT_H
+#define VRVISOR_PLACEMENT_H
+
+#include <opencv2/opencv.hpp>
+#include <ostream>
+#include <sched.h>
+
+/**
+ * Kinds of threads that can be placed on their own set of CPUs
+ */
+enum ThreadRole { ROLE_CAPTURE, ROLE_KMEANS, ROLE_RENDER, ROLE_COUNT };
+
+/**
+ * Struct describing where and how threads of each role should run
+ */
+struct PlacementPolicy {
+    cpu_set_t cpus[ROLE_COUNT]; // CPUs each role may run on
+    bool pinned[ROLE_COUNT]; // Whether the role is restricted to cpus
+    int nice[ROLE_COUNT]; // Niceness of each role, 0 leaves it unchanged
+    bool render_fifo; // Run render threads with SCHED_FIFO
+    int render_priority; // SCHED_FIFO priority for render threads
+    bool numa; // Allocate converted capture frames on the render threads' NUMA node
+};
+
+/**
+ * Process wide CPU placement. Threads call apply() with their role when they start,
+ *      threads they create inherit the same affinity and scheduling.
+ */
+class Placement {
+public:
+    /**
+     * Build a policy from VRVISOR_* environment variables:
+     *      VRVISOR_PLACEMENT=auto splits the available CPUs between roles,
+     *      VRVISOR_{CAPTURE,KMEANS,RENDER}_CPUS take CPU lists such as "0-3,6",
+     *      VRVISOR_{CAPTURE,KMEANS,RENDER}_NICE set niceness,
+     *      VRVISOR_RENDER_SCHED=fifo and VRVISOR_RENDER_PRIORITY select real-time render threads,
+     *      VRVISOR_NUMA=1 places converted capture frames on the render CPUs' node.
+     * @return Policy
+     */
+    static PlacementPolicy fromEnvironment();
+
+    /**
+     * Set the policy used by all later calls to apply()
+     * @param new_policy New policy
+     */
+    static void configure(const PlacementPolicy& new_policy);
+
+    /**
+     * Move the calling thread onto the CPUs and scheduling class of its role
+     * @param role Role of the calling thread
+     */
+    static void apply(ThreadRole role);
+
+    /**
+     * Allocate a converted capture frame, preferring memory local to the render CPUs if NUMA placement is enabled
+     * @param mat Mat to allocate
+     * @param size Frame size
+     * @param type Frame type
+     */
+    static void allocateFrame(cv::Mat& mat, cv::Size size, int type);
+
+    /**
+     * Print the configured placement of each role
+     * @param out Stream to print to
+     */
+    static void report(std::ostream& out);
+
+private:
+    static PlacementPolicy policy;
+};
+
+#endif // VRVISOR_PLACEMENT_H
@@ -0,0 +1,112 @@
+#ifndef VRVISOR_PRESENTER_H
+#define VRVISOR_PRESENTER_H
+
+#include <opencv2/opencv.hpp>
+
+#include <chrono>
+#include <ostream>
+#include <string>
+
+/**
+ * Where presented frames go
+ */
+enum PresenterBackend {
+    PRESENTER_WINDOW, // Fullscreen HighGUI window
+    PRESENTER_NULL, // Frames are only counted, for running headless
+};
+
+/**
+ * Presenter settings
+ */
+struct PresenterOptions {
+    PresenterBackend backend;
+    double fps; // Target refresh rate
+};
+
+/**
+ * Presenter counters
+ */
+struct PresenterStats {
+    size_t submitted; // Frames handed to the presenter
+    size_t presented; // Frames shown
+    size_t dropped; // Frames replaced by a newer frame before they were shown
+    size_t idle_ticks; // Refreshes with no new frame to show
+    double mean_interval_ms; // Mean time between shown frames
+    double jitter_ms; // Standard deviation of the time between shown frames
+    double max_interval_ms; // Longest time between shown frames
+    double startup_ms; // Time from process start to the first shown frame
+};
+
+/**
+ * Object owning the display. A dedicated thread shows the newest submitted frame once per
+ *      refresh, so display and GUI events never stall the thread producing frames.
+ */
+class Presenter {
+public:
+    /**
+     * Create the presenter and start its thread
+     * @param name Window name
+     * @param options Backend and refresh rate
+     */
+    Presenter(const std::string& name, const PresenterOptions& options);
+
+    ~Presenter();
+
+    /**
+     * Read options from VRVISOR_DISPLAY (window or null) and VRVISOR_DISPLAY_FPS
+     * @return Presenter options
+     */
+    static PresenterOptions fromEnvironment();
+
+    /**
+     * Hand over a completed frame without waiting for the display. Replaces any frame
+     *      that has not been shown yet. The frame must not be modified afterwards.
+     * @param frame Completed frame
+     */
+    void submit(cv::Mat frame);
+
+    /**
+     * Check whether the user asked to quit by pressing ESC
+     * @return True once ESC was pressed
+     */
+    bool closed();
+
+    /**
+     * Get a snapshot of the counters
+     * @return Presenter counters
+     */
+    PresenterStats stats();
+
+    /**
+     * Print the counters
+     * @param out Stream to print to
+     */
+    void report(std::ostream& out);
+
+    /**
+     * Stop internal thread and close the window
+     */
+    void stop();
+
+private:
+    pthread_t thread;
+
+protected:
+    const std::string name;
+    const PresenterOptions options;
+
+    pthread_mutex_t mutex;
+    cv::Mat pending;
+    bool has_pending;
+    bool stopped;
+    bool escaped;
+
+    PresenterStats counters;
+    std::chrono::steady_clock::time_point last_present;
+    double interval_sum_ms;
+    double interval_square_sum_ms;
+
+    friend void* presenter_thread(void* arg);
+};
+
+#endif // VRVISOR_PRESENTER_H
@@ -0,0 +1,159 @@
+#ifndef VRVISOR_PROTOCOL_H
+#define VRVISOR_PROTOCOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Wire format of the render daemon. Clients connect to a UNIX stream socket and send
+ *      any number of requests without waiting for replies:
+ *
+ *      RenderRequest, payload      (payload_size bytes)
+ *
+ *      The daemon answers every request with a RenderReply and its payload, in the
+ *      order requests finish rather than the order they were sent; the id ties them
+ *      together. Numbers are in host byte order, both ends run on the same machine.
+ */
+
+#define RENDER_REQUEST_MAGIC "VRVREQ1"
+#define RENDER_REPLY_MAGIC "VRVREP1"
+#define RENDER_SOCKET "/tmp/vrvisor-renderd.sock"
+
+// Effect bits of RenderRequest::effects
+#define RENDER_EFFECT_EDGES 1
+#define RENDER_EFFECT_HALFTONE 2
+#define RENDER_EFFECT_POSTERIZE 4
+
+// Bits of RenderRequest::flags
+#define RENDER_FLAG_COLD_PALETTE 1 // Seed k-means with k-means++ instead of the warm palette for k
+
+/**
+ * What a request asks for
+ */
+enum RenderOp {
+    RENDER_OP_RENDER, // Render an image
+    RENDER_OP_STATS, // Return the daemon's counters as text
+};
+
+/**
+ * How the image of a render request is passed
+ */
+enum RenderInput {
+    RENDER_INPUT_PATH, // Payload is a file path the daemon reads
+    RENDER_INPUT_ENCODED, // Payload is an encoded image, e.g. the bytes of a JPEG file
+    RENDER_INPUT_RAW, // Payload is raw_rows x raw_cols BGR pixels, rows back to back
+};
+
+/**
+ * How the result of a render request is returned
+ */
+enum RenderOutput {
+    RENDER_OUTPUT_ENCODED, // Payload is the result encoded as format
+    RENDER_OUTPUT_SHM, // Payload is the name of a shared memory object with raw pixels, the client unlinks it
+};
+
+/**
+ * Outcome of a request
+ */
+enum RenderStatus {
+    RENDER_OK,
+    RENDER_BAD_REQUEST, // Malformed request, the payload has the reason
+    RENDER_BAD_INPUT, // Image could not be read or decoded
+    RENDER_FAILED, // Rendering or encoding failed, the payload has the reason
+    RENDER_BUSY, // Queue full, try again later
+    RENDER_STATUS_COUNT
+};
+
+struct RenderRequest {
+    char magic[8];
+    uint32_t id; // Echoed in the reply
+    uint16_t op; // RenderOp
+    uint16_t input; // RenderInput
+    uint16_t output; // RenderOutput
+    uint16_t flags; // RENDER_FLAG_*
+    uint16_t k; // Number of colors, 0 for 8
+    uint16_t iterations; // k-means iterations, 0 for 100
+    uint16_t effects; // RENDER_EFFECT_* bits, 0 for the daemon's VRVISOR_EFFECTS
+    int16_t engine; // EdgeEngine, -1 for the daemon's VRVISOR_EDGES
+    uint16_t scale; // Output size relative to the input, 0 for the daemon's default
+    uint16_t quality; // JPEG quality, 0 for the encoder's default
+    int32_t width, height; // Resize the input to this size first, 0 to keep its size
+    char format[8]; // Encoded output format as a file extension, e.g. .jpg or .png
+    uint64_t payload_size;
+    int32_t raw_rows, raw_cols; // Size of RENDER_INPUT_RAW images
+};
+
+struct RenderReply {
+    char magic[8];
+    uint32_t id; // Id of the request
+    uint16_t status; // RenderStatus
+    uint16_t batch; // Requests rendered together with this one
+    int32_t rows, cols, type; // Result image
+    uint32_t queue_depth; // Requests still queued when this one was taken
+    float queue_ms; // Time from receiving the request until rendering started
+    float render_ms; // Time spent decoding, rendering and encoding
+    float total_ms; // Time from receiving the request until the reply was ready
+    uint32_t reserved;
+    uint64_t payload_size;
+    uint64_t reserved2;
+};
+
+static_assert(sizeof(RenderRequest) == 64, "requests are sent as is");
+static_assert(sizeof(RenderReply) == 64, "replies are sent as is");
+
+/**
+ * Make a request with the magic set and every option at its default
+ * @param op RenderOp
+ * @param id Request id
+ * @return Request
+ */
+RenderRequest render_request(RenderOp op, uint32_t id);
+
+/**
+ * Make a reply with the magic set
+ * @param id Request id
+ * @param status RenderStatus
+ * @return Reply
+ */
+RenderReply render_reply(uint32_t id, RenderStatus status);
+
+/**
+ * Get the name of a status
+ * @param status RenderStatus
+ * @return Short lowercase name
+ */
+const char* render_status_name(int status);
+
+/**
+ * Get the daemon's socket path from VRVISOR_RENDERD_SOCKET, RENDER_SOCKET by default
+ * @return Socket path
+ */
+std::string render_socket_path();
+
+/**
+ * Connect to the daemon
+ * @param path Socket path
+ * @return Connected socket, or -1 with errno set
+ */
+int render_connect(const std::string& path);
+
+/**
+ * Read exactly size bytes, retrying short reads
+ * @param fd Socket
+ * @param data Buffer
+ * @param size Bytes to read
+ * @return False on error or end of stream
+ */
+bool read_full(int fd, void* data, size_t size);
+
+/**
+ * Write exactly size bytes, retrying short writes. Never raises SIGPIPE.
+ * @param fd Socket
+ * @param data Bytes to write
+ * @param size Bytes to write
+ * @return False on error
+ */
+bool write_full(int fd, const void* data, size_t size);
+
+#endif // VRVISOR_PROTOCOL_H
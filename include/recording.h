@@ -0,0 +1,293 @@
+#ifndef VRVISOR_RECORDING_H
+#define VRVISOR_RECORDING_H
+
+#include "indexed.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <sys/uio.h>
+#include <vector>
+
+/**
+ * Frame recording container. Everything is 64 byte aligned so frames can be used
+ *      straight from a memory mapping:
+ *
+ *      RecordingHeader
+ *      FrameRecord, frame data, padding      (one per frame, in capture order)
+ *      RecordingIndexEntry[index_count]
+ *      RecordingFooter
+ *
+ *      A recording that was not closed has no index or footer, replay then scans the
+ *      frame records instead. Frame data is raw pixel rows, or for recordings of
+ *      rendered output a palette indexed frame (indexed.h) that may build on the
+ *      previous frame of its stream back to the last key frame.
+ */
+
+#define RECORDING_MAGIC "VRVREC1"
+#define RECORDING_FOOTER_MAGIC "VRVIDX1"
+#define RECORDING_FRAME_MAGIC 0x52465256 // "VRFR"
+#define RECORDING_ALIGNMENT 64
+#define RECORDING_VERSION 2 // Version 1 files only have raw frames
+#define RECORDING_KEY_INTERVAL 30
+
+// Frame data of a record, FrameRecord::encoding
+#define RECORDING_ENCODING_RAW 0 // Pixel rows back to back
+#define RECORDING_ENCODING_INDEXED 1 // Palette indexed frame
+
+// Bits of FrameRecord::flags
+#define RECORDING_KEY_FRAME 1 // Decodes without earlier frames, raw frames always do
+
+struct RecordingHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved[13];
+};
+
+struct FrameRecord {
+    uint32_t magic;
+    uint32_t stream; // Camera of the frame
+    uint64_t index; // Frame number within the stream, pairs stereo frames
+    int64_t capture_ns; // Steady clock capture time
+    int32_t rows, cols, type;
+    uint32_t step; // Bytes per row of the pixels
+    uint64_t data_size; // Bytes of frame data following this record, not counting padding
+    uint32_t encoding; // RECORDING_ENCODING_*
+    uint32_t flags; // RECORDING_KEY_FRAME
+    uint64_t reserved;
+};
+
+struct RecordingIndexEntry {
+    uint32_t stream;
+    uint32_t reserved;
+    uint64_t index;
+    int64_t capture_ns;
+    uint64_t offset; // File offset of the FrameRecord
+};
+
+struct RecordingFooter {
+    uint64_t index_offset;
+    uint64_t index_count;
+    char magic[8];
+    uint64_t reserved[5];
+};
+
+/**
+ * Appends frames to a recording file, raw camera frames or palette indexed rendered
+ *      frames. Thread safe, so several cameras can record into one file. Capture and
+ *      render threads submit() frames to a writer thread so they never wait for the disk.
+ */
+class FrameRecorder {
+public:
+    FrameRecorder();
+
+    ~FrameRecorder();
+
+    /**
+     * Create a recording file
+     * @param path File path, replaced if it exists
+     * @param indexed Store 8 bit BGR frames palette indexed, for rendered frames
+     * @return True if the file was created
+     */
+    bool open(const std::string& path, bool indexed = false);
+
+    /**
+     * Create the recording file named by VRVISOR_RECORD, if set
+     * @return True if recording
+     */
+    bool openFromEnvironment();
+
+    /**
+     * Create the palette indexed recording of rendered frames named by VRVISOR_RECORD_OUTPUT,
+     *      if set, with a key frame every VRVISOR_INDEXED_KEYFRAME frames
+     * @return True if recording
+     */
+    bool openOutputFromEnvironment();
+
+    /**
+     * Check whether frames are being recorded
+     * @return True if a file is open
+     */
+    bool isOpen();
+
+    /**
+     * Append a frame, waiting for the file
+     * @param stream Camera of the frame
+     * @param frame Raw camera frame, or rendered frame of an indexed recording
+     * @param captured When the frame was grabbed
+     */
+    void write(int stream, const cv::Mat& frame, std::chrono::steady_clock::time_point captured);
+
+    /**
+     * Queue a frame for the writer thread without waiting for the file. The frame is shared,
+     *      not copied, so it must not be written into while queued. If VRVISOR_RECORD_QUEUE
+     *      frames are already waiting the frame is dropped and counted instead.
+     * @param stream Camera of the frame
+     * @param frame Raw camera frame, or rendered frame of an indexed recording
+     * @param captured When the frame was grabbed
+     * @return False if the frame was dropped or no file is open
+     */
+    bool submit(int stream, const cv::Mat& frame, std::chrono::steady_clock::time_point captured);
+
+    /**
+     * Write the queued frames, the index and footer and close the file
+     */
+    void close();
+
+private:
+    /**
+     * Write all bytes at the end of the file
+     * @return True on success
+     */
+    bool append(const void* data, size_t size);
+
+    /**
+     * Write several buffers at the end of the file with as few system calls as possible
+     * @param parts Buffers to write in order, changed by partial writes
+     * @param count Number of buffers
+     * @return True on success
+     */
+    bool append(struct iovec* parts, size_t count);
+
+    pthread_mutex_t mutex;
+    int fd;
+    std::string path;
+    uint64_t offset;
+    std::vector<RecordingIndexEntry> index;
+    std::vector<struct iovec> parts; // Buffers of the frame being written
+    std::vector<uint64_t> stream_frames;
+    bool indexed;
+    int key_interval; // Frames from one key frame to the next
+    std::vector<IndexedEncoder> encoders; // One per stream, deltas only refer to their own stream
+    std::vector<uint8_t> encoded;
+    uint64_t raw_bytes, data_bytes; // Sizes of the written frames before and after encoding
+
+    // Frame waiting for the writer thread
+    struct QueuedFrame {
+        int stream;
+        cv::Mat frame;
+        std::chrono::steady_clock::time_point captured;
+    };
+
+    // Queue of submit(), under its own mutex so submitting never waits for a write in progress
+    size_t queue_max; // VRVISOR_RECORD_QUEUE
+    pthread_t writer;
+    pthread_mutex_t queue_mutex;
+    pthread_cond_t queue_cond;
+    std::deque<QueuedFrame> queue;
+    bool writing; // Writer thread runs, frames may be queued
+    bool closing; // Writer thread exits once the queue is empty
+    size_t dropped; // Frames submitted while the queue was full
+
+    friend void* recorder_thread(void* arg);
+};
+
+/**
+ * How a replay hands out frames
+ */
+enum ReplayMode {
+    REPLAY_REALTIME, // At the recorded capture times
+    REPLAY_FAST, // As fast as the consumers take them, each frame delivered to every render consumer
+};
+
+/**
+ * Memory mapped recording. Raw frames are returned as Mats pointing into the mapping, so
+ *      the file must stay open while any frame is in use; indexed frames are decoded into
+ *      new Mats.
+ */
+class ReplayFile {
+public:
+    ReplayFile();
+
+    ~ReplayFile();
+
+    /**
+     * Map a recording and index its frames
+     * @param path Recording file
+     * @param mode Replay pacing
+     * @return True if the file is a recording
+     */
+    bool open(const std::string& path, ReplayMode mode);
+
+    /**
+     * Open the recording named by VRVISOR_REPLAY, if set, paced by VRVISOR_REPLAY_MODE (realtime or fast)
+     * @return True if replaying
+     */
+    bool openFromEnvironment();
+
+    /**
+     * Check whether a recording is open
+     * @return True if a file is open
+     */
+    bool isOpen() const;
+
+    /**
+     * Get the replay pacing
+     * @return Replay mode
+     */
+    ReplayMode mode() const;
+
+    /**
+     * Get the number of frames of one stream
+     * @param stream Camera of the frames
+     * @return Number of frames
+     */
+    size_t frameCount(int stream) const;
+
+    /**
+     * Get a frame, without copying it if it is raw. Indexed frames decode fastest in order.
+     * @param stream Camera of the frame
+     * @param index Frame number within the stream
+     * @param image Set to a Mat pointing into the mapping, or to the decoded frame
+     * @param capture_ns Set to the recorded capture time
+     * @return False past the last frame or if the frame cannot be decoded
+     */
+    bool frame(int stream, size_t index, cv::Mat& image, int64_t& capture_ns) const;
+
+    /**
+     * Sleep until a recorded capture time comes around again. Every stream shares the
+     *      same starting point, so stereo frames stay in step.
+     * @param capture_ns Recorded capture time
+     */
+    void waitUntil(int64_t capture_ns);
+
+    /**
+     * Unmap the recording
+     */
+    void close();
+
+private:
+    /**
+     * Add a frame record to the per stream index
+     * @return False if the record is not valid
+     */
+    bool addRecord(uint64_t offset);
+
+    /**
+     * Decode an indexed frame, first decoding the frames it builds on
+     * @param stream Camera of the frame
+     * @param index Frame number within the stream
+     * @param image Set to the decoded frame
+     * @return False if a frame could not be decoded
+     */
+    bool decode(int stream, size_t index, cv::Mat& image) const;
+
+    int fd;
+    uint8_t* map;
+    size_t size;
+    ReplayMode replay_mode;
+    std::vector<std::vector<uint64_t>> streams; // Offsets of the FrameRecords of each stream
+    int64_t first_ns; // Earliest capture time in the file
+
+    mutable std::vector<IndexedDecoder> decoders; // One per stream
+    mutable std::vector<size_t> decoded; // Frame each decoder holds, SIZE_MAX for none
+
+    mutable pthread_mutex_t mutex;
+    bool started;
+    std::chrono::steady_clock::time_point start;
+};
+
+#endif // VRVISOR_RECORDING_H
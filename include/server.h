@@ -0,0 +1,204 @@
+#ifndef VRVISOR_SERVER_H
+#define VRVISOR_SERVER_H
+
+#include "graph.h"
+#include "protocol.h"
+
+#include <opencv2/opencv.hpp>
+#include <pthread.h>
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class RenderServer;
+
+/**
+ * Reply queued for a client
+ */
+struct RenderOutgoing {
+    std::vector<uint8_t> bytes; // Reply and payload
+    std::string shm_name; // Shared memory result to unlink if the reply is never written
+};
+
+/**
+ * Replies waiting to be written to one client by its writer thread, so a client that
+ *      stops reading only ever blocks its own writer and never a render task
+ */
+struct RenderOutbox {
+    int fd; // Closed by the writer once the connection is gone
+    size_t max_bytes; // Queued bytes before the client is dropped
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    std::deque<RenderOutgoing> replies;
+    size_t bytes; // Bytes queued in replies
+    bool closing; // Connection is gone, write what is left and exit
+    bool dropped; // Client overflowed its queue or failed a write, nothing more is written
+    bool finished; // Writer exited, it can be joined
+
+    RenderOutbox(int fd, size_t max_bytes);
+
+    ~RenderOutbox();
+
+    /**
+     * Stop writing, unlink the results of queued replies and wake both sides of the socket,
+     *      call with mutex held
+     */
+    void drop();
+};
+
+/**
+ * One client. Replies may be queued by any render task and are written by the outbox.
+ */
+struct RenderConnection : std::enable_shared_from_this<RenderConnection> {
+    RenderServer* server;
+    int fd;
+    pthread_t thread;
+    std::shared_ptr<RenderOutbox> outbox;
+    bool done; // Reader thread finished, it can be joined
+
+    RenderConnection(RenderServer* server, int fd, std::shared_ptr<RenderOutbox> outbox);
+
+    /**
+     * Let the writer finish the queued replies and exit
+     */
+    ~RenderConnection();
+
+    /**
+     * Queue a reply and its payload, never blocks on the socket. A client whose queue
+     *      overflows is dropped.
+     * @param reply Reply, payload_size is set here
+     * @param payload Payload bytes
+     * @param size Payload size
+     * @param shm_name Shared memory result named by the payload, unlinked if the reply is never written
+     * @return False if the client went away or was dropped
+     */
+    bool send(RenderReply& reply, const void* payload, size_t size, const std::string& shm_name = std::string());
+};
+
+/**
+ * Request waiting to be rendered
+ */
+struct RenderJob {
+    RenderRequest request;
+    std::vector<uint8_t> payload;
+    std::shared_ptr<RenderConnection> connection; // Kept open until the reply is sent
+    std::chrono::steady_clock::time_point received;
+    size_t queue_depth; // Requests still queued when this one was taken
+};
+
+/**
+ * Long running renderer for still images. Clients send requests over a UNIX socket,
+ *      queued requests are rendered in batches spread over the shared WorkerPool, and
+ *      decode buffers, effect graphs and the k-means palette of each k stay warm
+ *      between requests.
+ */
+class RenderServer {
+public:
+    RenderServer();
+
+    ~RenderServer();
+
+    /**
+     * Listen on a socket and start serving
+     * @param path Socket path, a stale socket left by a crashed daemon is replaced
+     * @return False if the socket could not be created or another daemon is using it
+     */
+    bool open(const std::string& path);
+
+    /**
+     * Stop accepting requests, finish the queued ones and remove the socket
+     */
+    void stop();
+
+    /**
+     * Print request counts, queue depth, batch sizes and latency percentiles
+     * @param out Stream to print to
+     */
+    void report(std::ostream& out);
+
+private:
+    // Warm state of one position in a batch, only used by the task rendering that position
+    struct RenderSlot {
+        cv::Mat decoded; // Decoded input, reused when the next image has the same size
+        cv::Mat input; // Resized input
+        std::vector<uint8_t> encoded;
+        std::map<unsigned, EffectGraph*> graphs; // One per effect options key
+    };
+
+    // Argument of render_thread
+    struct render_args {
+        RenderServer* server;
+        RenderJob* job;
+        RenderSlot* slot;
+        int batch;
+    };
+
+    /**
+     * Queue a request, or reject it if the queue is full
+     * @param job Request, owned by the server from here on
+     */
+    void enqueue(RenderJob* job);
+
+    /**
+     * Render one request and send its reply
+     * @param job Request
+     * @param slot Warm buffers to render with
+     * @param batch Requests in this batch
+     */
+    void render(RenderJob& job, RenderSlot& slot, int batch);
+
+    /**
+     * Send a reply and count it
+     * @param job Request
+     * @param reply Reply, timings are set here
+     * @param payload Payload bytes
+     * @param size Payload size
+     */
+    void finish(RenderJob& job, RenderReply& reply, const void* payload, size_t size);
+
+    // Settings
+    size_t batch_max; // VRVISOR_RENDERD_BATCH
+    double batch_window_ms; // VRVISOR_RENDERD_BATCH_MS
+    size_t queue_max; // VRVISOR_RENDERD_QUEUE
+    size_t payload_max; // VRVISOR_RENDERD_MAX_PAYLOAD_MB
+    size_t outbox_max; // VRVISOR_RENDERD_REPLY_QUEUE_MB
+    int send_timeout_s; // VRVISOR_RENDERD_SEND_TIMEOUT_S
+    EffectOptions default_options;
+    EdgeEngine default_engine;
+
+    std::string path;
+    int listen_fd;
+    pthread_t accept_thread_id;
+    pthread_t batch_thread_id;
+    std::vector<RenderSlot*> slots;
+    bool started;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    std::deque<RenderJob*> queue;
+    std::vector<std::shared_ptr<RenderConnection>> connections;
+    std::vector<std::shared_ptr<RenderOutbox>> outboxes; // Writers not joined yet
+    std::map<int, cv::Mat> palettes; // Latest k-means centers of each k
+    size_t shm_count; // Shared memory results created
+    bool stopped;
+
+    // Counters, under mutex
+    size_t requests, failures, rejected, dropped;
+    size_t batches, batched; // Batches rendered and the requests in them
+    size_t queue_peak;
+    std::deque<float> queue_ms, render_ms, total_ms; // Most recent requests
+
+    friend void* accept_thread(void* arg);
+    friend void* connection_thread(void* arg);
+    friend void* batch_thread(void* arg);
+    friend void* render_thread(void* arg);
+    friend struct RenderConnection;
+};
+
+#endif // VRVISOR_SERVER_H
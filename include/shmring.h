@@ -0,0 +1,221 @@
+#ifndef VRVISOR_SHMRING_H
+#define VRVISOR_SHMRING_H
+
+#include "indexed.h"
+
+#include <opencv2/opencv.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Shared memory ring of finished frames for other processes on the same machine.
+ *      One writer publishes into a POSIX shared memory object, any number of readers
+ *      map it read only and look at the latest frame in place:
+ *
+ *      ShmRingHeader
+ *      ShmSlot, pixels      (slot_count times, each slot_size bytes)
+ *
+ *      Every slot is guarded by a sequence lock. Frame p goes to slot p % slot_count,
+ *      the slot sequence is 2p - 1 while it is written and 2p once it is complete, and
+ *      the header's latest is p once the frame can be read. Readers never block the
+ *      writer; a reader that is overtaken sees the sequence change and drops the frame.
+ *
+ *      Frames are raw pixels, or with VRVISOR_SHM_INDEXED palette indexed frames (indexed.h)
+ *      that copy a fraction of the bytes. Readers skip frames, so indexed frames never
+ *      refer to the frame before.
+ */
+
+#define SHM_RING_MAGIC "VRVSHM1"
+#define SHM_RING_VERSION 2
+#define SHM_RING_SLOTS 4
+#define SHM_RING_STAGES 8
+#define SHM_RING_STAGE_NAME 16
+#define SHM_RING_ALIGNMENT 64
+
+// Frame data of a slot, ShmFrameMeta::encoding
+#define SHM_ENCODING_RAW 0 // Pixel rows back to back
+#define SHM_ENCODING_INDEXED 1 // One palette indexed frame without INDEXED_DELTA
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring sequences are shared between processes");
+
+/**
+ * Metadata published with each frame
+ */
+struct ShmFrameMeta {
+    uint64_t frame_num; // Capture frame number
+    int64_t capture_ns; // Steady clock time the camera frame was grabbed
+    int64_t publish_ns; // Steady clock time the frame was published
+    int32_t rows, cols, type;
+    uint32_t step; // Bytes per row of the pixels
+    uint32_t stage_count;
+    uint32_t encoding; // SHM_ENCODING_*
+    uint64_t data_size; // Bytes of frame data after the slot
+    float stage_ms[SHM_RING_STAGES]; // Time spent in each processing stage
+    char stage_names[SHM_RING_STAGES][SHM_RING_STAGE_NAME];
+};
+
+struct alignas(SHM_RING_ALIGNMENT) ShmRingHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_count;
+    uint64_t slot_size; // Bytes per slot, including the ShmSlot
+    uint64_t capacity; // Largest frame data in bytes
+    std::atomic<uint64_t> latest; // Number of the newest complete frame, 0 before the first
+    std::atomic<uint32_t> closed; // Set when the writer goes away, readers should reopen
+};
+
+struct alignas(SHM_RING_ALIGNMENT) ShmSlot {
+    std::atomic<uint64_t> seq; // Odd while being written
+    ShmFrameMeta meta;
+};
+
+/**
+ * Time spent in one processing stage
+ */
+struct ShmStage {
+    const char* name;
+    double ms;
+};
+
+/**
+ * Publishes finished frames into a shared memory ring
+ */
+class ShmRingWriter {
+public:
+    ShmRingWriter();
+
+    ~ShmRingWriter();
+
+    /**
+     * Create the ring. It is sized by the first published frame.
+     * @param name Shared memory object name, e.g. /vrvisor
+     * @param slots Number of frames kept
+     * @param indexed Publish 8 bit BGR frames as palette indexed frames
+     * @return True if the name is usable
+     */
+    bool open(const std::string& name, int slots, bool indexed = false);
+
+    /**
+     * Create the ring named by VRVISOR_SHM, if set, with VRVISOR_SHM_SLOTS slots, indexed
+     *      if VRVISOR_SHM_INDEXED is set
+     * @return True if publishing
+     */
+    bool openFromEnvironment();
+
+    /**
+     * Check whether frames are published
+     * @return True if open
+     */
+    bool isOpen() const;
+
+    /**
+     * Check whether frames are published palette indexed
+     * @return True if indexed
+     */
+    bool isIndexed() const;
+
+    /**
+     * Copy a frame into the next slot and make it the latest
+     * @param frame Finished frame
+     * @param frame_num Capture frame number
+     * @param captured When the camera frame was grabbed
+     * @param stages Stage timings, at most SHM_RING_STAGES are kept
+     */
+    void publish(const cv::Mat& frame, size_t frame_num, std::chrono::steady_clock::time_point captured,
+        const std::vector<ShmStage>& stages);
+
+    /**
+     * Print published and dropped frame counts
+     * @param out Stream to print to
+     */
+    void report(std::ostream& out);
+
+    /**
+     * Mark the ring closed and remove it
+     */
+    void close();
+
+private:
+    /**
+     * Create and map the shared memory object
+     * @param capacity Largest frame data in bytes
+     * @return True on success
+     */
+    bool create(uint64_t capacity);
+
+    std::string name;
+    int slot_count;
+    uint8_t* map;
+    size_t size;
+    uint64_t next; // Number of the next frame to publish
+    size_t dropped; // Frames too big for the ring
+    bool indexed;
+    IndexedEncoder encoder;
+    std::vector<uint8_t> encoded;
+    uint64_t raw_bytes, data_bytes; // Sizes of the published frames before and after encoding
+};
+
+/**
+ * A frame in a ring, valid until the writer reuses its slot
+ */
+struct ShmFrameView {
+    uint64_t seq; // Frame number within the ring
+    ShmFrameMeta meta;
+    const uint8_t* data; // Frame data in the shared memory, meta.data_size bytes
+    cv::Mat image; // Points into the shared memory, empty unless meta.encoding is SHM_ENCODING_RAW
+};
+
+/**
+ * Maps a ring published by another process
+ */
+class ShmRingReader {
+public:
+    ShmRingReader();
+
+    ~ShmRingReader();
+
+    /**
+     * Map a ring read only
+     * @param name Shared memory object name
+     * @return True if the ring exists and has a frame size
+     */
+    bool open(const std::string& name);
+
+    /**
+     * Check whether the writer has closed the ring
+     * @return True if the ring should be reopened
+     */
+    bool closed() const;
+
+    /**
+     * Get the newest frame without copying its pixels
+     * @param view Set to the frame
+     * @param after Only return frames newer than this ring frame number
+     * @return False if there is no newer complete frame
+     */
+    bool latest(ShmFrameView& view, uint64_t after = 0) const;
+
+    /**
+     * Check that a frame was not overwritten while it was being used. Call after
+     *      reading the pixels, anything read is garbage if this returns false.
+     * @param view Frame from latest
+     * @return True if the pixels read were the published frame
+     */
+    bool valid(const ShmFrameView& view) const;
+
+    /**
+     * Unmap the ring
+     */
+    void close();
+
+private:
+    int fd;
+    uint8_t* map;
+    size_t size;
+};
+
+#endif // VRVISOR_SHMRING_H
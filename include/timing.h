@@ -7,6 +7,12 @@ using namespace std::chrono;
 
 #define START_TIMING() auto start = duration_cast<milliseconds>(system_clock::now().time_since_epoch());
 
+/**
+ * Get the time since this process started, including exec and loading before main
+ * @return Milliseconds since process start
+ */
+double process_uptime_ms();
+
 #define STOP_TIMING(name)                                                                                                                  \
     auto end = duration_cast<milliseconds>(system_clock::now().time_since_epoch());                                                        \
     std::cout << name << ": " << (end - start).count() << " ms" << std::endl;
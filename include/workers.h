@@ -0,0 +1,123 @@
+#ifndef VRVISOR_WORKERS_H
+#define VRVISOR_WORKERS_H
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <vector>
+
+/**
+ * Tasks that are waited for together
+ */
+struct TaskGroup {
+    size_t pending; // Tasks submitted and not finished yet
+    std::exception_ptr error; // First exception thrown by a task, wait() rethrows it
+
+    TaskGroup()
+        : pending(0)
+    {
+    }
+};
+
+/**
+ * Fixed set of render threads shared by every effect. Threads waiting for a group run
+ *      queued tasks meanwhile, so tasks may submit and wait for tasks of their own.
+ */
+class WorkerPool {
+public:
+    /**
+     * Start worker threads
+     * @param threads Number of threads
+     */
+    WorkerPool(int threads);
+
+    ~WorkerPool();
+
+    /**
+     * Get the pool shared by every effect, sized by VRVISOR_WORKERS or the number of CPUs
+     * @return Shared pool
+     */
+    static WorkerPool& shared();
+
+    /**
+     * Queue a task
+     * @param group Group the task belongs to
+     * @param fn Task function
+     * @param arg Argument to fn
+     */
+    void submit(TaskGroup& group, void* (*fn)(void*), void* arg);
+
+    /**
+     * Run queued tasks until every task of a group has finished
+     * @param group Group to wait for
+     * @throws First exception thrown by a task of the group, once all of them have finished
+     */
+    void wait(TaskGroup& group);
+
+    /**
+     * Run a function once per argument in parallel and wait for all of them
+     * @param fn Task function
+     * @param args Array of count arguments
+     * @param count Number of arguments
+     * @throws First exception thrown by any of the calls, once all of them have finished
+     */
+    template <typename T> void run(void* (*fn)(void*), T* args, int count)
+    {
+        TaskGroup group;
+        for (int i = 1; i < count; ++i) {
+            submit(group, fn, &args[i]);
+        }
+        if (count > 0) {
+            // The caller takes a share instead of only waiting, queued tasks still use group and args if it throws
+            try {
+                fn(&args[0]);
+            } catch (...) {
+                fail(group, std::current_exception());
+            }
+        }
+        wait(group);
+    }
+
+    /**
+     * Get the number of worker threads
+     * @return Number of threads
+     */
+    int size() const;
+
+    /**
+     * Stop worker threads, queued tasks are still run
+     */
+    void stop();
+
+private:
+    struct Task {
+        void* (*fn)(void*);
+        void* arg;
+        TaskGroup* group;
+    };
+
+    /**
+     * Run one task and mark it finished, call with mutex held
+     * @param task Task taken off the queue
+     */
+    void execute(const Task& task);
+
+    /**
+     * Keep the first exception thrown by a task of a group
+     * @param group Group the task belongs to
+     * @param error Exception thrown
+     */
+    void fail(TaskGroup& group, std::exception_ptr error);
+
+    std::vector<pthread_t> threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    std::deque<Task> queue;
+    bool stopped;
+
+    friend void* worker_thread(void* arg);
+};
+
+#endif // VRVISOR_WORKERS_H
@@ -0,0 +1,466 @@
+#include "indexed.h"
+#include "kernels.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+// Table of the colors of one frame, at most half full so probes stay short
+#define COLOR_TABLE_BITS 15
+#define COLOR_TABLE_SIZE (1 << COLOR_TABLE_BITS)
+#define COLOR_TABLE_LIMIT (COLOR_TABLE_SIZE / 2)
+
+// Slot of a color that has no palette index yet
+#define SLOT_UNRESOLVED 0xFFFF
+#define SLOT_CHOSEN 0xFFFE
+
+// Shortest run worth an op instead of literal indices
+#define MIN_MATCH 3
+
+// Largest count that fits in an op byte without a LEB128 number
+#define SHORT_COUNT 63
+
+/**
+ * Pack the color of a BGR pixel
+ */
+static inline uint32_t pack(const uint8_t* pixel) { return pixel[0] | (pixel[1] << 8) | (pixel[2] << 16); }
+
+/**
+ * Write an op byte and its count
+ * @return Position after the op
+ */
+static uint8_t* put_op(uint8_t* out, int op, size_t count)
+{
+    if (count <= SHORT_COUNT) {
+        *out++ = (op << 6) | (count - 1);
+        return out;
+    }
+    *out++ = (op << 6) | SHORT_COUNT;
+    for (count -= SHORT_COUNT + 1; count >= 0x80; count >>= 7) {
+        *out++ = (count & 0x7F) | 0x80;
+    }
+    *out++ = count;
+    return out;
+}
+
+/**
+ * Write literal indices
+ * @return Position after the indices
+ */
+static uint8_t* put_literal(uint8_t* out, const uint8_t* indices, size_t count)
+{
+    if (count == 0) {
+        return out;
+    }
+    out = put_op(out, INDEXED_OP_LITERAL, count);
+    std::memcpy(out, indices, count);
+    return out + count;
+}
+
+/**
+ * Count the pixels from i on that equal a reference
+ * @param indices Indices of the frame
+ * @param reference Indices to compare with, lined up with indices
+ * @param i First pixel
+ * @param n Number of pixels
+ * @return Number of equal pixels
+ */
+static size_t match_length(const uint8_t* indices, const uint8_t* reference, size_t i, size_t n)
+{
+    size_t length = 0;
+    while (i + length < n && indices[i + length] == reference[i + length]) {
+        ++length;
+    }
+    return length;
+}
+
+IndexedEncoder::IndexedEncoder()
+    : keys(COLOR_TABLE_SIZE, 0)
+    , counts(COLOR_TABLE_SIZE, 0)
+    , slots(COLOR_TABLE_SIZE, SLOT_UNRESOLVED)
+{
+    reset();
+}
+
+/**
+ * Forget the previous frame and palette
+ */
+void IndexedEncoder::reset()
+{
+    palette_size = 0;
+    previous_rows = previous_cols = 0;
+}
+
+/**
+ * Get the largest possible encoded size of a frame
+ * @param rows Frame height
+ * @param cols Frame width
+ * @return Bytes
+ */
+size_t IndexedEncoder::maxSize(int rows, int cols)
+{
+    // Literals cost one op byte per run of up to 63 indices, plus a little for long counts
+    size_t n = (size_t)rows * cols;
+    return sizeof(IndexedHeader) + 3 * INDEXED_MAX_COLORS + n + n / 32 + 16;
+}
+
+/**
+ * Find a color in the hash table, adding it if there is room
+ * @param color Packed BGR color
+ * @param insert Add the color if it is missing
+ * @return Table position, or -1 if missing
+ */
+long IndexedEncoder::find(uint32_t color, bool insert)
+{
+    const uint32_t key = color + 1;
+    uint32_t position = (color * 2654435761u) >> (32 - COLOR_TABLE_BITS);
+    while (keys[position] != 0) {
+        if (keys[position] == key) {
+            return position;
+        }
+        position = (position + 1) & (COLOR_TABLE_SIZE - 1);
+    }
+    if (!insert || used.size() >= COLOR_TABLE_LIMIT) {
+        return -1;
+    }
+    keys[position] = key;
+    used.push_back(position);
+    return position;
+}
+
+/**
+ * Count the colors of a frame and choose the palette
+ * @return True if the palette holds every color
+ */
+bool IndexedEncoder::choosePalette(const uint8_t* bgr, int rows, int cols, size_t step)
+{
+    for (uint32_t position : used) {
+        keys[position] = 0;
+        counts[position] = 0;
+        slots[position] = SLOT_UNRESOLVED;
+    }
+    used.clear();
+
+    // Flat areas repeat the last color, which skips the table
+    bool complete = true;
+    for (int y = 0; y < rows; ++y) {
+        const uint8_t* row = bgr + y * step;
+        uint32_t last = UINT32_MAX;
+        long last_position = -1;
+        for (int x = 0; x < cols; ++x) {
+            const uint32_t color = pack(row + 3 * x);
+            if (color != last) {
+                last = color;
+                last_position = find(color, true);
+            }
+            if (last_position < 0) {
+                complete = false;
+            } else {
+                counts[last_position] += 1;
+            }
+        }
+    }
+
+    // The most common colors make the palette
+    std::vector<uint32_t> chosen(used);
+    if (chosen.size() > INDEXED_MAX_COLORS) {
+        complete = false;
+        std::nth_element(chosen.begin(), chosen.begin() + INDEXED_MAX_COLORS, chosen.end(),
+            [this](uint32_t a, uint32_t b) { return counts[a] != counts[b] ? counts[a] > counts[b] : keys[a] < keys[b]; });
+        chosen.resize(INDEXED_MAX_COLORS);
+    }
+    for (uint32_t position : chosen) {
+        slots[position] = SLOT_CHOSEN;
+    }
+
+    // Colors already in the palette keep their index, new colors take the free slots
+    bool taken[INDEXED_MAX_COLORS] = {};
+    for (int slot = 0; slot < palette_size; ++slot) {
+        const long position = find(palette[slot], false);
+        if (position >= 0 && slots[position] == SLOT_CHOSEN) {
+            slots[position] = slot;
+            taken[slot] = true;
+        }
+    }
+    int free_slot = 0;
+    int size = 0;
+    for (uint32_t position : chosen) {
+        if (slots[position] == SLOT_CHOSEN) {
+            while (taken[free_slot]) {
+                ++free_slot;
+            }
+            slots[position] = free_slot;
+            palette[free_slot] = keys[position] - 1;
+            taken[free_slot] = true;
+        }
+        size = std::max(size, slots[position] + 1);
+    }
+    // Slots of colors that left the picture stay until reused, they are valid colors to map to
+    palette_size = size;
+    return complete;
+}
+
+/**
+ * Find the nearest palette color, the lowest index wins ties
+ * @param color Packed BGR color
+ * @return Palette index
+ */
+uint8_t IndexedEncoder::nearest(uint32_t color) const
+{
+    int best_distance = INT_MAX;
+    int best_slot = 0;
+    for (int slot = 0; slot < palette_size; ++slot) {
+        const int db = (int)(color & 0xFF) - (int)(palette[slot] & 0xFF);
+        const int dg = (int)((color >> 8) & 0xFF) - (int)((palette[slot] >> 8) & 0xFF);
+        const int dr = (int)(color >> 16) - (int)(palette[slot] >> 16);
+        const int distance = db * db + dg * dg + dr * dr;
+        if (distance < best_distance) {
+            best_distance = distance;
+            best_slot = slot;
+        }
+    }
+    return best_slot;
+}
+
+/**
+ * Encode a frame
+ * @param bgr Top left BGR pixel
+ * @param rows Frame height
+ * @param cols Frame width
+ * @param step Bytes between rows
+ * @param delta Code against the previous frame of this encoder if it has the same size
+ * @param out Set to the encoded frame
+ * @return True if every pixel kept its exact color
+ */
+bool IndexedEncoder::encode(const uint8_t* bgr, int rows, int cols, size_t step, bool delta, std::vector<uint8_t>& out)
+{
+    const bool exact = choosePalette(bgr, rows, cols, step);
+    delta = delta && rows == previous_rows && cols == previous_cols;
+
+    // Indices, colors left out of the palette are mapped once per frame
+    const size_t n = (size_t)rows * cols;
+    indices.resize(n);
+    for (int y = 0; y < rows; ++y) {
+        const uint8_t* row = bgr + y * step;
+        uint8_t* index = indices.data() + (size_t)y * cols;
+        uint32_t last = UINT32_MAX;
+        uint8_t last_index = 0;
+        for (int x = 0; x < cols; ++x) {
+            const uint32_t color = pack(row + 3 * x);
+            if (color != last) {
+                last = color;
+                const long position = find(color, false);
+                if (position < 0) {
+                    last_index = nearest(color);
+                } else {
+                    if (slots[position] == SLOT_UNRESOLVED) {
+                        slots[position] = nearest(color);
+                    }
+                    last_index = slots[position];
+                }
+            }
+            index[x] = last_index;
+        }
+    }
+
+    out.resize(maxSize(rows, cols));
+    IndexedHeader* header = (IndexedHeader*)out.data();
+    std::memset(header, 0, sizeof(IndexedHeader));
+    std::memcpy(header->magic, INDEXED_MAGIC, sizeof(header->magic));
+    header->rows = rows;
+    header->cols = cols;
+    header->colors = std::max(palette_size, 1);
+    header->flags = (delta ? INDEXED_DELTA : 0) | (exact ? INDEXED_EXACT : 0);
+    uint8_t* p = out.data() + sizeof(IndexedHeader);
+    for (uint32_t slot = 0; slot < header->colors; ++slot) {
+        const uint32_t color = (int)slot < palette_size ? palette[slot] : 0;
+        *p++ = color & 0xFF;
+        *p++ = (color >> 8) & 0xFF;
+        *p++ = color >> 16;
+    }
+
+    // Greedy: take the longest match at each pixel, ties go to the cheapest op
+    const uint8_t* stream = p;
+    const uint8_t* index = indices.data();
+    size_t literal = 0;
+    size_t i = 0;
+    while (i < n) {
+        int op = INDEXED_OP_RUN;
+        size_t length = 0;
+        if (delta) {
+            length = match_length(index, previous.data(), i, n);
+            op = INDEXED_OP_PREVIOUS;
+        }
+        if (i >= (size_t)cols) {
+            const size_t above = match_length(index, index - cols, i, n);
+            if (above > length) {
+                length = above;
+                op = INDEXED_OP_ABOVE;
+            }
+        }
+        const size_t run = 1 + match_length(index + 1, index, i, n - 1);
+        if (run > length) {
+            length = run;
+            op = INDEXED_OP_RUN;
+        }
+        if (length < MIN_MATCH) {
+            ++i;
+            continue;
+        }
+        p = put_literal(p, index + literal, i - literal);
+        p = put_op(p, op, length);
+        if (op == INDEXED_OP_RUN) {
+            *p++ = index[i];
+        }
+        i += length;
+        literal = i;
+    }
+    p = put_literal(p, index + literal, n - literal);
+    header->stream_size = p - stream;
+    out.resize(p - out.data());
+
+    previous.swap(indices);
+    previous_rows = rows;
+    previous_cols = cols;
+    return exact;
+}
+
+IndexedDecoder::IndexedDecoder()
+{
+    reset();
+}
+
+/**
+ * Forget the previous frame, only frames without INDEXED_DELTA decode until the next one
+ */
+void IndexedDecoder::reset()
+{
+    rows = cols = 0;
+}
+
+/**
+ * Read the header of an encoded frame
+ * @param data Encoded frame
+ * @param size Bytes available
+ * @param header Set to the header
+ * @return False if this is not a complete encoded frame
+ */
+bool IndexedDecoder::peek(const uint8_t* data, size_t size, IndexedHeader& header)
+{
+    if (size < sizeof(IndexedHeader)) {
+        return false;
+    }
+    std::memcpy(&header, data, sizeof(IndexedHeader));
+    return std::memcmp(header.magic, INDEXED_MAGIC, sizeof(header.magic)) == 0 && header.rows > 0 && header.cols > 0
+        && header.rows <= (1 << 15) && header.cols <= (1 << 15) && header.colors >= 1 && header.colors <= INDEXED_MAX_COLORS
+        && size - sizeof(IndexedHeader) >= 3 * header.colors && header.stream_size <= size - sizeof(IndexedHeader) - 3 * header.colors;
+}
+
+/**
+ * Decode a frame
+ * @param data Encoded frame
+ * @param size Bytes available
+ * @param bgr Top left BGR pixel of a bgr_rows x bgr_cols frame, or NULL to only follow a delta chain
+ * @param bgr_rows Height of bgr, the frame must have this size
+ * @param bgr_cols Width of bgr
+ * @param step Bytes between rows of bgr
+ * @return False if the frame is corrupt, has another size, or is a delta frame without its previous frame
+ */
+bool IndexedDecoder::decode(const uint8_t* data, size_t size, uint8_t* bgr, int bgr_rows, int bgr_cols, size_t step)
+{
+    IndexedHeader header;
+    if (!peek(data, size, header)) {
+        return false;
+    }
+    // The output must fit the encoded frame exactly, the header is not trusted to size it
+    if (bgr != NULL && (header.rows != bgr_rows || header.cols != bgr_cols || step < 3 * (size_t)bgr_cols)) {
+        return false;
+    }
+    if ((header.flags & INDEXED_DELTA) && (header.rows != rows || header.cols != cols)) {
+        return false;
+    }
+
+    // Unused slots stay black, a corrupt index cannot read past the table
+    const uint8_t* p = data + sizeof(IndexedHeader);
+    std::memset(palette, 0, sizeof(palette));
+    for (uint32_t slot = 0; slot < header.colors; ++slot) {
+        std::memcpy(palette + 4 * slot, p + 3 * slot, 3);
+    }
+    p += 3 * header.colors;
+    const uint8_t* end = p + header.stream_size;
+
+    // The indices of the previous frame are updated in place
+    const size_t n = (size_t)header.rows * header.cols;
+    indices.resize(n);
+    rows = cols = 0;
+    uint8_t* index = indices.data();
+    size_t i = 0;
+    while (p < end) {
+        const int op = *p >> 6;
+        size_t count = (*p++ & SHORT_COUNT) + 1;
+        if (count > SHORT_COUNT) {
+            size_t extra = 0;
+            for (int shift = 0;; shift += 7) {
+                if (p == end || shift > 35) {
+                    return false;
+                }
+                const uint8_t byte = *p++;
+                extra |= (size_t)(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) {
+                    break;
+                }
+            }
+            count = SHORT_COUNT + 1 + extra;
+        }
+        if (count > n - i) {
+            return false;
+        }
+        switch (op) {
+        case INDEXED_OP_RUN:
+            if (p == end) {
+                return false;
+            }
+            std::memset(index + i, *p++, count);
+            break;
+        case INDEXED_OP_LITERAL:
+            if ((size_t)(end - p) < count) {
+                return false;
+            }
+            std::memcpy(index + i, p, count);
+            p += count;
+            break;
+        case INDEXED_OP_ABOVE:
+            if (i < (size_t)header.cols) {
+                return false;
+            }
+            // Runs may overlap the row they copy, so copy forwards one index at a time
+            for (size_t j = i; j < i + count; ++j) {
+                index[j] = index[j - header.cols];
+            }
+            break;
+        case INDEXED_OP_PREVIOUS:
+            if (!(header.flags & INDEXED_DELTA)) {
+                return false;
+            }
+            break;
+        }
+        i += count;
+    }
+    if (i != n) {
+        return false;
+    }
+    rows = header.rows;
+    cols = header.cols;
+
+    if (bgr != NULL) {
+        const KernelTable& k = kernels();
+        if (step == 3 * (size_t)cols) {
+            k.expand(index, bgr, n, palette);
+        } else {
+            for (int y = 0; y < rows; ++y) {
+                k.expand(index + (size_t)y * cols, bgr + y * step, cols, palette);
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,362 @@
+#include "kernels.h"
+
+#include <climits>
+#include <cstring>
+#include <immintrin.h>
+
+/**
+ * kernels-avx2.cpp
+ * AVX2 kernels. Only built with -mavx2 and only called after kernels() checked the CPU,
+ *      so nothing in this file may be shared with other translation units.
+ */
+
+// Shuffles gathering the B, G and R bytes of 16 BGR pixels from each of their three 16 byte blocks
+alignas(16) static const int8_t plane_masks[3][3][16] = {
+    { { 0, 3, 6, 9, 12, 15, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128 },
+        { -128, -128, -128, -128, -128, -128, 2, 5, 8, 11, 14, -128, -128, -128, -128, -128 },
+        { -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 1, 4, 7, 10, 13 } },
+    { { 1, 4, 7, 10, 13, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128 },
+        { -128, -128, -128, -128, -128, 0, 3, 6, 9, 12, 15, -128, -128, -128, -128, -128 },
+        { -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 2, 5, 8, 11, 14 } },
+    { { 2, 5, 8, 11, 14, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128 },
+        { -128, -128, -128, -128, -128, 1, 4, 7, 10, 13, -128, -128, -128, -128, -128, -128 },
+        { -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 0, 3, 6, 9, 12, 15 } },
+};
+
+// Shuffle packing the BGR bytes of four 4 byte palette colors into 12 bytes
+alignas(16) static const int8_t pack_mask[16] = { 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -128, -128, -128, -128 };
+
+// Shuffles repeating a per pixel byte three times to line up with each 16 byte block of BGR pixels
+alignas(16) static const int8_t expand_masks[3][16] = {
+    { 0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5 },
+    { 5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10 },
+    { 10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15 },
+};
+
+/**
+ * Load a 16 byte mask into both 128 bit lanes
+ */
+static inline __m256i load_mask(const int8_t* mask) { return _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i*)mask)); }
+
+/**
+ * Load two unrelated 16 byte blocks into the low and high lane
+ */
+static inline __m256i load_lanes(const uint8_t* low, const uint8_t* high)
+{
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)low)), _mm_loadu_si128((const __m128i*)high), 1);
+}
+
+/**
+ * Split 16 BGR pixels into B, G and R planes
+ */
+static inline void split16(const uint8_t* p, __m128i* planes)
+{
+    const __m128i v[3] = { _mm_loadu_si128((const __m128i*)p), _mm_loadu_si128((const __m128i*)(p + 16)),
+        _mm_loadu_si128((const __m128i*)(p + 32)) };
+    for (int c = 0; c < 3; ++c) {
+        planes[c] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v[0], _mm_load_si128((const __m128i*)plane_masks[c][0])),
+                                     _mm_shuffle_epi8(v[1], _mm_load_si128((const __m128i*)plane_masks[c][1]))),
+            _mm_shuffle_epi8(v[2], _mm_load_si128((const __m128i*)plane_masks[c][2])));
+    }
+}
+
+/**
+ * Find the nearest center for 16 pixels, matching the scalar tie breaking. Each 32 bit
+ *      lane holds a (b, g) and an (r, 0) pair of 16 bit fixed point differences, so one
+ *      madd per pair gives the squared distance.
+ * @param p 16 BGR pixels
+ * @param clusters Index of the nearest center of each pixel
+ */
+static inline void nearest16(const uint8_t* p, const int16_t* centers, int k, int32_t* clusters)
+{
+    __m128i planes[3];
+    split16(p, planes);
+    const __m128i zero = _mm_setzero_si128();
+    const __m256i bg[2] = { _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(planes[0], planes[1])), KERNEL_CENTER_BITS),
+        _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_unpackhi_epi8(planes[0], planes[1])), KERNEL_CENTER_BITS) };
+    const __m256i r[2] = { _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_unpacklo_epi8(planes[2], zero)), KERNEL_CENTER_BITS),
+        _mm256_slli_epi16(_mm256_cvtepu8_epi16(_mm_unpackhi_epi8(planes[2], zero)), KERNEL_CENTER_BITS) };
+
+    __m256i best_distance[2] = { _mm256_set1_epi32(INT_MAX), _mm256_set1_epi32(INT_MAX) };
+    __m256i best_cluster[2] = { _mm256_setzero_si256(), _mm256_setzero_si256() };
+    for (int cluster = 0; cluster < k; ++cluster) {
+        const __m256i center_bg = _mm256_set1_epi32((centers[3 * cluster + 1] << 16) | centers[3 * cluster]);
+        const __m256i center_r = _mm256_set1_epi32(centers[3 * cluster + 2]);
+        const __m256i index = _mm256_set1_epi32(cluster);
+        for (int half = 0; half < 2; ++half) {
+            const __m256i dbg = _mm256_sub_epi16(bg[half], center_bg);
+            const __m256i dr = _mm256_sub_epi16(r[half], center_r);
+            const __m256i distance = _mm256_add_epi32(_mm256_madd_epi16(dbg, dbg), _mm256_madd_epi16(dr, dr));
+            const __m256i less = _mm256_cmpgt_epi32(best_distance[half], distance);
+            best_distance[half] = _mm256_min_epi32(best_distance[half], distance);
+            best_cluster[half] = _mm256_blendv_epi8(best_cluster[half], index, less);
+        }
+    }
+    _mm256_storeu_si256((__m256i*)clusters, best_cluster[0]);
+    _mm256_storeu_si256((__m256i*)(clusters + 8), best_cluster[1]);
+}
+
+/**
+ * Replace each pixel with the color of the nearest center
+ */
+static void posterize_avx2(const uint8_t* src, uint8_t* dst, size_t n, const int16_t* centers, int k)
+{
+    uint8_t colors[3 * KERNEL_MAX_COLORS];
+    center_colors(centers, k, colors);
+    int32_t clusters[16];
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        nearest16(src + 3 * i, centers, k, clusters);
+        for (int lane = 0; lane < 16; ++lane) {
+            std::memcpy(dst + 3 * (i + lane), colors + 3 * clusters[lane], 3);
+        }
+    }
+    scalar_kernels.posterize(src + 3 * i, dst + 3 * i, n - i, centers, k);
+}
+
+/**
+ * Sum the intensity of a row of square cells
+ */
+static void cell_sums_avx2(const uint8_t* gray, size_t step, int cells, int size, uint32_t* sums)
+{
+    // 16 bit column sums hold up to 257 rows of 255
+    if (size > 257) {
+        scalar_kernels.cell_sums(gray, step, cells, size, sums);
+        return;
+    }
+    alignas(32) uint16_t columns[1024];
+    const int chunk_cells = 1024 / size;
+    for (int first = 0; first < cells; first += chunk_cells) {
+        const int chunk = cells - first < chunk_cells ? cells - first : chunk_cells;
+        const int width = chunk * size;
+        const uint8_t* base = gray + first * size;
+
+        // Add up each column of the chunk, 32 columns at a time
+        int x = 0;
+        for (; x + 32 <= width; x += 32) {
+            __m256i low = _mm256_setzero_si256();
+            __m256i high = _mm256_setzero_si256();
+            for (int row = 0; row < size; ++row) {
+                const uint8_t* p = base + row * step + x;
+                low = _mm256_add_epi16(low, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p)));
+                high = _mm256_add_epi16(high, _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(p + 16))));
+            }
+            _mm256_store_si256((__m256i*)(columns + x), low);
+            _mm256_store_si256((__m256i*)(columns + x + 16), high);
+        }
+        for (; x < width; ++x) {
+            uint16_t sum = 0;
+            for (int row = 0; row < size; ++row) {
+                sum += base[row * step + x];
+            }
+            columns[x] = sum;
+        }
+
+        // Then add the columns of each cell
+        for (int cell = 0; cell < chunk; ++cell) {
+            uint32_t sum = 0;
+            for (int col = 0; col < size; ++col) {
+                sum += columns[cell * size + col];
+            }
+            sums[first + cell] = sum;
+        }
+    }
+}
+
+/**
+ * Combine edges, halftone dots and posterized pixels, 32 pixels at a time.
+ *      Each 128 bit lane holds 16 pixels split across three registers.
+ */
+static void overlay_avx2(const uint8_t* edges, const uint8_t* halftone, const uint8_t* posterized, uint8_t* dst, size_t n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i bg_weights = _mm256_set1_epi32((GRAY_WEIGHT_G << 16) | GRAY_WEIGHT_B);
+    const __m256i r_weights = _mm256_set1_epi32(GRAY_WEIGHT_R);
+    const __m256i threshold = _mm256_set1_epi32(DOT_WEIGHT_THRESHOLD - 1);
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const uint8_t* h = halftone + 3 * i;
+        const uint8_t* p = posterized + 3 * i;
+        __m256i hv[3], pv[3];
+        for (int j = 0; j < 3; ++j) {
+            hv[j] = load_lanes(h + 16 * j, h + 48 + 16 * j);
+            pv[j] = load_lanes(p + 16 * j, p + 48 + 16 * j);
+        }
+
+        // Split halftone pixels into B, G and R planes
+        __m256i planes[3];
+        for (int c = 0; c < 3; ++c) {
+            planes[c] = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(hv[0], load_mask(plane_masks[c][0])),
+                                            _mm256_shuffle_epi8(hv[1], load_mask(plane_masks[c][1]))),
+                _mm256_shuffle_epi8(hv[2], load_mask(plane_masks[c][2])));
+        }
+
+        // Gray weights in 32 bit lanes, four groups of four pixels per lane
+        const __m256i b16[2] = { _mm256_unpacklo_epi8(planes[0], zero), _mm256_unpackhi_epi8(planes[0], zero) };
+        const __m256i g16[2] = { _mm256_unpacklo_epi8(planes[1], zero), _mm256_unpackhi_epi8(planes[1], zero) };
+        const __m256i r16[2] = { _mm256_unpacklo_epi8(planes[2], zero), _mm256_unpackhi_epi8(planes[2], zero) };
+        __m256i dots[4];
+        for (int half = 0; half < 2; ++half) {
+            const __m256i bg_low = _mm256_unpacklo_epi16(b16[half], g16[half]);
+            const __m256i bg_high = _mm256_unpackhi_epi16(b16[half], g16[half]);
+            const __m256i r_low = _mm256_unpacklo_epi16(r16[half], zero);
+            const __m256i r_high = _mm256_unpackhi_epi16(r16[half], zero);
+            const __m256i weight_low = _mm256_add_epi32(_mm256_madd_epi16(bg_low, bg_weights), _mm256_madd_epi16(r_low, r_weights));
+            const __m256i weight_high = _mm256_add_epi32(_mm256_madd_epi16(bg_high, bg_weights), _mm256_madd_epi16(r_high, r_weights));
+            dots[2 * half] = _mm256_cmpgt_epi32(weight_low, threshold);
+            dots[2 * half + 1] = _mm256_cmpgt_epi32(weight_high, threshold);
+        }
+        const __m256i dot = _mm256_packs_epi16(_mm256_packs_epi32(dots[0], dots[1]), _mm256_packs_epi32(dots[2], dots[3]));
+
+        const __m256i edge = load_lanes(edges + i, edges + i + 16);
+        const __m256i keep = _mm256_andnot_si256(dot, _mm256_cmpeq_epi8(edge, zero));
+
+        for (int j = 0; j < 3; ++j) {
+            const __m256i keep3 = _mm256_shuffle_epi8(keep, load_mask(expand_masks[j]));
+            const __m256i out = _mm256_blendv_epi8(hv[j], _mm256_adds_epu8(pv[j], hv[j]), keep3);
+            _mm_storeu_si128((__m128i*)(dst + 3 * i + 16 * j), _mm256_castsi256_si128(out));
+            _mm_storeu_si128((__m128i*)(dst + 3 * i + 48 + 16 * j), _mm256_extracti128_si256(out, 1));
+        }
+    }
+    scalar_kernels.overlay(edges + i, halftone + 3 * i, posterized + 3 * i, dst + 3 * i, n - i);
+}
+
+/**
+ * k-means assignment step: add each sample to the sum of its nearest center
+ */
+static void assign_avx2(const uint8_t* samples, size_t n, const int16_t* centers, int k, uint32_t* sums, int32_t* counts)
+{
+    int32_t clusters[16];
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const uint8_t* p = samples + 3 * i;
+        nearest16(p, centers, k, clusters);
+        for (int lane = 0; lane < 16; ++lane) {
+            uint32_t* sum = sums + 3 * clusters[lane];
+            sum[0] += p[3 * lane];
+            sum[1] += p[3 * lane + 1];
+            sum[2] += p[3 * lane + 2];
+            counts[clusters[lane]] += 1;
+        }
+    }
+    scalar_kernels.assign(samples + 3 * i, n - i, centers, k, sums, counts);
+}
+
+/**
+ * Widen 16 gray pixels to 16 bit lanes
+ */
+static inline __m256i load16(const uint8_t* p) { return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p)); }
+
+/**
+ * Narrow 16 lanes of all ones or zero to bytes
+ */
+static inline void store_mask16(uint8_t* p, __m256i mask)
+{
+    _mm_storeu_si128((__m128i*)p, _mm_packs_epi16(_mm256_castsi256_si128(mask), _mm256_extracti128_si256(mask, 1)));
+}
+
+/**
+ * Threshold the Sobel gradient magnitude of 16 pixels starting at x
+ */
+static inline void sobel16(const uint8_t* a, const uint8_t* b, const uint8_t* c, uint8_t* dst, size_t x, __m256i threshold)
+{
+    const __m256i a0 = load16(a + x - 1), a1 = load16(a + x), a2 = load16(a + x + 1);
+    const __m256i b0 = load16(b + x - 1), b2 = load16(b + x + 1);
+    const __m256i c0 = load16(c + x - 1), c1 = load16(c + x), c2 = load16(c + x + 1);
+
+    const __m256i right = _mm256_add_epi16(_mm256_add_epi16(a2, c2), _mm256_slli_epi16(b2, 1));
+    const __m256i left = _mm256_add_epi16(_mm256_add_epi16(a0, c0), _mm256_slli_epi16(b0, 1));
+    const __m256i below = _mm256_add_epi16(_mm256_add_epi16(c0, c2), _mm256_slli_epi16(c1, 1));
+    const __m256i above = _mm256_add_epi16(_mm256_add_epi16(a0, a2), _mm256_slli_epi16(a1, 1));
+    const __m256i magnitude
+        = _mm256_add_epi16(_mm256_abs_epi16(_mm256_sub_epi16(right, left)), _mm256_abs_epi16(_mm256_sub_epi16(below, above)));
+    store_mask16(dst + x, _mm256_cmpgt_epi16(magnitude, threshold));
+}
+
+/**
+ * Threshold the Sobel gradient magnitude of one row, 16 pixels at a time
+ */
+static void sobel_avx2(const uint8_t* const* rows, uint8_t* dst, size_t n, int threshold)
+{
+    if (n < 18) {
+        scalar_kernels.sobel(rows, dst, n, threshold);
+        return;
+    }
+    const __m256i limit = _mm256_set1_epi16(threshold);
+    dst[0] = 0;
+    dst[n - 1] = 0;
+    for (size_t x = 1; x + 17 <= n; x += 16) {
+        sobel16(rows[0], rows[1], rows[2], dst, x, limit);
+    }
+    // The last block overlaps the previous one instead of falling back to scalar
+    sobel16(rows[0], rows[1], rows[2], dst, n - 17, limit);
+}
+
+/**
+ * Threshold the difference of Gaussians of 16 pixels starting at x. Both blurs are scaled to
+ *      at most 65280 so they fit unsigned 16 bit lanes.
+ */
+static inline void dog16(const uint8_t* const* rows, uint8_t* dst, size_t x, __m256i threshold)
+{
+    __m256i wide[5], narrow[3];
+    for (int offset = 0; offset < 5; ++offset) {
+        const __m256i r0 = load16(rows[0] + x + offset - 2), r1 = load16(rows[1] + x + offset - 2);
+        const __m256i r2 = load16(rows[2] + x + offset - 2), r3 = load16(rows[3] + x + offset - 2);
+        const __m256i r4 = load16(rows[4] + x + offset - 2);
+        const __m256i middle = _mm256_add_epi16(_mm256_slli_epi16(r2, 2), _mm256_slli_epi16(r2, 1));
+        const __m256i outer = _mm256_add_epi16(_mm256_add_epi16(r0, r4), _mm256_slli_epi16(_mm256_add_epi16(r1, r3), 2));
+        wide[offset] = _mm256_add_epi16(outer, middle);
+        if (offset > 0 && offset < 4) {
+            narrow[offset - 1] = _mm256_add_epi16(_mm256_add_epi16(r1, r3), _mm256_slli_epi16(r2, 1));
+        }
+    }
+    const __m256i outer = _mm256_add_epi16(_mm256_add_epi16(wide[0], wide[4]), _mm256_slli_epi16(_mm256_add_epi16(wide[1], wide[3]), 2));
+    const __m256i wide_blur = _mm256_add_epi16(outer, _mm256_add_epi16(_mm256_slli_epi16(wide[2], 2), _mm256_slli_epi16(wide[2], 1)));
+    const __m256i narrow_sum = _mm256_add_epi16(_mm256_add_epi16(narrow[0], narrow[2]), _mm256_slli_epi16(narrow[1], 1));
+    const __m256i narrow_blur = _mm256_slli_epi16(narrow_sum, 4);
+
+    // wide > narrow + threshold, unsigned. Saturation is safe since wide never reaches 65535.
+    const __m256i excess = _mm256_subs_epu16(wide_blur, _mm256_adds_epu16(narrow_blur, threshold));
+    const __m256i not_edge = _mm256_cmpeq_epi16(excess, _mm256_setzero_si256());
+    store_mask16(dst + x, _mm256_xor_si256(not_edge, _mm256_set1_epi16(-1)));
+}
+
+/**
+ * Threshold the difference of Gaussians of one row, 16 pixels at a time
+ */
+static void dog_avx2(const uint8_t* const* rows, uint8_t* dst, size_t n, int threshold)
+{
+    if (n < 20) {
+        scalar_kernels.dog(rows, dst, n, threshold);
+        return;
+    }
+    const __m256i limit = _mm256_set1_epi16(threshold < 65535 ? threshold : 65535);
+    dst[0] = dst[1] = 0;
+    dst[n - 2] = dst[n - 1] = 0;
+    for (size_t x = 2; x + 18 <= n; x += 16) {
+        dog16(rows, dst, x, limit);
+    }
+    dog16(rows, dst, n - 18, limit);
+}
+
+/**
+ * Look up the color of each palette index, 8 pixels per gather
+ */
+static void expand_avx2(const uint8_t* indices, uint8_t* dst, size_t n, const uint8_t* palette)
+{
+    const __m256i pack = load_mask(pack_mask);
+    // The 12 bytes of each lane next to each other in the low 24 bytes
+    const __m256i compact = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(indices + i)));
+        const __m256i colors = _mm256_i32gather_epi32((const int*)palette, index, 4);
+        const __m256i packed = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(colors, pack), compact);
+        _mm_storeu_si128((__m128i*)(dst + 3 * i), _mm256_castsi256_si128(packed));
+        _mm_storel_epi64((__m128i*)(dst + 3 * i + 16), _mm256_extracti128_si256(packed, 1));
+    }
+    scalar_kernels.expand(indices + i, dst + 3 * i, n - i, palette);
+}
+
+const KernelTable avx2_kernels = { "avx2", posterize_avx2, cell_sums_avx2, overlay_avx2, assign_avx2, sobel_avx2, dog_avx2, expand_avx2 };
@@ -0,0 +1,382 @@
+#include "kernels.h"
+
+#include <climits>
+#include <cstring>
+#include <immintrin.h>
+
+/**
+ * kernels-avx512.cpp
+ * AVX-512 (F + BW) kernels. Only built with -mavx512f -mavx512bw and only called after kernels()
+ *      checked the CPU, so nothing in this file may be shared with other translation units.
+ */
+
+// Shuffles gathering the B, G and R bytes of 16 BGR pixels from each of their three 16 byte blocks
+alignas(16) static const int8_t plane_masks[3][3][16] = {
+    { { 0, 3, 6, 9, 12, 15, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128 },
+        { -128, -128, -128, -128, -128, -128, 2, 5, 8, 11, 14, -128, -128, -128, -128, -128 },
+        { -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 1, 4, 7, 10, 13 } },
+    { { 1, 4, 7, 10, 13, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128 },
+        { -128, -128, -128, -128, -128, 0, 3, 6, 9, 12, 15, -128, -128, -128, -128, -128 },
+        { -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 2, 5, 8, 11, 14 } },
+    { { 2, 5, 8, 11, 14, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, -128 },
+        { -128, -128, -128, -128, -128, 1, 4, 7, 10, 13, -128, -128, -128, -128, -128, -128 },
+        { -128, -128, -128, -128, -128, -128, -128, -128, -128, -128, 0, 3, 6, 9, 12, 15 } },
+};
+
+// Shuffles repeating a per pixel byte three times to line up with each 16 byte block of BGR pixels
+alignas(16) static const int8_t expand_masks[3][16] = {
+    { 0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5 },
+    { 5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10 },
+    { 10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15 },
+};
+
+/**
+ * Load a 16 byte mask into all four 128 bit lanes
+ */
+static inline __m512i load_mask(const int8_t* mask) { return _mm512_broadcast_i32x4(_mm_load_si128((const __m128i*)mask)); }
+
+/**
+ * Load four 16 byte blocks spaced stride bytes apart into the four lanes
+ */
+static inline __m512i load_lanes(const uint8_t* p, size_t stride)
+{
+    __m512i v = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i*)p));
+    v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i*)(p + stride)), 1);
+    v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i*)(p + 2 * stride)), 2);
+    return _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i*)(p + 3 * stride)), 3);
+}
+
+/**
+ * Store the four lanes as 16 byte blocks spaced stride bytes apart
+ */
+static inline void store_lanes(uint8_t* p, size_t stride, __m512i v)
+{
+    _mm_storeu_si128((__m128i*)p, _mm512_extracti32x4_epi32(v, 0));
+    _mm_storeu_si128((__m128i*)(p + stride), _mm512_extracti32x4_epi32(v, 1));
+    _mm_storeu_si128((__m128i*)(p + 2 * stride), _mm512_extracti32x4_epi32(v, 2));
+    _mm_storeu_si128((__m128i*)(p + 3 * stride), _mm512_extracti32x4_epi32(v, 3));
+}
+
+/**
+ * Split 16 BGR pixels into B, G and R planes
+ */
+static inline void split16(const uint8_t* p, __m128i* planes)
+{
+    const __m128i v[3] = { _mm_loadu_si128((const __m128i*)p), _mm_loadu_si128((const __m128i*)(p + 16)),
+        _mm_loadu_si128((const __m128i*)(p + 32)) };
+    for (int c = 0; c < 3; ++c) {
+        planes[c] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v[0], _mm_load_si128((const __m128i*)plane_masks[c][0])),
+                                     _mm_shuffle_epi8(v[1], _mm_load_si128((const __m128i*)plane_masks[c][1]))),
+            _mm_shuffle_epi8(v[2], _mm_load_si128((const __m128i*)plane_masks[c][2])));
+    }
+}
+
+/**
+ * Widen 16 pixels into (b, g) and (r, 0) pairs of 16 bit fixed point values, one pair per 32 bit lane
+ */
+static inline void pairs16(const uint8_t* p, __m512i* bg, __m512i* r)
+{
+    __m128i planes[3];
+    split16(p, planes);
+    const __m128i zero = _mm_setzero_si128();
+    *bg = _mm512_slli_epi16(
+        _mm512_cvtepu8_epi16(_mm256_set_m128i(_mm_unpackhi_epi8(planes[0], planes[1]), _mm_unpacklo_epi8(planes[0], planes[1]))),
+        KERNEL_CENTER_BITS);
+    *r = _mm512_slli_epi16(
+        _mm512_cvtepu8_epi16(_mm256_set_m128i(_mm_unpackhi_epi8(planes[2], zero), _mm_unpacklo_epi8(planes[2], zero))), KERNEL_CENTER_BITS);
+}
+
+/**
+ * Find the nearest center for 32 pixels, matching the scalar tie breaking
+ * @param p 32 BGR pixels
+ * @param clusters Index of the nearest center of each pixel
+ */
+static inline void nearest32(const uint8_t* p, const int16_t* centers, int k, int32_t* clusters)
+{
+    __m512i bg[2], r[2];
+    pairs16(p, &bg[0], &r[0]);
+    pairs16(p + 48, &bg[1], &r[1]);
+
+    __m512i best_distance[2] = { _mm512_set1_epi32(INT_MAX), _mm512_set1_epi32(INT_MAX) };
+    __m512i best_cluster[2] = { _mm512_setzero_si512(), _mm512_setzero_si512() };
+    for (int cluster = 0; cluster < k; ++cluster) {
+        const __m512i center_bg = _mm512_set1_epi32((centers[3 * cluster + 1] << 16) | centers[3 * cluster]);
+        const __m512i center_r = _mm512_set1_epi32(centers[3 * cluster + 2]);
+        const __m512i index = _mm512_set1_epi32(cluster);
+        for (int half = 0; half < 2; ++half) {
+            const __m512i dbg = _mm512_sub_epi16(bg[half], center_bg);
+            const __m512i dr = _mm512_sub_epi16(r[half], center_r);
+            const __m512i distance = _mm512_add_epi32(_mm512_madd_epi16(dbg, dbg), _mm512_madd_epi16(dr, dr));
+            const __mmask16 less = _mm512_cmplt_epi32_mask(distance, best_distance[half]);
+            best_distance[half] = _mm512_min_epi32(best_distance[half], distance);
+            best_cluster[half] = _mm512_mask_blend_epi32(less, best_cluster[half], index);
+        }
+    }
+    _mm512_storeu_si512(clusters, best_cluster[0]);
+    _mm512_storeu_si512(clusters + 16, best_cluster[1]);
+}
+
+/**
+ * Replace each pixel with the color of the nearest center
+ */
+static void posterize_avx512(const uint8_t* src, uint8_t* dst, size_t n, const int16_t* centers, int k)
+{
+    uint8_t colors[3 * KERNEL_MAX_COLORS];
+    center_colors(centers, k, colors);
+    int32_t clusters[32];
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        nearest32(src + 3 * i, centers, k, clusters);
+        for (int lane = 0; lane < 32; ++lane) {
+            std::memcpy(dst + 3 * (i + lane), colors + 3 * clusters[lane], 3);
+        }
+    }
+    scalar_kernels.posterize(src + 3 * i, dst + 3 * i, n - i, centers, k);
+}
+
+/**
+ * Sum the intensity of a row of square cells
+ */
+static void cell_sums_avx512(const uint8_t* gray, size_t step, int cells, int size, uint32_t* sums)
+{
+    // 16 bit column sums hold up to 257 rows of 255
+    if (size > 257) {
+        scalar_kernels.cell_sums(gray, step, cells, size, sums);
+        return;
+    }
+    alignas(64) uint16_t columns[1024];
+    const int chunk_cells = 1024 / size;
+    for (int first = 0; first < cells; first += chunk_cells) {
+        const int chunk = cells - first < chunk_cells ? cells - first : chunk_cells;
+        const int width = chunk * size;
+        const uint8_t* base = gray + first * size;
+
+        // Add up each column of the chunk, 64 columns at a time
+        int x = 0;
+        for (; x + 64 <= width; x += 64) {
+            __m512i low = _mm512_setzero_si512();
+            __m512i high = _mm512_setzero_si512();
+            for (int row = 0; row < size; ++row) {
+                const uint8_t* p = base + row * step + x;
+                low = _mm512_add_epi16(low, _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)p)));
+                high = _mm512_add_epi16(high, _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)(p + 32))));
+            }
+            _mm512_store_si512(columns + x, low);
+            _mm512_store_si512(columns + x + 32, high);
+        }
+        for (; x < width; ++x) {
+            uint16_t sum = 0;
+            for (int row = 0; row < size; ++row) {
+                sum += base[row * step + x];
+            }
+            columns[x] = sum;
+        }
+
+        // Then add the columns of each cell
+        for (int cell = 0; cell < chunk; ++cell) {
+            uint32_t sum = 0;
+            for (int col = 0; col < size; ++col) {
+                sum += columns[cell * size + col];
+            }
+            sums[first + cell] = sum;
+        }
+    }
+}
+
+/**
+ * Combine edges, halftone dots and posterized pixels, 64 pixels at a time.
+ *      Each 128 bit lane holds 16 pixels split across three registers.
+ */
+static void overlay_avx512(const uint8_t* edges, const uint8_t* halftone, const uint8_t* posterized, uint8_t* dst, size_t n)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i bg_weights = _mm512_set1_epi32((GRAY_WEIGHT_G << 16) | GRAY_WEIGHT_B);
+    const __m512i r_weights = _mm512_set1_epi32(GRAY_WEIGHT_R);
+    const __m512i threshold = _mm512_set1_epi32(DOT_WEIGHT_THRESHOLD - 1);
+
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        const uint8_t* h = halftone + 3 * i;
+        const uint8_t* p = posterized + 3 * i;
+        __m512i hv[3], pv[3];
+        for (int j = 0; j < 3; ++j) {
+            hv[j] = load_lanes(h + 16 * j, 48);
+            pv[j] = load_lanes(p + 16 * j, 48);
+        }
+
+        // Split halftone pixels into B, G and R planes
+        __m512i planes[3];
+        for (int c = 0; c < 3; ++c) {
+            planes[c] = _mm512_or_si512(_mm512_or_si512(_mm512_shuffle_epi8(hv[0], load_mask(plane_masks[c][0])),
+                                            _mm512_shuffle_epi8(hv[1], load_mask(plane_masks[c][1]))),
+                _mm512_shuffle_epi8(hv[2], load_mask(plane_masks[c][2])));
+        }
+
+        // Gray weights in 32 bit lanes, four groups of four pixels per lane
+        const __m512i b16[2] = { _mm512_unpacklo_epi8(planes[0], zero), _mm512_unpackhi_epi8(planes[0], zero) };
+        const __m512i g16[2] = { _mm512_unpacklo_epi8(planes[1], zero), _mm512_unpackhi_epi8(planes[1], zero) };
+        const __m512i r16[2] = { _mm512_unpacklo_epi8(planes[2], zero), _mm512_unpackhi_epi8(planes[2], zero) };
+        __m512i dots[4];
+        for (int half = 0; half < 2; ++half) {
+            const __m512i bg_low = _mm512_unpacklo_epi16(b16[half], g16[half]);
+            const __m512i bg_high = _mm512_unpackhi_epi16(b16[half], g16[half]);
+            const __m512i r_low = _mm512_unpacklo_epi16(r16[half], zero);
+            const __m512i r_high = _mm512_unpackhi_epi16(r16[half], zero);
+            const __m512i weight_low = _mm512_add_epi32(_mm512_madd_epi16(bg_low, bg_weights), _mm512_madd_epi16(r_low, r_weights));
+            const __m512i weight_high = _mm512_add_epi32(_mm512_madd_epi16(bg_high, bg_weights), _mm512_madd_epi16(r_high, r_weights));
+            // All ones where the weight is above the threshold
+            dots[2 * half] = _mm512_srai_epi32(_mm512_sub_epi32(threshold, weight_low), 31);
+            dots[2 * half + 1] = _mm512_srai_epi32(_mm512_sub_epi32(threshold, weight_high), 31);
+        }
+        const __m512i dot = _mm512_packs_epi16(_mm512_packs_epi32(dots[0], dots[1]), _mm512_packs_epi32(dots[2], dots[3]));
+
+        const __m512i edge = load_lanes(edges + i, 16);
+        const __mmask64 keep = _mm512_cmpeq_epi8_mask(edge, zero) & ~_mm512_movepi8_mask(dot);
+        const __m512i keep_bytes = _mm512_movm_epi8(keep);
+
+        for (int j = 0; j < 3; ++j) {
+            const __mmask64 keep3 = _mm512_movepi8_mask(_mm512_shuffle_epi8(keep_bytes, load_mask(expand_masks[j])));
+            const __m512i out = _mm512_mask_blend_epi8(keep3, hv[j], _mm512_adds_epu8(pv[j], hv[j]));
+            store_lanes(dst + 3 * i + 16 * j, 48, out);
+        }
+    }
+    scalar_kernels.overlay(edges + i, halftone + 3 * i, posterized + 3 * i, dst + 3 * i, n - i);
+}
+
+/**
+ * k-means assignment step: add each sample to the sum of its nearest center
+ */
+static void assign_avx512(const uint8_t* samples, size_t n, const int16_t* centers, int k, uint32_t* sums, int32_t* counts)
+{
+    int32_t clusters[32];
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        const uint8_t* p = samples + 3 * i;
+        nearest32(p, centers, k, clusters);
+        for (int lane = 0; lane < 32; ++lane) {
+            uint32_t* sum = sums + 3 * clusters[lane];
+            sum[0] += p[3 * lane];
+            sum[1] += p[3 * lane + 1];
+            sum[2] += p[3 * lane + 2];
+            counts[clusters[lane]] += 1;
+        }
+    }
+    scalar_kernels.assign(samples + 3 * i, n - i, centers, k, sums, counts);
+}
+
+/**
+ * Widen 32 gray pixels to 16 bit lanes
+ */
+static inline __m512i load32(const uint8_t* p) { return _mm512_cvtepu8_epi16(_mm256_loadu_si256((const __m256i*)p)); }
+
+/**
+ * Store a 32 lane mask as bytes of all ones or zero
+ */
+static inline void store_mask32(uint8_t* p, __mmask32 mask)
+{
+    _mm512_mask_storeu_epi8(p, 0xffffffffULL, _mm512_movm_epi8(mask));
+}
+
+/**
+ * Threshold the Sobel gradient magnitude of 32 pixels starting at x
+ */
+static inline void sobel32(const uint8_t* a, const uint8_t* b, const uint8_t* c, uint8_t* dst, size_t x, __m512i threshold)
+{
+    const __m512i a0 = load32(a + x - 1), a1 = load32(a + x), a2 = load32(a + x + 1);
+    const __m512i b0 = load32(b + x - 1), b2 = load32(b + x + 1);
+    const __m512i c0 = load32(c + x - 1), c1 = load32(c + x), c2 = load32(c + x + 1);
+
+    const __m512i right = _mm512_add_epi16(_mm512_add_epi16(a2, c2), _mm512_slli_epi16(b2, 1));
+    const __m512i left = _mm512_add_epi16(_mm512_add_epi16(a0, c0), _mm512_slli_epi16(b0, 1));
+    const __m512i below = _mm512_add_epi16(_mm512_add_epi16(c0, c2), _mm512_slli_epi16(c1, 1));
+    const __m512i above = _mm512_add_epi16(_mm512_add_epi16(a0, a2), _mm512_slli_epi16(a1, 1));
+    const __m512i magnitude
+        = _mm512_add_epi16(_mm512_abs_epi16(_mm512_sub_epi16(right, left)), _mm512_abs_epi16(_mm512_sub_epi16(below, above)));
+    store_mask32(dst + x, _mm512_cmpgt_epi16_mask(magnitude, threshold));
+}
+
+/**
+ * Threshold the Sobel gradient magnitude of one row, 32 pixels at a time
+ */
+static void sobel_avx512(const uint8_t* const* rows, uint8_t* dst, size_t n, int threshold)
+{
+    if (n < 34) {
+        scalar_kernels.sobel(rows, dst, n, threshold);
+        return;
+    }
+    const __m512i limit = _mm512_set1_epi16(threshold);
+    dst[0] = 0;
+    dst[n - 1] = 0;
+    for (size_t x = 1; x + 33 <= n; x += 32) {
+        sobel32(rows[0], rows[1], rows[2], dst, x, limit);
+    }
+    // The last block overlaps the previous one instead of falling back to scalar
+    sobel32(rows[0], rows[1], rows[2], dst, n - 33, limit);
+}
+
+/**
+ * Threshold the difference of Gaussians of 32 pixels starting at x. Both blurs are scaled to
+ *      at most 65280 so they fit unsigned 16 bit lanes.
+ */
+static inline void dog32(const uint8_t* const* rows, uint8_t* dst, size_t x, __m512i threshold)
+{
+    __m512i wide[5], narrow[3];
+    for (int offset = 0; offset < 5; ++offset) {
+        const __m512i r0 = load32(rows[0] + x + offset - 2), r1 = load32(rows[1] + x + offset - 2);
+        const __m512i r2 = load32(rows[2] + x + offset - 2), r3 = load32(rows[3] + x + offset - 2);
+        const __m512i r4 = load32(rows[4] + x + offset - 2);
+        const __m512i middle = _mm512_add_epi16(_mm512_slli_epi16(r2, 2), _mm512_slli_epi16(r2, 1));
+        const __m512i outer = _mm512_add_epi16(_mm512_add_epi16(r0, r4), _mm512_slli_epi16(_mm512_add_epi16(r1, r3), 2));
+        wide[offset] = _mm512_add_epi16(outer, middle);
+        if (offset > 0 && offset < 4) {
+            narrow[offset - 1] = _mm512_add_epi16(_mm512_add_epi16(r1, r3), _mm512_slli_epi16(r2, 1));
+        }
+    }
+    const __m512i outer = _mm512_add_epi16(_mm512_add_epi16(wide[0], wide[4]), _mm512_slli_epi16(_mm512_add_epi16(wide[1], wide[3]), 2));
+    const __m512i wide_blur = _mm512_add_epi16(outer, _mm512_add_epi16(_mm512_slli_epi16(wide[2], 2), _mm512_slli_epi16(wide[2], 1)));
+    const __m512i narrow_sum = _mm512_add_epi16(_mm512_add_epi16(narrow[0], narrow[2]), _mm512_slli_epi16(narrow[1], 1));
+    const __m512i narrow_blur = _mm512_slli_epi16(narrow_sum, 4);
+
+    // Saturation is safe since wide never reaches 65535
+    store_mask32(dst + x, _mm512_cmpgt_epu16_mask(wide_blur, _mm512_adds_epu16(narrow_blur, threshold)));
+}
+
+/**
+ * Threshold the difference of Gaussians of one row, 32 pixels at a time
+ */
+static void dog_avx512(const uint8_t* const* rows, uint8_t* dst, size_t n, int threshold)
+{
+    if (n < 36) {
+        scalar_kernels.dog(rows, dst, n, threshold);
+        return;
+    }
+    const __m512i limit = _mm512_set1_epi16(threshold < 65535 ? threshold : 65535);
+    dst[0] = dst[1] = 0;
+    dst[n - 2] = dst[n - 1] = 0;
+    for (size_t x = 2; x + 34 <= n; x += 32) {
+        dog32(rows, dst, x, limit);
+    }
+    dog32(rows, dst, n - 34, limit);
+}
+
+/**
+ * Look up the color of each palette index, 16 pixels per gather
+ */
+static void expand_avx512(const uint8_t* indices, uint8_t* dst, size_t n, const uint8_t* palette)
+{
+    // Shuffle packing the BGR bytes of four 4 byte palette colors into 12 bytes: 0 1 2 4 5 6 8 9 10 12 13 14
+    const __m512i pack = _mm512_set4_epi32(0x80808080, 0x0E0D0C0A, 0x09080605, 0x04020100);
+    // The 12 bytes of each lane next to each other in the low 48 bytes
+    const __m512i compact = _mm512_setr_epi32(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, 3, 7, 11, 15);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const __m512i index = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(indices + i)));
+        const __m512i colors = _mm512_i32gather_epi32(index, palette, 4);
+        const __m512i packed = _mm512_permutexvar_epi32(compact, _mm512_shuffle_epi8(colors, pack));
+        _mm512_mask_storeu_epi8(dst + 3 * i, 0xFFFFFFFFFFFFull, packed);
+    }
+    scalar_kernels.expand(indices + i, dst + 3 * i, n - i, palette);
+}
+
+const KernelTable avx512_kernels = { "avx512", posterize_avx512, cell_sums_avx512, overlay_avx512, assign_avx512, sobel_avx512,
+    dog_avx512, expand_avx512 };
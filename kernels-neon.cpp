@@ -0,0 +1,312 @@
+#include "kernels.h"
+
+#include <arm_neon.h>
+#include <climits>
+#include <cstring>
+
+/**
+ * kernels-neon.cpp
+ * NEON kernels for ARM. Only called after kernels() checked the CPU.
+ */
+
+/**
+ * Find the nearest center for 16 pixels, matching the scalar tie breaking
+ * @param p 16 BGR pixels
+ * @param clusters Index of the nearest center of each pixel
+ */
+static inline void nearest16(const uint8_t* p, const int16_t* centers, int k, uint32_t* clusters)
+{
+    const uint8x16x3_t bgr = vld3q_u8(p);
+    int16x8_t planes[3][2];
+    for (int c = 0; c < 3; ++c) {
+        planes[c][0] = vreinterpretq_s16_u16(vshlq_n_u16(vmovl_u8(vget_low_u8(bgr.val[c])), KERNEL_CENTER_BITS));
+        planes[c][1] = vreinterpretq_s16_u16(vshlq_n_u16(vmovl_u8(vget_high_u8(bgr.val[c])), KERNEL_CENTER_BITS));
+    }
+
+    int32x4_t best_distance[4];
+    uint32x4_t best_cluster[4];
+    for (int q = 0; q < 4; ++q) {
+        best_distance[q] = vdupq_n_s32(INT_MAX);
+        best_cluster[q] = vdupq_n_u32(0);
+    }
+    for (int cluster = 0; cluster < k; ++cluster) {
+        const uint32x4_t index = vdupq_n_u32(cluster);
+        for (int half = 0; half < 2; ++half) {
+            const int16x8_t db = vsubq_s16(planes[0][half], vdupq_n_s16(centers[3 * cluster]));
+            const int16x8_t dg = vsubq_s16(planes[1][half], vdupq_n_s16(centers[3 * cluster + 1]));
+            const int16x8_t dr = vsubq_s16(planes[2][half], vdupq_n_s16(centers[3 * cluster + 2]));
+
+            int32x4_t distance[2];
+            distance[0] = vmull_s16(vget_low_s16(db), vget_low_s16(db));
+            distance[0] = vmlal_s16(distance[0], vget_low_s16(dg), vget_low_s16(dg));
+            distance[0] = vmlal_s16(distance[0], vget_low_s16(dr), vget_low_s16(dr));
+            distance[1] = vmull_s16(vget_high_s16(db), vget_high_s16(db));
+            distance[1] = vmlal_s16(distance[1], vget_high_s16(dg), vget_high_s16(dg));
+            distance[1] = vmlal_s16(distance[1], vget_high_s16(dr), vget_high_s16(dr));
+
+            for (int part = 0; part < 2; ++part) {
+                const int q = 2 * half + part;
+                const uint32x4_t less = vcltq_s32(distance[part], best_distance[q]);
+                best_distance[q] = vminq_s32(best_distance[q], distance[part]);
+                best_cluster[q] = vbslq_u32(less, index, best_cluster[q]);
+            }
+        }
+    }
+    for (int q = 0; q < 4; ++q) {
+        vst1q_u32(clusters + 4 * q, best_cluster[q]);
+    }
+}
+
+/**
+ * Replace each pixel with the color of the nearest center
+ */
+static void posterize_neon(const uint8_t* src, uint8_t* dst, size_t n, const int16_t* centers, int k)
+{
+    uint8_t colors[3 * KERNEL_MAX_COLORS];
+    center_colors(centers, k, colors);
+    uint32_t clusters[16];
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        nearest16(src + 3 * i, centers, k, clusters);
+        for (int lane = 0; lane < 16; ++lane) {
+            std::memcpy(dst + 3 * (i + lane), colors + 3 * clusters[lane], 3);
+        }
+    }
+    scalar_kernels.posterize(src + 3 * i, dst + 3 * i, n - i, centers, k);
+}
+
+/**
+ * Sum the intensity of a row of square cells
+ */
+static void cell_sums_neon(const uint8_t* gray, size_t step, int cells, int size, uint32_t* sums)
+{
+    // 16 bit column sums hold up to 257 rows of 255
+    if (size > 257) {
+        scalar_kernels.cell_sums(gray, step, cells, size, sums);
+        return;
+    }
+    uint16_t columns[1024];
+    const int chunk_cells = 1024 / size;
+    for (int first = 0; first < cells; first += chunk_cells) {
+        const int chunk = cells - first < chunk_cells ? cells - first : chunk_cells;
+        const int width = chunk * size;
+        const uint8_t* base = gray + first * size;
+
+        // Add up each column of the chunk, 16 columns at a time
+        int x = 0;
+        for (; x + 16 <= width; x += 16) {
+            uint16x8_t low = vdupq_n_u16(0);
+            uint16x8_t high = vdupq_n_u16(0);
+            for (int row = 0; row < size; ++row) {
+                const uint8x16_t v = vld1q_u8(base + row * step + x);
+                low = vaddw_u8(low, vget_low_u8(v));
+                high = vaddw_u8(high, vget_high_u8(v));
+            }
+            vst1q_u16(columns + x, low);
+            vst1q_u16(columns + x + 8, high);
+        }
+        for (; x < width; ++x) {
+            uint16_t sum = 0;
+            for (int row = 0; row < size; ++row) {
+                sum += base[row * step + x];
+            }
+            columns[x] = sum;
+        }
+
+        // Then add the columns of each cell
+        for (int cell = 0; cell < chunk; ++cell) {
+            uint32_t sum = 0;
+            for (int col = 0; col < size; ++col) {
+                sum += columns[cell * size + col];
+            }
+            sums[first + cell] = sum;
+        }
+    }
+}
+
+/**
+ * Check 4 gray weights against the dot threshold
+ * @return All ones in each lane holding a dot
+ */
+static inline uint16x4_t dot4(uint16x4_t b, uint16x4_t g, uint16x4_t r)
+{
+    uint32x4_t weight = vmull_n_u16(b, GRAY_WEIGHT_B);
+    weight = vmlal_n_u16(weight, g, GRAY_WEIGHT_G);
+    weight = vmlal_n_u16(weight, r, GRAY_WEIGHT_R);
+    return vmovn_u32(vcgtq_u32(weight, vdupq_n_u32(DOT_WEIGHT_THRESHOLD - 1)));
+}
+
+/**
+ * Combine edges, halftone dots and posterized pixels, 16 pixels at a time
+ */
+static void overlay_neon(const uint8_t* edges, const uint8_t* halftone, const uint8_t* posterized, uint8_t* dst, size_t n)
+{
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const uint8x16x3_t h = vld3q_u8(halftone + 3 * i);
+        const uint8x16x3_t p = vld3q_u8(posterized + 3 * i);
+
+        const uint16x8_t b_low = vmovl_u8(vget_low_u8(h.val[0])), b_high = vmovl_u8(vget_high_u8(h.val[0]));
+        const uint16x8_t g_low = vmovl_u8(vget_low_u8(h.val[1])), g_high = vmovl_u8(vget_high_u8(h.val[1]));
+        const uint16x8_t r_low = vmovl_u8(vget_low_u8(h.val[2])), r_high = vmovl_u8(vget_high_u8(h.val[2]));
+        const uint16x8_t dot_low = vcombine_u16(dot4(vget_low_u16(b_low), vget_low_u16(g_low), vget_low_u16(r_low)),
+            dot4(vget_high_u16(b_low), vget_high_u16(g_low), vget_high_u16(r_low)));
+        const uint16x8_t dot_high = vcombine_u16(dot4(vget_low_u16(b_high), vget_low_u16(g_high), vget_low_u16(r_high)),
+            dot4(vget_high_u16(b_high), vget_high_u16(g_high), vget_high_u16(r_high)));
+        const uint8x16_t dot = vcombine_u8(vmovn_u16(dot_low), vmovn_u16(dot_high));
+
+        const uint8x16_t keep = vbicq_u8(vceqq_u8(vld1q_u8(edges + i), vdupq_n_u8(0)), dot);
+
+        uint8x16x3_t out;
+        for (int c = 0; c < 3; ++c) {
+            out.val[c] = vbslq_u8(keep, vqaddq_u8(p.val[c], h.val[c]), h.val[c]);
+        }
+        vst3q_u8(dst + 3 * i, out);
+    }
+    scalar_kernels.overlay(edges + i, halftone + 3 * i, posterized + 3 * i, dst + 3 * i, n - i);
+}
+
+/**
+ * k-means assignment step: add each sample to the sum of its nearest center
+ */
+static void assign_neon(const uint8_t* samples, size_t n, const int16_t* centers, int k, uint32_t* sums, int32_t* counts)
+{
+    uint32_t clusters[16];
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        const uint8_t* p = samples + 3 * i;
+        nearest16(p, centers, k, clusters);
+        for (int lane = 0; lane < 16; ++lane) {
+            uint32_t* sum = sums + 3 * clusters[lane];
+            sum[0] += p[3 * lane];
+            sum[1] += p[3 * lane + 1];
+            sum[2] += p[3 * lane + 2];
+            counts[clusters[lane]] += 1;
+        }
+    }
+    scalar_kernels.assign(samples + 3 * i, n - i, centers, k, sums, counts);
+}
+
+/**
+ * Widen 8 gray pixels to 16 bit lanes
+ */
+static inline uint16x8_t load8(const uint8_t* p) { return vmovl_u8(vld1_u8(p)); }
+
+/**
+ * Threshold the Sobel gradient magnitude of 8 pixels starting at x
+ */
+static inline void sobel8(const uint8_t* a, const uint8_t* b, const uint8_t* c, uint8_t* dst, size_t x, int16x8_t threshold)
+{
+    const uint16x8_t a0 = load8(a + x - 1), a1 = load8(a + x), a2 = load8(a + x + 1);
+    const uint16x8_t b0 = load8(b + x - 1), b2 = load8(b + x + 1);
+    const uint16x8_t c0 = load8(c + x - 1), c1 = load8(c + x), c2 = load8(c + x + 1);
+
+    const int16x8_t right = vreinterpretq_s16_u16(vaddq_u16(vaddq_u16(a2, c2), vshlq_n_u16(b2, 1)));
+    const int16x8_t left = vreinterpretq_s16_u16(vaddq_u16(vaddq_u16(a0, c0), vshlq_n_u16(b0, 1)));
+    const int16x8_t below = vreinterpretq_s16_u16(vaddq_u16(vaddq_u16(c0, c2), vshlq_n_u16(c1, 1)));
+    const int16x8_t above = vreinterpretq_s16_u16(vaddq_u16(vaddq_u16(a0, a2), vshlq_n_u16(a1, 1)));
+    const int16x8_t magnitude = vaddq_s16(vabsq_s16(vsubq_s16(right, left)), vabsq_s16(vsubq_s16(below, above)));
+    vst1_u8(dst + x, vmovn_u16(vcgtq_s16(magnitude, threshold)));
+}
+
+/**
+ * Threshold the Sobel gradient magnitude of one row, 8 pixels at a time
+ */
+static void sobel_neon(const uint8_t* const* rows, uint8_t* dst, size_t n, int threshold)
+{
+    if (n < 10) {
+        scalar_kernels.sobel(rows, dst, n, threshold);
+        return;
+    }
+    const int16x8_t limit = vdupq_n_s16(threshold);
+    dst[0] = 0;
+    dst[n - 1] = 0;
+    for (size_t x = 1; x + 9 <= n; x += 8) {
+        sobel8(rows[0], rows[1], rows[2], dst, x, limit);
+    }
+    // The last block overlaps the previous one instead of falling back to scalar
+    sobel8(rows[0], rows[1], rows[2], dst, n - 9, limit);
+}
+
+/**
+ * Threshold the difference of Gaussians of 8 pixels starting at x. Both blurs are scaled to
+ *      at most 65280 so they fit unsigned 16 bit lanes.
+ */
+static inline void dog8(const uint8_t* const* rows, uint8_t* dst, size_t x, uint16x8_t threshold)
+{
+    uint16x8_t wide[5], narrow[3];
+    for (int offset = 0; offset < 5; ++offset) {
+        const uint16x8_t r0 = load8(rows[0] + x + offset - 2), r1 = load8(rows[1] + x + offset - 2);
+        const uint16x8_t r2 = load8(rows[2] + x + offset - 2), r3 = load8(rows[3] + x + offset - 2);
+        const uint16x8_t r4 = load8(rows[4] + x + offset - 2);
+        const uint16x8_t outer = vaddq_u16(vaddq_u16(r0, r4), vshlq_n_u16(vaddq_u16(r1, r3), 2));
+        wide[offset] = vmlaq_n_u16(outer, r2, 6);
+        if (offset > 0 && offset < 4) {
+            narrow[offset - 1] = vaddq_u16(vaddq_u16(r1, r3), vshlq_n_u16(r2, 1));
+        }
+    }
+    const uint16x8_t outer = vaddq_u16(vaddq_u16(wide[0], wide[4]), vshlq_n_u16(vaddq_u16(wide[1], wide[3]), 2));
+    const uint16x8_t wide_blur = vmlaq_n_u16(outer, wide[2], 6);
+    const uint16x8_t narrow_blur = vshlq_n_u16(vaddq_u16(vaddq_u16(narrow[0], narrow[2]), vshlq_n_u16(narrow[1], 1)), 4);
+
+    // Saturation is safe since wide never reaches 65535
+    vst1_u8(dst + x, vmovn_u16(vcgtq_u16(wide_blur, vqaddq_u16(narrow_blur, threshold))));
+}
+
+/**
+ * Threshold the difference of Gaussians of one row, 8 pixels at a time
+ */
+static void dog_neon(const uint8_t* const* rows, uint8_t* dst, size_t n, int threshold)
+{
+    if (n < 12) {
+        scalar_kernels.dog(rows, dst, n, threshold);
+        return;
+    }
+    const uint16x8_t limit = vdupq_n_u16(threshold < 65535 ? threshold : 65535);
+    dst[0] = dst[1] = 0;
+    dst[n - 2] = dst[n - 1] = 0;
+    for (size_t x = 2; x + 10 <= n; x += 8) {
+        dog8(rows, dst, x, limit);
+    }
+    dog8(rows, dst, n - 10, limit);
+}
+
+/**
+ * Look up the color of each palette index, 16 pixels at a time with table lookups on AArch64.
+ *      32 bit ARM has no 64 byte table lookup and uses the scalar loop.
+ */
+static void expand_neon(const uint8_t* indices, uint8_t* dst, size_t n, const uint8_t* palette)
+{
+    size_t i = 0;
+#if defined(__aarch64__)
+    // B, G and R planes of the palette, four tables of 64 colors each
+    uint8x16x4_t tables[3][4];
+    for (int part = 0; part < 4; ++part) {
+        for (int q = 0; q < 4; ++q) {
+            const uint8x16x4_t colors = vld4q_u8(palette + 256 * part + 64 * q);
+            for (int c = 0; c < 3; ++c) {
+                tables[c][part].val[q] = colors.val[c];
+            }
+        }
+    }
+    const uint8x16_t part_size = vdupq_n_u8(64);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t index = vld1q_u8(indices + i);
+        uint8x16x3_t bgr;
+        for (int c = 0; c < 3; ++c) {
+            bgr.val[c] = vqtbl4q_u8(tables[c][0], index);
+        }
+        // Indices outside a table leave the lanes alone, earlier parts wrap around past 255
+        for (int part = 1; part < 4; ++part) {
+            index = vsubq_u8(index, part_size);
+            for (int c = 0; c < 3; ++c) {
+                bgr.val[c] = vqtbx4q_u8(bgr.val[c], tables[c][part], index);
+            }
+        }
+        vst3q_u8(dst + 3 * i, bgr);
+    }
+#endif
+    scalar_kernels.expand(indices + i, dst + 3 * i, n - i, palette);
+}
+
+const KernelTable neon_kernels = { "neon", posterize_neon, cell_sums_neon, overlay_neon, assign_neon, sobel_neon, dog_neon, expand_neon };
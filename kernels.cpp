@@ -0,0 +1,257 @@
+#include "kernels.h"
+#include "config.h"
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#if defined(__aarch64__) || defined(__arm__)
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+/**
+ * Find the nearest center to a pixel
+ * @return Index of the nearest center, the lowest index wins ties
+ */
+static int nearest(const uint8_t* pixel, const int16_t* centers, int k)
+{
+    int best_distance = INT_MAX;
+    int best_cluster = 0;
+    for (int cluster = 0; cluster < k; ++cluster) {
+        const int db = (pixel[0] << KERNEL_CENTER_BITS) - centers[3 * cluster];
+        const int dg = (pixel[1] << KERNEL_CENTER_BITS) - centers[3 * cluster + 1];
+        const int dr = (pixel[2] << KERNEL_CENTER_BITS) - centers[3 * cluster + 2];
+        const int distance = db * db + dg * dg + dr * dr;
+        if (distance < best_distance) {
+            best_distance = distance;
+            best_cluster = cluster;
+        }
+    }
+    return best_cluster;
+}
+
+/**
+ * Replace each pixel with the color of the nearest center
+ */
+static void posterize_scalar(const uint8_t* src, uint8_t* dst, size_t n, const int16_t* centers, int k)
+{
+    uint8_t colors[3 * KERNEL_MAX_COLORS];
+    center_colors(centers, k, colors);
+    for (size_t i = 0; i < n; ++i) {
+        std::memcpy(dst + 3 * i, colors + 3 * nearest(src + 3 * i, centers, k), 3);
+    }
+}
+
+/**
+ * Sum the intensity of a row of square cells
+ */
+static void cell_sums_scalar(const uint8_t* gray, size_t step, int cells, int size, uint32_t* sums)
+{
+    for (int cell = 0; cell < cells; ++cell) {
+        uint32_t sum = 0;
+        for (int row = 0; row < size; ++row) {
+            const uint8_t* p = gray + row * step + cell * size;
+            for (int col = 0; col < size; ++col) {
+                sum += p[col];
+            }
+        }
+        sums[cell] = sum;
+    }
+}
+
+/**
+ * Combine edges, halftone dots and posterized pixels
+ */
+static void overlay_scalar(const uint8_t* edges, const uint8_t* halftone, const uint8_t* posterized, uint8_t* dst, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        const uint8_t* h = halftone + 3 * i;
+        const uint8_t* p = posterized + 3 * i;
+        const int weight = h[0] * GRAY_WEIGHT_B + h[1] * GRAY_WEIGHT_G + h[2] * GRAY_WEIGHT_R;
+        const bool keep = edges[i] == 0 && weight < DOT_WEIGHT_THRESHOLD;
+        for (int c = 0; c < 3; ++c) {
+            const int value = keep ? h[c] + p[c] : h[c];
+            dst[3 * i + c] = value > 255 ? 255 : value;
+        }
+    }
+}
+
+/**
+ * k-means assignment step: add each sample to the sum of its nearest center
+ */
+static void assign_scalar(const uint8_t* samples, size_t n, const int16_t* centers, int k, uint32_t* sums, int32_t* counts)
+{
+    for (size_t i = 0; i < n; ++i) {
+        const uint8_t* s = samples + 3 * i;
+        const int cluster = nearest(s, centers, k);
+        sums[3 * cluster] += s[0];
+        sums[3 * cluster + 1] += s[1];
+        sums[3 * cluster + 2] += s[2];
+        counts[cluster] += 1;
+    }
+}
+
+/**
+ * Threshold the Sobel gradient magnitude of one row
+ */
+static void sobel_scalar(const uint8_t* const* rows, uint8_t* dst, size_t n, int threshold)
+{
+    const uint8_t* a = rows[0];
+    const uint8_t* b = rows[1];
+    const uint8_t* c = rows[2];
+    for (size_t x = 0; x < n; ++x) {
+        if (x == 0 || x + 1 == n) {
+            dst[x] = 0;
+            continue;
+        }
+        const int gx = (a[x + 1] + 2 * b[x + 1] + c[x + 1]) - (a[x - 1] + 2 * b[x - 1] + c[x - 1]);
+        const int gy = (c[x - 1] + 2 * c[x] + c[x + 1]) - (a[x - 1] + 2 * a[x] + a[x + 1]);
+        dst[x] = std::abs(gx) + std::abs(gy) > threshold ? 255 : 0;
+    }
+}
+
+/**
+ * Threshold the difference of Gaussians of one row
+ */
+static void dog_scalar(const uint8_t* const* rows, uint8_t* dst, size_t n, int threshold)
+{
+    // Vertical passes of the 5 tap (1 4 6 4 1) and 3 tap (1 2 1) binomials
+    auto wide = [rows](size_t x) { return rows[0][x] + 4 * rows[1][x] + 6 * rows[2][x] + 4 * rows[3][x] + rows[4][x]; };
+    auto narrow = [rows](size_t x) { return rows[1][x] + 2 * rows[2][x] + rows[3][x]; };
+    for (size_t x = 0; x < n; ++x) {
+        if (x < 2 || x + 2 >= n) {
+            dst[x] = 0;
+            continue;
+        }
+        // Both blurs scaled to 256 times the gray level
+        const int wide_blur = wide(x - 2) + 4 * wide(x - 1) + 6 * wide(x) + 4 * wide(x + 1) + wide(x + 2);
+        const int narrow_blur = 16 * (narrow(x - 1) + 2 * narrow(x) + narrow(x + 1));
+        dst[x] = wide_blur - narrow_blur > threshold ? 255 : 0;
+    }
+}
+
+/**
+ * Look up the color of each palette index
+ */
+static void expand_scalar(const uint8_t* indices, uint8_t* dst, size_t n, const uint8_t* palette)
+{
+    for (size_t i = 0; i < n; ++i) {
+        std::memcpy(dst + 3 * i, palette + 4 * indices[i], 3);
+    }
+}
+
+const KernelTable scalar_kernels
+    = { "scalar", posterize_scalar, cell_sums_scalar, overlay_scalar, assign_scalar, sobel_scalar, dog_scalar, expand_scalar };
+
+/**
+ * Round fixed point centers to the colors posterize writes
+ * @param centers k fixed point BGR centers
+ * @param k Number of centers
+ * @param colors k BGR colors
+ */
+void center_colors(const int16_t* centers, int k, uint8_t* colors)
+{
+    for (int i = 0; i < 3 * k; ++i) {
+        colors[i] = (centers[i] + KERNEL_CENTER_SCALE / 2) >> KERNEL_CENTER_BITS;
+    }
+}
+
+/**
+ * Check whether this CPU can run a kernel table
+ * @param table Kernel table
+ * @return True if supported
+ */
+static bool is_supported(const KernelTable* table)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+#ifdef VRVISOR_HAVE_AVX512
+    if (table == &avx512_kernels) {
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+    }
+#endif
+#ifdef VRVISOR_HAVE_AVX2
+    if (table == &avx2_kernels) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+#endif
+#ifdef VRVISOR_HAVE_NEON
+    if (table == &neon_kernels) {
+#if defined(__aarch64__)
+        return getauxval(AT_HWCAP) & HWCAP_ASIMD;
+#else
+        return getauxval(AT_HWCAP) & HWCAP_NEON;
+#endif
+    }
+#endif
+    return table == &scalar_kernels;
+}
+
+/**
+ * Get every kernel table this CPU can run, scalar first
+ * @param tables Array to fill
+ * @param max_tables Size of tables
+ * @return Number of tables
+ */
+size_t supported_kernels(const KernelTable** tables, size_t max_tables)
+{
+    const KernelTable* compiled[] = {
+        &scalar_kernels,
+#ifdef VRVISOR_HAVE_NEON
+        &neon_kernels,
+#endif
+#ifdef VRVISOR_HAVE_AVX2
+        &avx2_kernels,
+#endif
+#ifdef VRVISOR_HAVE_AVX512
+        &avx512_kernels,
+#endif
+    };
+    size_t count = 0;
+    for (const KernelTable* table : compiled) {
+        if (count < max_tables && is_supported(table)) {
+            tables[count++] = table;
+        }
+    }
+    return count;
+}
+
+/**
+ * Choose the fastest supported kernel table, or the one named by VRVISOR_KERNELS
+ * @return Kernel table
+ */
+static const KernelTable* select_kernels()
+{
+    const KernelTable* tables[8];
+    size_t count = supported_kernels(tables, 8);
+    const KernelTable* selected = tables[count - 1];
+
+    std::string name = config_string("VRVISOR_KERNELS", "");
+    if (!name.empty()) {
+        bool found = false;
+        for (size_t i = 0; i < count; ++i) {
+            if (name == tables[i]->name) {
+                selected = tables[i];
+                found = true;
+            }
+        }
+        if (!found) {
+            std::cerr << "kernels: " << name << " is not supported on this CPU" << std::endl;
+        }
+    }
+    std::cout << "kernels: " << selected->name << std::endl;
+    return selected;
+}
+
+/**
+ * Get the kernels for this CPU
+ * @return Selected kernels
+ */
+const KernelTable& kernels()
+{
+    static const KernelTable* selected = select_kernels();
+    return *selected;
+}
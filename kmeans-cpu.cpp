@@ -1,3 +1,6 @@
+#include "kernels.h"
+#include "kmeans.h"
+
 #include <opencv2/opencv.hpp>
 
 /**
@@ -13,12 +16,48 @@ cv::Mat kmeans(cv::Mat src, cv::Mat means, size_t k, size_t max_iterations)
     cv::Mat samples;
     cv::resize(src, samples, src.size() / 4);
     samples = samples.reshape(1, samples.rows * samples.cols);
-    samples.convertTo(samples, CV_32F);
 
-    cv::TermCriteria criteria(cv::TermCriteria::EPS | cv::TermCriteria::MAX_ITER, max_iterations, 1.0);
+    // Seed with k-means++ if there is no previous color set to start from
+    if (means.empty() || means.cols != (int)k) {
+        samples.convertTo(samples, CV_32F);
+        cv::TermCriteria criteria(cv::TermCriteria::EPS | cv::TermCriteria::MAX_ITER, max_iterations, 1.0);
+
+        cv::Mat centers, labels;
+        cv::kmeans(samples, k, labels, criteria, 1, cv::KMEANS_PP_CENTERS, centers);
+
+        return snap_means(centers.t());
+    }
+
+    // Otherwise refine the previous color set. Samples stay 8 bit and are assigned to the
+    // fixed point centers, the new centers are still averaged as floats.
+    cv::Mat centers = means.t();
+    cv::Mat palette;
+    std::vector<uint32_t> sums(3 * k);
+    std::vector<int32_t> counts(k);
+    for (size_t iteration = 0; iteration < max_iterations; ++iteration) {
+        centers.convertTo(palette, CV_16S, KERNEL_CENTER_SCALE);
+        palette = cv::max(palette, 0.0);
+        palette = cv::min(palette, (double)KERNEL_CENTER_MAX);
+        std::fill(sums.begin(), sums.end(), 0);
+        std::fill(counts.begin(), counts.end(), 0);
+        kernels().assign(samples.ptr<uint8_t>(0), samples.rows, palette.ptr<int16_t>(0), k, sums.data(), counts.data());
 
-    cv::Mat centers, labels;
-    cv::kmeans(samples, k, labels, criteria, 1, cv::KMEANS_PP_CENTERS, centers);
+        // Colors with no samples keep their previous value
+        cv::Mat new_centers = centers.clone();
+        for (size_t cluster = 0; cluster < k; ++cluster) {
+            if (counts[cluster] > 0) {
+                for (int c = 0; c < 3; ++c) {
+                    new_centers.at<float>(cluster, c) = (float)sums[3 * cluster + c] / counts[cluster];
+                }
+            }
+        }
 
-    return centers.t();
-}
\ No newline at end of file
+        // Stop early if change in means is less than threshold
+        double change = cv::norm(centers, new_centers);
+        centers = new_centers;
+        if (change < 1.0) {
+            break;
+        }
+    }
+    return snap_means(centers.t());
+}
@@ -1,4 +1,120 @@
 #include "kmeans.h"
+#include "config.h"
+#include "kernels.h"
+#include "perf.h"
+#include "placement.h"
+#include "timing.h"
+
+#include <cstdio>
+#include <sys/stat.h>
+
+/**
+ * Round means to the fixed point grid of the posterize kernels, KERNEL_CENTER_SCALE steps
+ *      per level, and clamp them to 0 to 255. Posterize then assigns every pixel to the
+ *      mean float distances would pick.
+ * @param means 3 x k float means
+ * @return 3 x k float means on the grid
+ */
+cv::Mat snap_means(cv::Mat means)
+{
+    cv::Mat fixed, snapped;
+    means.convertTo(fixed, CV_16S, KERNEL_CENTER_SCALE);
+    fixed = cv::max(fixed, 0.0);
+    fixed = cv::min(fixed, (double)KERNEL_CENTER_MAX);
+    fixed.convertTo(snapped, CV_32F, 1.0 / KERNEL_CENTER_SCALE);
+    return snapped;
+}
+
+/**
+ * Get the default palette cache path, under $XDG_CACHE_HOME or ~/.cache
+ * @return Cache file path
+ */
+static std::string default_cache_path()
+{
+    std::string dir = config_string("XDG_CACHE_HOME", "");
+    if (dir.empty()) {
+        std::string home = config_string("HOME", "");
+        if (home.empty()) {
+            return "vrvisor-palette.yml";
+        }
+        dir = home + "/.cache";
+    }
+    return dir + "/vrvisor-palette.yml";
+}
+
+/**
+ * Load a palette saved by a previous run
+ * @param path Cache file path
+ * @param k Number of discrete colors
+ * @return 3 x k means, or an empty Mat if there is no usable palette for k colors
+ */
+static cv::Mat load_palette(const std::string& path, int k)
+{
+    cv::Mat means;
+    int stored_k = 0;
+    try {
+        cv::FileStorage fs(path, cv::FileStorage::READ);
+        if (fs.isOpened()) {
+            fs["k"] >> stored_k;
+            fs["means"] >> means;
+        }
+    } catch (cv::Exception& e) {
+        std::cerr << "kmeans: ignoring unreadable palette cache " << path << std::endl;
+        return cv::Mat();
+    }
+    if (stored_k != k || means.rows != 3 || means.cols != k || means.type() != CV_32F) {
+        return cv::Mat();
+    }
+    return snap_means(means); // Caches written before means were snapped
+}
+
+/**
+ * Save a palette for the next run. Written to a temporary file first so a crash
+ *      never leaves a half written cache.
+ * @param path Cache file path
+ * @param means 3 x k means
+ */
+static void save_palette(const std::string& path, const cv::Mat& means)
+{
+    size_t slash = path.rfind('/');
+    if (slash != std::string::npos && slash > 0) {
+        mkdir(path.substr(0, slash).c_str(), 0755); // Only the last directory, ~/.cache may not exist yet
+    }
+    std::string temp_path = path + ".tmp";
+    try {
+        cv::FileStorage fs(temp_path, cv::FileStorage::WRITE | cv::FileStorage::FORMAT_YAML);
+        if (!fs.isOpened()) {
+            std::cerr << "kmeans: cannot write palette cache " << path << std::endl;
+            return;
+        }
+        fs << "k" << means.cols;
+        fs << "means" << means;
+        fs.release();
+    } catch (cv::Exception& e) {
+        std::cerr << "kmeans: cannot write palette cache " << path << ": " << e.what() << std::endl;
+        return;
+    }
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        std::perror("kmeans: rename palette cache");
+    }
+}
+
+/**
+ * Make a fixed palette to render with before any means are known
+ * @param k Number of discrete colors
+ * @return 3 x k gray ramp from black to white
+ */
+static cv::Mat fallback_palette(int k)
+{
+    cv::Mat means(3, k, CV_32F);
+    for (int i = 0; i < k; ++i) {
+        float level = k > 1 ? 255.0f * i / (k - 1) : 128.0f;
+        for (int c = 0; c < 3; ++c) {
+            means.at<float>(c, i) = level;
+        }
+    }
+    return snap_means(means);
+}
 
 /**
  * Thread to continuously calculate color set
@@ -8,49 +124,86 @@
 void* kmeans_thread(void* arg)
 {
     Kmeans* parent = (Kmeans*)arg;
+    Placement::apply(ROLE_KMEANS);
+
+    // A cached palette is a better starting point than k-means++, the fallback palette is not
+    pthread_mutex_lock(&(parent->mutex));
+    cv::Mat seed = parent->source == PALETTE_CACHED ? parent->means.clone() : cv::Mat();
+    pthread_mutex_unlock(&(parent->mutex));
 
     size_t last_frame = 0;
     while (!parent->stopped) {
-        struct Frame frame = parent->src->getFrame(last_frame);
+        struct Frame frame = parent->src->getFrame(last_frame, parent->consumer);
+        if (frame.frame_num == last_frame) {
+            break; // getFrame only returns the same frame again once the source has ended, no new means will come
+        }
         last_frame = frame.frame_num;
-        cv::Mat new_means = kmeans(frame.image, parent->means, parent->k, parent->num_iterations);
+        cv::Mat new_means;
+        {
+            PerfScope scope("kmeans", frame.image.total());
+            new_means = kmeans(frame.image, seed, parent->k, parent->num_iterations);
+        }
+        seed = new_means;
 
         // Lock mutex before copying latest means to Kmeans object
         pthread_mutex_lock(&(parent->mutex));
+        if (parent->source != PALETTE_FRESH) {
+            std::cout << "kmeans: first palette " << process_uptime_ms() << " ms after process start" << std::endl;
+        }
         new_means.copyTo(parent->means);
+        parent->source = PALETTE_FRESH;
         pthread_cond_broadcast(&(parent->cond));
         pthread_mutex_unlock(&(parent->mutex));
     }
+    return NULL;
 }
 
 /**
- * Get latest calculated means
- * @return Latest means
+ * Start with the cached palette, or a fallback palette if there is none, and start
+ *      calculating fresh means in the background
+ * @param k Number of discrete colors
+ * @param num_iterations Iterations per frame
+ * @param src Source of frames
  */
 Kmeans::Kmeans(int k, int num_iterations, ImageCapture* src)
     : k(k)
     , num_iterations(num_iterations)
     , src(src)
+    , consumer(src->addConsumer("kmeans", false)) // Palettes lag frames anyway, so replays do not wait for k-means
+    , source(PALETTE_FALLBACK)
+    , cache_path(config_string("VRVISOR_PALETTE_CACHE", default_cache_path()))
     , stopped(false)
 {
+    if (cache_path != "none") {
+        means = load_palette(cache_path, k);
+    }
+    if (means.empty()) {
+        std::cout << "kmeans: no cached palette, starting with a gray ramp" << std::endl;
+        means = fallback_palette(k);
+    } else {
+        std::cout << "kmeans: starting with cached palette " << cache_path << std::endl;
+        source = PALETTE_CACHED;
+    }
+
     pthread_mutex_init(&mutex, NULL);
     pthread_cond_init(&cond, NULL);
     pthread_create(&thread, NULL, &kmeans_thread, this);
 }
 
-Kmeans::~Kmeans() { stop(); }
+Kmeans::~Kmeans()
+{
+    stop();
+    src->removeConsumer(consumer);
+}
 
 /**
- * Get latest calculated means
+ * Get latest calculated means without blocking. Until the first means are calculated
+ *      this is the cached or fallback palette.
  * @return Latest means
  */
 cv::Mat Kmeans::getMeans()
 {
     pthread_mutex_lock(&mutex);
-    // Block only if no means have yet been calculated
-    while (means.empty()) {
-        pthread_cond_wait(&cond, &mutex);
-    }
     cv::Mat latest;
     means.copyTo(latest);
     pthread_mutex_unlock(&mutex);
@@ -58,7 +211,19 @@ cv::Mat Kmeans::getMeans()
 }
 
 /**
- * Stop internal thread
+ * Get where the latest means came from
+ * @return Palette source
+ */
+PaletteSource Kmeans::getSource()
+{
+    pthread_mutex_lock(&mutex);
+    PaletteSource latest = source;
+    pthread_mutex_unlock(&mutex);
+    return latest;
+}
+
+/**
+ * Stop internal thread and save fresh means to the palette cache
  */
 void Kmeans::stop()
 {
@@ -68,6 +233,10 @@ void Kmeans::stop()
         pthread_mutex_unlock(&mutex);
         pthread_join(thread, NULL);
         pthread_cond_broadcast(&cond); // Wakeup anybody waiting
+
+        if (source == PALETTE_FRESH && cache_path != "none") {
+            save_palette(cache_path, means);
+        }
     } else {
         pthread_mutex_unlock(&mutex);
     }
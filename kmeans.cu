@@ -1,4 +1,5 @@
 #include "cuda.h"
+#include "kmeans.h"
 #include <algorithm>
 #include <cfloat>
 #include <chrono>
@@ -23,21 +24,21 @@ __device__ float squared_l3_distance(float x_1, float y_1, float z_1, float x_2,
 
 /**
  * GPU Method for assigning data points to a mean
- * @param data Source data
+ * @param data Source data, 8 bit
  * @param row_size Number of data points
  * @param means Current means
  * @param new_sums Sum of all values assigned to each mean
  * @param k Number of means
  * @param counts Counts of number of points assigned to each mean
  */
-__global__ void assign_clusters(const cv::cuda::PtrStepSzf data, int row_size, cv::cuda::PtrStepSzf means, cv::cuda::PtrStepSzf new_sums,
+__global__ void assign_clusters(const cv::cuda::PtrStepSzb data, int row_size, cv::cuda::PtrStepSzf means, cv::cuda::PtrStepSzf new_sums,
     int k, cv::cuda::PtrStepSz<int32_t> counts)
 {
     const int index = blockIdx.x * blockDim.x + threadIdx.x;
     if (index >= row_size)
         return;
 
-    // Make global loads once.
+    // Make global loads once, converting to float in registers.
     const float x = data(0, index);
     const float y = data(1, index);
     const float z = data(2, index);
@@ -90,15 +91,14 @@ __global__ void compute_new_means_and_reset(cv::cuda::PtrStepSzf means, cv::cuda
 static Mat generate_random_means(Mat src, size_t k)
 {
     Mat img = src.reshape(3, 1);
-    img.convertTo(img, CV_32FC3);
 
     std::mt19937 rng(std::random_device {}());
-    std::uniform_int_distribution<int> distribution(0, img.cols);
+    std::uniform_int_distribution<int> distribution(0, img.cols - 1);
 
-    // Pick k random pixels from source image
+    // Pick k random pixels from source image, only those are converted to float
     Mat centers(k, 1, CV_32FC3);
     for (int i = 0; i < k; ++i) {
-        centers.at<Vec3f>(i, 0) = img.at<Vec3f>(0, distribution(rng));
+        centers.at<Vec3f>(i, 0) = img.at<Vec3b>(0, distribution(rng));
     }
     centers = centers.reshape(1, k);
     return centers.t();
@@ -120,8 +120,7 @@ Mat kmeans(Mat src, Mat means, size_t k, size_t max_iterations)
     resize(src, data, src.size() / 2); // Down-sample original image
     data = data.reshape(1, data.total());
     data = data.t();
-    data.convertTo(data, CV_32F);
-    g_data.upload(data);
+    g_data.upload(data); // Uploaded as bytes, a quarter of the float size
 
     // Create random starting means of no starting point was given
     if (means.empty()) {
@@ -157,5 +156,5 @@ Mat kmeans(Mat src, Mat means, size_t k, size_t max_iterations)
         }
         means = new_means;
     }
-    return means;
+    return snap_means(means); // Onto the grid the posterize kernels compute distances on
 }
\ No newline at end of file
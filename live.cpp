@@ -1,8 +1,15 @@
 #include "capture.h"
 #include "effects.h"
+#include "graph.h"
 #include "kmeans.h"
+#include "perf.h"
+#include "placement.h"
+#include "presenter.h"
+#include "recording.h"
+#include "shmring.h"
 #include "timing.h"
 
+#include <chrono>
 #include <csignal>
 #include <opencv2/opencv.hpp>
 
@@ -15,6 +22,7 @@ bool stop = false;
 
 void stop_handler(int s) { stop = true; }
 
+
 int main(int argc, char** argv)
 {
     // Catch any stop signals to ensure proper cleanup
@@ -24,28 +32,64 @@ int main(int argc, char** argv)
     sigIntHandler.sa_flags = 0;
     sigaction(SIGINT, &sigIntHandler, NULL);
 
-    ImageCapture capture(0);
+    Placement::configure(Placement::fromEnvironment());
+    Placement::report(std::cout);
+
+    // Replay a recording in place of the camera, or record the camera
+    ReplayFile replay;
+    FrameRecorder recorder;
+    bool replaying = replay.openFromEnvironment();
+    bool recording = !replaying && recorder.openFromEnvironment();
+
+    ImageCapture capture(0, replaying ? &replay : NULL, recording ? &recorder : NULL);
     Kmeans kmeans_src(8, 100, &capture);
+    QualityController quality = QualityController::fromEnvironment();
+
+    // Finished frames can also go to other processes through shared memory, and be recorded
+    ShmRingWriter shm;
+    shm.openFromEnvironment();
+    FrameRecorder output;
+    output.openOutputFromEnvironment();
+
+    // Effects run at half size and are scaled back up, without blending colors for indexed frames
+    EffectOptions options = EffectOptions::fromEnvironment();
+    options.scale = 2;
+    if (shm.isIndexed() || output.isOpen()) {
+        options.interpolation = cv::INTER_NEAREST;
+    }
+    EffectGraph graph(options);
     size_t last_frame = 0;
+    int consumer = capture.addConsumer("render");
 
-    // Make window show up fullscreen
-    namedWindow("Window", cv::WINDOW_NORMAL);
-    setWindowProperty("Window", cv::WND_PROP_FULLSCREEN, cv::WINDOW_FULLSCREEN);
+    // The presenter thread owns the window, so display never stalls processing
+    Presenter presenter("Window", Presenter::fromEnvironment());
+
+    // Effects run on the main thread and the worker pool. Only now, so the presenter and
+    //      other helper threads started above do not inherit render CPUs and scheduling.
+    Placement::apply(ROLE_RENDER);
 
     while (!stop) {
         START_TIMING();
+        auto begin = std::chrono::steady_clock::now();
         try {
-            struct Frame frame = capture.getFrame(last_frame);
+            struct Frame frame = capture.getFrame(last_frame, consumer);
+            last_frame = frame.frame_num;
             Mat image = frame.image;
             resize(image, image, image.size() / 2);
 
-            Mat canny_overlay = Effects::canny(image);
-            Mat posterized = Effects::posterize(image, kmeans_src.getMeans());
-            Mat halftone_overlay = Effects::halftone(image);
-            Mat combined = Effects::overlay(canny_overlay, halftone_overlay, posterized);
-
-            resize(combined, combined, combined.size() * 2);
-            imshow("Window", combined);
+            Mat combined = graph.run(image, kmeans_src.getMeans(), quality.engine());
+            presenter.submit(combined);
+            output.submit(0, combined, frame.captured);
+            if (shm.isOpen()) {
+                std::vector<ShmStage> stages;
+                for (int node = 0; node < NODE_COUNT; ++node) {
+                    if (graph.enabled((EffectNode)node)) {
+                        stages.push_back({ effect_node_name((EffectNode)node), graph.nodeMs((EffectNode)node) });
+                    }
+                }
+                stages.push_back({ "frame", std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count() });
+                shm.publish(combined, frame.frame_num, frame.captured, stages);
+            }
         } catch (Exception e) {
             std::cout << e.what() << std::endl;
             break;
@@ -54,12 +98,24 @@ int main(int argc, char** argv)
             break;
         }
         STOP_TIMING("Frame Time");
+        Perf::countFrame();
+        quality.update(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count());
 
-        if (waitKey(1) == 27)
+        if (presenter.closed())
             break; // stop capturing by pressing ESC
+        if (capture.finished())
+            break; // replay is over
     }
     capture.stop();
+    recorder.close();
+    output.close();
     kmeans_src.stop();
+    presenter.stop();
+    presenter.report(std::cout);
+    capture.report(std::cout);
+    shm.report(std::cout);
+    shm.close();
+    Perf::report(std::cout);
 
     return 0;
 }
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include "effects.h"
+#include "graph.h"
 #include "kmeans.h"
+#include "placement.h"
 #include "timing.h"
 
 #include <opencv2/opencv.hpp>
@@ -23,18 +25,18 @@ int main(int argc, char** argv)
         iterations = std::atoi(argv[3]);
     }
 
+    Placement::configure(Placement::fromEnvironment());
+    Placement::apply(ROLE_RENDER);
+
     Mat image = imread(argv[1]);
     resize(image, image, Size(640, 480));
 
     START_TIMING();
     try {
-        // Generate effects sequentially
-        Mat canny_overlay = Effects::canny(image);
+        // Colors come first, then every effect runs as soon as its inputs are ready
         Mat means = kmeans(image, Mat(), k, iterations);
-        Mat posterized = Effects::posterize(image, means);
-        Mat halftone_overlay = Effects::halftone(image);
-        // Combine effects
-        Mat combined = Effects::overlay(canny_overlay, halftone_overlay, posterized);
+        EffectGraph graph(EffectOptions::fromEnvironment());
+        Mat combined = graph.run(image, means, edge_engine_from_environment());
         // Write result to file
         imwrite("post.jpg", combined);
     } catch (Exception& e) {
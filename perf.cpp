@@ -0,0 +1,295 @@
+#include "perf.h"
+#include "config.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+pthread_mutex_t Perf::mutex = PTHREAD_MUTEX_INITIALIZER;
+std::map<std::string, PerfStage> Perf::stages;
+size_t Perf::frames = 0;
+bool Perf::counters_seen = false;
+
+static const char* event_names[PERF_EVENT_COUNT] = { "cycles", "instructions", "LLC misses", "branch misses" };
+
+/**
+ * Counter group of one thread, opened on first use
+ */
+struct PerfThread {
+    bool opened;
+    int leader; // Group leader fd, -1 without counters
+    int fds[PERF_EVENT_COUNT];
+    int slot[PERF_EVENT_COUNT]; // Position of each event in a group read, -1 if it could not be opened
+    int count; // Events in the group
+    PerfScope* top; // Innermost open scope
+
+    PerfThread()
+        : opened(false)
+        , leader(-1)
+        , count(0)
+        , top(NULL)
+    {
+        for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+            fds[i] = -1;
+            slot[i] = -1;
+        }
+    }
+
+    ~PerfThread()
+    {
+        for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+            }
+        }
+    }
+};
+
+static thread_local PerfThread perf_thread;
+
+/**
+ * Open one counter of the calling thread
+ * @param type perf_event_attr type
+ * @param config perf_event_attr config
+ * @param group Group leader fd, or -1 to open a leader
+ * @return fd, or -1 with errno set
+ */
+static int open_counter(uint32_t type, uint64_t config, int group)
+{
+    struct perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1; // Allowed without privileges at the default perf_event_paranoid
+    attr.exclude_hv = 1;
+    attr.disabled = group < 0;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+/**
+ * Open the counter group of the calling thread. Events the CPU or hypervisor does not
+ *      offer are left out; without cycles the thread has no counters at all.
+ */
+static void open_thread_counters()
+{
+    PerfThread& thread = perf_thread;
+    thread.opened = true;
+
+    const uint64_t configs[PERF_EVENT_COUNT]
+        = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+    for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+        int fd = open_counter(PERF_TYPE_HARDWARE, configs[i], thread.leader);
+        if (fd < 0) {
+            if (i == PERF_CYCLES) {
+                static std::atomic<bool> warned(false);
+                if (!warned.exchange(true)) {
+                    // Once per process, every thread fails the same way
+                    std::cerr << "perf: hardware counters unavailable (" << std::strerror(errno) << "), recording CPU time only"
+                              << std::endl;
+                }
+                return;
+            }
+            continue;
+        }
+        if (thread.leader < 0) {
+            thread.leader = fd;
+        }
+        thread.fds[i] = fd;
+        thread.slot[i] = thread.count++;
+    }
+    ioctl(thread.leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(thread.leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+/**
+ * Check whether profiling is on
+ * @return True if VRVISOR_PERF is set
+ */
+bool Perf::enabled()
+{
+    static const bool on = config_bool("VRVISOR_PERF", false);
+    return on;
+}
+
+/**
+ * Count a finished frame, stage totals are reported per frame
+ */
+void Perf::countFrame()
+{
+    if (enabled()) {
+        pthread_mutex_lock(&mutex);
+        frames += 1;
+        pthread_mutex_unlock(&mutex);
+    }
+}
+
+/**
+ * Add the counts of one scope to a stage, called by PerfScope
+ * @param stage Stage name
+ * @param pixels Pixels processed, 0 if counted by another scope of the stage
+ * @param counts Event counts and time of the scope
+ */
+void Perf::record(const char* stage, size_t pixels, const PerfCounts& counts)
+{
+    pthread_mutex_lock(&mutex);
+    PerfStage& totals = stages[stage];
+    totals.calls += 1;
+    totals.pixels += pixels;
+    for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+        totals.counts.events[i] += counts.events[i];
+    }
+    totals.counts.ms += counts.ms;
+    counters_seen = counters_seen || perf_thread.leader >= 0;
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Add the wall clock latency of one run of a stage, reported next to its CPU time
+ * @param stage Stage name
+ * @param ms Milliseconds from start to finish of the run
+ */
+void Perf::recordLatency(const char* stage, double ms)
+{
+    pthread_mutex_lock(&mutex);
+    PerfStage& totals = stages[stage];
+    totals.runs += 1;
+    totals.latency_ms += ms;
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Read the counters of the calling thread. Events are raw, unscaled totals: scale the
+ *      difference of two reads by the differences of enabled and running.
+ * @param counts Set to the running totals of this thread
+ * @return False if this thread has no counters, counts then only has the CPU time
+ */
+bool Perf::read(PerfCounts& counts)
+{
+    PerfThread& thread = perf_thread;
+    if (!thread.opened) {
+        open_thread_counters();
+    }
+    std::memset(counts.events, 0, sizeof(counts.events));
+    counts.enabled = counts.running = 0;
+    // CPU time, so a stage preempted or waiting on a lock is not charged for it
+    struct timespec cpu;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    counts.ms = cpu.tv_sec * 1e3 + cpu.tv_nsec / 1e6;
+    if (thread.leader < 0) {
+        return false;
+    }
+
+    // nr, time enabled, time running, then one value per event
+    uint64_t values[3 + PERF_EVENT_COUNT];
+    if (::read(thread.leader, values, sizeof(values)) < (ssize_t)(3 * sizeof(uint64_t))) {
+        return false;
+    }
+    counts.enabled = values[1];
+    counts.running = values[2];
+    for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+        if (thread.slot[i] >= 0 && (uint64_t)thread.slot[i] < values[0]) {
+            counts.events[i] = values[3 + thread.slot[i]];
+        }
+    }
+    return true;
+}
+
+/**
+ * Print CPU time, latency, IPC and misses per pixel of every stage
+ * @param out Stream to print to
+ */
+void Perf::report(std::ostream& out)
+{
+    if (!enabled()) {
+        return;
+    }
+    pthread_mutex_lock(&mutex);
+    size_t per = frames > 0 ? frames : 1;
+    out << "perf: " << frames << " frames, per frame" << (counters_seen ? "" : ", no hardware counters") << std::endl;
+    for (const auto& entry : stages) {
+        const PerfStage& stage = entry.second;
+        const uint64_t* events = stage.counts.events;
+        out << "perf:   " << std::left << std::setw(24) << entry.first << std::right << std::fixed << std::setprecision(3)
+            << stage.counts.ms / per << " CPU ms";
+        if (stage.runs > 0) {
+            out << ", latency " << stage.latency_ms / stage.runs << " ms";
+        }
+        if (counters_seen) {
+            double ipc = events[PERF_CYCLES] > 0 ? (double)events[PERF_INSTRUCTIONS] / events[PERF_CYCLES] : 0;
+            out << ", " << std::setprecision(2) << events[PERF_CYCLES] / 1e6 / per << " M" << event_names[PERF_CYCLES] << ", IPC " << ipc;
+            if (stage.pixels > 0) {
+                out << std::setprecision(4) << ", " << (double)events[PERF_LLC_MISSES] / stage.pixels << " " << event_names[PERF_LLC_MISSES]
+                    << "/px, " << (double)events[PERF_BRANCH_MISSES] / stage.pixels << " " << event_names[PERF_BRANCH_MISSES] << "/px";
+            }
+        }
+        out << std::defaultfloat << std::setprecision(6) << std::endl;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Start counting
+ * @param stage Stage name, must outlive the scope
+ * @param pixels Pixels processed, 0 if counted by another scope of the stage
+ */
+PerfScope::PerfScope(const char* stage, size_t pixels)
+    : stage(stage)
+    , pixels(pixels)
+    , active(Perf::enabled())
+    , parent(NULL)
+{
+    if (!active) {
+        return;
+    }
+    std::memset(&total, 0, sizeof(total));
+
+    // The enclosing scope stops counting until this one ends
+    parent = perf_thread.top;
+    if (parent != NULL) {
+        parent->pause();
+    }
+    Perf::read(mark);
+    perf_thread.top = this;
+}
+
+PerfScope::~PerfScope()
+{
+    if (!active) {
+        return;
+    }
+    pause();
+    Perf::record(stage, pixels, total);
+    perf_thread.top = parent;
+    if (parent != NULL) {
+        Perf::read(parent->mark); // Resume the enclosing scope
+    }
+}
+
+/**
+ * Add the counts since the last mark to this scope and move the mark to now
+ */
+void PerfScope::pause()
+{
+    PerfCounts now;
+    Perf::read(now);
+    // Raw counts only grow, so their difference cannot wrap. Scale it up by the share of this
+    //      interval the kernel had the group on the CPU, if it multiplexed it with other users.
+    uint64_t enabled = now.enabled - mark.enabled, running = now.running - mark.running;
+    double scale = running > 0 && running < enabled ? (double)enabled / running : 1.0;
+    for (int i = 0; i < PERF_EVENT_COUNT; ++i) {
+        total.events[i] += (uint64_t)((now.events[i] - mark.events[i]) * scale);
+    }
+    total.enabled += enabled;
+    total.running += running;
+    total.ms += now.ms - mark.ms;
+    mark = now;
+}
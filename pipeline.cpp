@@ -1,108 +1,112 @@
 #include "pipeline.h"
 #include "effects.h"
+#include "placement.h"
 
-/**
- * Thread for performing Canny edge detection asynchronously
- * @param arg canny_thread_args*
- * @return NULL
- */
-static void* canny_thread(void* arg)
-{
-    auto args = (struct canny_thread_args*)arg;
-    *(args->result) = Effects::canny(*(args->src));
-    return NULL;
-}
+#include <algorithm>
+#include <chrono>
 
 /**
- * Thread for performing Halftone asynchronously
- * @param arg halftone_thread_args*
+ * Thread for processing an image asynchronously
+ * @param arg Pipeline* to parent object
  * @return NULL
  */
-static void* halftone_thread(void* arg)
+static void* pipeline_thread(void* arg)
 {
-    auto args = (struct halftone_thread_args*)arg;
-    *(args->result) = Effects::halftone(*(args->src));
-    return NULL;
-}
+    Pipeline* pipe = (Pipeline*)arg;
+    Placement::apply(ROLE_RENDER); // Once for the life of the pipeline, pool workers place themselves
 
-/**
- * Thread for performing posterize asynchronously
- * @param arg posterized_thread_args*
- * @return NULL
- */
-static void* posterized_thread(void* arg)
-{
-    auto args = (struct posterized_thread_args*)arg;
-    *(args->result) = Effects::posterize(*(args->src), *(args->centers));
+    pthread_mutex_lock(&(pipe->mutex));
+    while (true) {
+        // A frame asked for before stopping is still processed
+        while (!pipe->running && !pipe->stopped) {
+            pthread_cond_wait(&(pipe->cond), &(pipe->mutex));
+        }
+        if (!pipe->running) {
+            break;
+        }
+        pthread_mutex_unlock(&(pipe->mutex));
+        pipe->process();
+        pthread_mutex_lock(&(pipe->mutex));
+    }
+    pthread_mutex_unlock(&(pipe->mutex));
     return NULL;
 }
 
 /**
- * Process image with Canny, Halftone, and Posterize all asynchronously
- * @param src Source Image
- * @param means Discrete colors
- * @return Comicbook image
+ * Process the latest frame and hand the result to join(), called by the pipeline thread
  */
-static cv::Mat process_image(cv::Mat src, cv::Mat means)
+void Pipeline::process()
 {
-    cv::Mat image(src, Range::all(), Range(120, 520));
-
-    cv::Mat canny_overlay, halftone_overlay, posterized_image;
-    pthread_t canny_t, halftone_t, posterized_t;
-
-    // Create thread for each effect
-    struct canny_thread_args canny_args = { &image, &canny_overlay };
-    pthread_create(&canny_t, NULL, &canny_thread, &canny_args);
-
-    struct halftone_thread_args halftone_args = { &image, &halftone_overlay };
-    pthread_create(&halftone_t, NULL, &halftone_thread, &halftone_args);
-
-    struct posterized_thread_args posterized_args = { &image, &means, &posterized_image };
-    pthread_create(&posterized_t, NULL, &posterized_thread, &posterized_args);
-
-    // Join threads
-    pthread_join(canny_t, NULL);
-    pthread_join(halftone_t, NULL);
-    pthread_join(posterized_t, NULL);
+    struct Frame frame = capture->getFrame(last_frame, consumer);
+    last_frame = frame.frame_num;
+    auto begin = std::chrono::steady_clock::now();
+    cv::Mat processed;
+    bool threw = false;
+    cv::Exception caught;
+    try {
+        cv::Mat image(frame.image, Range::all(), Range(120, 520)); // Middle of the frame, the part each eye sees
+        processed = graph.run(image, kmeans_src->getMeans(), quality.engine());
+    } catch (cv::Exception& e) {
+        // An exception would end the process here, join() rethrows it to the caller instead
+        threw = true;
+        caught = e;
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+    quality.update(ms);
+    double stage_ms[NODE_COUNT];
+    for (int node = 0; node < NODE_COUNT; ++node) {
+        stage_ms[node] = graph.nodeMs((EffectNode)node);
+    }
 
-    // Overlay effects before returning result
-    Mat result = Effects::overlay(canny_overlay, halftone_overlay, posterized_image);
-    return result;
+    pthread_mutex_lock(&mutex);
+    if (threw) {
+        failed = true;
+        error = caught;
+    } else {
+        result = processed;
+        captured = frame.captured;
+        process_ms = ms;
+        std::copy(stage_ms, stage_ms + NODE_COUNT, node_ms);
+    }
+    running = false;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
 }
 
 /**
- * Thread for processing an image asynchronously
- * @param arg Pipeline* to parent object
- * @return NULL
+ * @param capture Source of frames
+ * @param kmeans_src Source of discrete colors
+ * @param quality Chooses the edge engine of this stream
+ * @param options Enabled effects
  */
-static void* pipeline_thread(void* arg)
-{
-    Pipeline* pipe = (Pipeline*)arg;
-
-    struct Frame frame = pipe->capture->getFrame(pipe->last_frame);
-    pipe->last_frame = frame.frame_num;
-    cv::Mat result = process_image(frame.image, pipe->kmeans_src->getMeans());
-
-    pthread_mutex_lock(&(pipe->mutex));
-    pipe->result = result;
-    pipe->running = false;
-    pthread_cond_signal(&(pipe->cond));
-    pthread_mutex_unlock(&(pipe->mutex));
-
-    return NULL;
-}
-
-Pipeline::Pipeline(ImageCapture* capture, Kmeans* kmeans_src)
+Pipeline::Pipeline(ImageCapture* capture, Kmeans* kmeans_src, QualityController quality, EffectOptions options)
     : capture(capture)
+    , consumer(capture->addConsumer("pipeline"))
     , kmeans_src(kmeans_src)
-    , running(false)
+    , quality(quality)
+    , graph(options)
     , last_frame(0)
+    , process_ms(0)
+    , node_ms()
+    , running(false)
+    , stopped(false)
+    , failed(false)
 {
     pthread_mutex_init(&mutex, NULL);
     pthread_cond_init(&cond, NULL);
+    pthread_create(&thread, NULL, &pipeline_thread, this);
 }
 
-Pipeline::~Pipeline() { join(); }
+Pipeline::~Pipeline()
+{
+    // The frame in flight, if any, is finished first and an exception of it is dropped
+    pthread_mutex_lock(&mutex);
+    stopped = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(thread, NULL);
+    capture->removeConsumer(consumer);
+}
 
 /**
  * Take latest image and means and process an image
@@ -112,23 +116,48 @@ void Pipeline::start()
     pthread_mutex_lock(&mutex);
     if (!running) {
         running = true;
-        pthread_create(&thread, NULL, &pipeline_thread, this);
+        pthread_cond_broadcast(&cond);
     }
     pthread_mutex_unlock(&mutex);
 }
 
 /**
- * Wait for latest processing image
+ * Wait for latest processing image. Throws the exception processing it raised, once.
  * @return Processed image
  */
 cv::Mat Pipeline::join()
 {
-    Mat ret;
     pthread_mutex_lock(&mutex);
     while (running) {
         pthread_cond_wait(&cond, &mutex);
     }
-    pthread_join(thread, NULL);
+    bool threw = failed;
+    cv::Exception error = this->error;
+    failed = false;
+    cv::Mat ret = result;
     pthread_mutex_unlock(&mutex);
-    return result;
-}
\ No newline at end of file
+    if (threw) {
+        throw error;
+    }
+    return ret;
+}
+
+/**
+ * Get what the latest processed image was made from, call after join
+ * @param captured Set to when its camera frame was grabbed
+ * @param process_ms Set to the time spent processing it
+ * @param node_ms Set to the time each effect node took on it, NODE_COUNT entries, 0 for pruned nodes, may be NULL
+ * @return Its capture frame number
+ */
+size_t Pipeline::lastFrame(std::chrono::steady_clock::time_point& captured, double& process_ms, double* node_ms)
+{
+    pthread_mutex_lock(&mutex);
+    captured = this->captured;
+    process_ms = this->process_ms;
+    if (node_ms != NULL) {
+        std::copy(this->node_ms, this->node_ms + NODE_COUNT, node_ms);
+    }
+    size_t frame_num = last_frame;
+    pthread_mutex_unlock(&mutex);
+    return frame_num;
+}
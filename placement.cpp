@@ -0,0 +1,312 @@
+#include "placement.h"
+#include "config.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <iostream>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sstream>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+PlacementPolicy Placement::policy = {};
+
+static const char* role_names[ROLE_COUNT] = { "capture", "kmeans", "render" };
+static const char* role_env[ROLE_COUNT] = { "VRVISOR_CAPTURE", "VRVISOR_KMEANS", "VRVISOR_RENDER" };
+static std::atomic<bool> role_logged[ROLE_COUNT];
+
+/**
+ * Parse a CPU list such as "0-3,6"
+ * @param list CPU list
+ * @param set Parsed CPUs
+ * @param bad Set to the first invalid item of the list
+ * @return True if the list was valid and not empty
+ */
+static bool parse_cpu_list(const std::string& list, cpu_set_t* set, std::string& bad)
+{
+    CPU_ZERO(set);
+    bad = list;
+    if (!list.empty() && list.back() == ',') {
+        return false;
+    }
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        bad = item;
+        int first, last;
+        char dash;
+        std::stringstream range(item);
+        if (!(range >> first)) {
+            return false;
+        }
+        last = first;
+        if (range >> dash) {
+            if (dash != '-' || !(range >> last)) {
+                return false;
+            }
+        }
+        // Nothing may follow, and the range must be ascending and within the CPU set
+        if (!(range >> std::ws).eof() || first < 0 || last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            CPU_SET(cpu, set);
+        }
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+/**
+ * Format a CPU set as a CPU list such as "0-3,6"
+ * @param set CPUs
+ * @return CPU list
+ */
+static std::string format_cpu_list(const cpu_set_t* set)
+{
+    std::stringstream ss;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, set)) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set)) {
+            ++last;
+        }
+        if (ss.tellp() > 0) {
+            ss << ",";
+        }
+        ss << cpu;
+        if (last != cpu) {
+            ss << "-" << last;
+        }
+        cpu = last;
+    }
+    return ss.str();
+}
+
+/**
+ * Find the NUMA node a CPU belongs to
+ * @param cpu CPU number
+ * @return Node number, or -1 if unknown
+ */
+static int cpu_node(int cpu)
+{
+    std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR* dir = opendir(path.c_str());
+    if (dir == NULL) {
+        return -1;
+    }
+    int node = -1;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (std::strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9') {
+            node = std::atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+/**
+ * Find the NUMA node of the first CPU in a set
+ * @param set CPUs
+ * @return Node number, or -1 if unknown
+ */
+static int first_node(const cpu_set_t* set)
+{
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, set)) {
+            return cpu_node(cpu);
+        }
+    }
+    return -1;
+}
+
+/**
+ * Split the CPUs this process may use between the roles: capture and k-means
+ *      get a CPU each and rendering gets the rest.
+ * @param policy Policy to fill in
+ */
+static void auto_partition(PlacementPolicy* policy)
+{
+    cpu_set_t available;
+    if (sched_getaffinity(0, sizeof(available), &available) != 0) {
+        return;
+    }
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &available)) {
+            cpus.push_back(cpu);
+        }
+    }
+    if (cpus.size() < 2) {
+        return;
+    }
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        CPU_ZERO(&policy->cpus[role]);
+        policy->pinned[role] = true;
+    }
+    if (cpus.size() == 2) {
+        // Capture and k-means share a CPU so rendering keeps one to itself
+        CPU_SET(cpus[0], &policy->cpus[ROLE_CAPTURE]);
+        CPU_SET(cpus[0], &policy->cpus[ROLE_KMEANS]);
+        CPU_SET(cpus[1], &policy->cpus[ROLE_RENDER]);
+        return;
+    }
+    CPU_SET(cpus[0], &policy->cpus[ROLE_CAPTURE]);
+    CPU_SET(cpus[1], &policy->cpus[ROLE_KMEANS]);
+    for (size_t i = 2; i < cpus.size(); ++i) {
+        CPU_SET(cpus[i], &policy->cpus[ROLE_RENDER]);
+    }
+}
+
+/**
+ * Build a policy from VRVISOR_* environment variables
+ * @return Policy
+ */
+PlacementPolicy Placement::fromEnvironment()
+{
+    PlacementPolicy result = {};
+    if (config_string("VRVISOR_PLACEMENT", "") == "auto") {
+        auto_partition(&result);
+    }
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        std::string prefix = role_env[role];
+        std::string cpus = config_string((prefix + "_CPUS").c_str(), "");
+        if (!cpus.empty()) {
+            std::string bad;
+            result.pinned[role] = parse_cpu_list(cpus, &result.cpus[role], bad);
+            if (!result.pinned[role]) {
+                std::cerr << "placement: ignoring invalid CPU list " << prefix << "_CPUS=" << cpus << " at \"" << bad << "\""
+                          << std::endl;
+            }
+        }
+        result.nice[role] = config_int((prefix + "_NICE").c_str(), 0);
+    }
+    result.render_fifo = config_string("VRVISOR_RENDER_SCHED", "other") == "fifo";
+    result.render_priority = config_int("VRVISOR_RENDER_PRIORITY", 10);
+    result.numa = config_bool("VRVISOR_NUMA", false);
+    return result;
+}
+
+/**
+ * Set the policy used by all later calls to apply()
+ * @param new_policy New policy
+ */
+void Placement::configure(const PlacementPolicy& new_policy)
+{
+    policy = new_policy;
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        role_logged[role] = false;
+    }
+}
+
+/**
+ * Move the calling thread onto the CPUs and scheduling class of its role
+ * @param role Role of the calling thread
+ */
+void Placement::apply(ThreadRole role)
+{
+    std::stringstream status;
+    pid_t tid = syscall(SYS_gettid);
+
+    if (policy.pinned[role]) {
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &policy.cpus[role]);
+        status << " cpus " << format_cpu_list(&policy.cpus[role]);
+        if (err != 0) {
+            status << " (failed: " << std::strerror(err) << ")";
+        }
+    }
+
+    bool fifo = false;
+    if (role == ROLE_RENDER && policy.render_fifo) {
+        struct sched_param param = {};
+        param.sched_priority = policy.render_priority;
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        fifo = err == 0;
+        status << " SCHED_FIFO " << policy.render_priority;
+        if (err != 0) {
+            status << " (failed: " << std::strerror(err) << ")";
+        }
+    }
+
+    // Niceness only matters for threads left in SCHED_OTHER
+    if (!fifo && policy.nice[role] != 0) {
+        int err = setpriority(PRIO_PROCESS, tid, policy.nice[role]) == 0 ? 0 : errno;
+        status << " nice " << policy.nice[role];
+        if (err != 0) {
+            status << " (failed: " << std::strerror(err) << ")";
+        }
+    }
+
+    // Only report the first thread of each role since render threads are created per frame
+    if (!role_logged[role].exchange(true)) {
+        std::string applied = status.str();
+        std::cout << "placement: " << role_names[role] << " thread " << tid << (applied.empty() ? " default" : applied) << std::endl;
+    }
+}
+
+/**
+ * Allocate a converted capture frame, preferring memory local to the render CPUs if NUMA placement is enabled
+ * @param mat Mat to allocate
+ * @param size Frame size
+ * @param type Frame type
+ */
+void Placement::allocateFrame(cv::Mat& mat, cv::Size size, int type)
+{
+    mat.create(size, type);
+    if (!policy.numa || !policy.pinned[ROLE_RENDER]) {
+        return;
+    }
+    int node = first_node(&policy.cpus[ROLE_RENDER]);
+    if (node < 0 || node >= (int)(8 * sizeof(unsigned long))) {
+        return;
+    }
+
+    // Frames are written once by capture and read by every render thread, so keep them near the readers
+    const uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = ((uintptr_t)mat.data + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)mat.data + mat.total() * mat.elemSize()) & ~(page - 1);
+    if (end > begin) {
+        unsigned long mask = 1UL << node;
+        // maxnode counts one past the last bit the kernel reads
+        syscall(SYS_mbind, begin, end - begin, MPOL_PREFERRED, &mask, 8 * sizeof(mask) + 1, MPOL_MF_MOVE);
+    }
+    // Touch every page so it is faulted in under the new policy
+    std::memset(mat.data, 0, mat.total() * mat.elemSize());
+}
+
+/**
+ * Print the configured placement of each role
+ * @param out Stream to print to
+ */
+void Placement::report(std::ostream& out)
+{
+    out << "Placement:" << std::endl;
+    for (int role = 0; role < ROLE_COUNT; ++role) {
+        out << "  " << role_names[role] << ": ";
+        if (policy.pinned[role]) {
+            out << "cpus " << format_cpu_list(&policy.cpus[role]);
+            int node = first_node(&policy.cpus[role]);
+            if (node >= 0) {
+                out << " (node " << node << ")";
+            }
+        } else {
+            out << "any cpu";
+        }
+        if (role == ROLE_RENDER && policy.render_fifo) {
+            out << ", SCHED_FIFO " << policy.render_priority;
+        } else if (policy.nice[role] != 0) {
+            out << ", nice " << policy.nice[role];
+        }
+        out << std::endl;
+    }
+    out << "  numa converted frames: " << (policy.numa && policy.pinned[ROLE_RENDER] ? "render node" : "default") << std::endl;
+}
@@ -0,0 +1,190 @@
+#include "presenter.h"
+#include "config.h"
+#include "timing.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+using namespace std::chrono;
+
+/**
+ * Internal thread for Presenter to show frames at a steady rate
+ * @param arg Presenter* to parent object
+ * @return NULL
+ */
+void* presenter_thread(void* arg)
+{
+    Presenter* presenter = (Presenter*)arg;
+    const bool window = presenter->options.backend == PRESENTER_WINDOW;
+    if (window) {
+        // The window belongs to this thread, every HighGUI call happens here
+        cv::namedWindow(presenter->name, cv::WINDOW_NORMAL);
+        cv::setWindowProperty(presenter->name, cv::WND_PROP_FULLSCREEN, cv::WINDOW_FULLSCREEN);
+    }
+
+    const auto period = duration_cast<steady_clock::duration>(duration<double>(1.0 / presenter->options.fps));
+    auto next = steady_clock::now();
+    bool stop = false;
+    while (!stop) {
+        std::this_thread::sleep_until(next);
+
+        // Take the newest frame, leaving the slot free for the next submit
+        pthread_mutex_lock(&(presenter->mutex));
+        cv::Mat frame = presenter->pending;
+        bool fresh = presenter->has_pending;
+        presenter->pending = cv::Mat();
+        presenter->has_pending = false;
+        if (!fresh) {
+            presenter->counters.idle_ticks += 1;
+        }
+        pthread_mutex_unlock(&(presenter->mutex));
+
+        if (fresh && window) {
+            cv::imshow(presenter->name, frame);
+        }
+        bool escaped = window && cv::waitKey(1) == 27;
+        auto now = steady_clock::now();
+
+        pthread_mutex_lock(&(presenter->mutex));
+        if (fresh) {
+            PresenterStats& counters = presenter->counters;
+            if (counters.presented == 0) {
+                counters.startup_ms = process_uptime_ms();
+                std::cout << "presenter: first frame " << counters.startup_ms << " ms after process start" << std::endl;
+            } else {
+                double interval = duration<double, std::milli>(now - presenter->last_present).count();
+                presenter->interval_sum_ms += interval;
+                presenter->interval_square_sum_ms += interval * interval;
+                counters.max_interval_ms = std::max(counters.max_interval_ms, interval);
+            }
+            presenter->last_present = now;
+            counters.presented += 1;
+        }
+        presenter->escaped = presenter->escaped || escaped;
+        stop = presenter->stopped;
+        pthread_mutex_unlock(&(presenter->mutex));
+
+        // Skip refreshes that were missed rather than presenting a burst to catch up
+        next += period;
+        while (next < now) {
+            next += period;
+        }
+    }
+
+    if (window) {
+        cv::destroyWindow(presenter->name);
+    }
+    return NULL;
+}
+
+/**
+ * Create the presenter and start its thread
+ * @param name Window name
+ * @param options Backend and refresh rate
+ */
+Presenter::Presenter(const std::string& name, const PresenterOptions& options)
+    : name(name)
+    , options(options)
+    , has_pending(false)
+    , stopped(false)
+    , escaped(false)
+    , counters()
+    , interval_sum_ms(0)
+    , interval_square_sum_ms(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_create(&thread, NULL, &presenter_thread, this);
+}
+
+Presenter::~Presenter() { stop(); }
+
+/**
+ * Read options from VRVISOR_DISPLAY (window or null) and VRVISOR_DISPLAY_FPS
+ * @return Presenter options
+ */
+PresenterOptions Presenter::fromEnvironment()
+{
+    PresenterOptions options;
+    options.backend = config_string("VRVISOR_DISPLAY", "window") == "null" ? PRESENTER_NULL : PRESENTER_WINDOW;
+    options.fps = config_double("VRVISOR_DISPLAY_FPS", 60);
+    if (options.fps <= 0) {
+        options.fps = 60;
+    }
+    return options;
+}
+
+/**
+ * Hand over a completed frame without waiting for the display. Replaces any frame
+ *      that has not been shown yet. The frame must not be modified afterwards.
+ * @param frame Completed frame
+ */
+void Presenter::submit(cv::Mat frame)
+{
+    pthread_mutex_lock(&mutex);
+    if (has_pending) {
+        counters.dropped += 1;
+    }
+    pending = frame;
+    has_pending = true;
+    counters.submitted += 1;
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Check whether the user asked to quit by pressing ESC
+ * @return True once ESC was pressed
+ */
+bool Presenter::closed()
+{
+    pthread_mutex_lock(&mutex);
+    bool closed = escaped;
+    pthread_mutex_unlock(&mutex);
+    return closed;
+}
+
+/**
+ * Get a snapshot of the counters
+ * @return Presenter counters
+ */
+PresenterStats Presenter::stats()
+{
+    pthread_mutex_lock(&mutex);
+    PresenterStats stats = counters;
+    if (counters.presented > 1) {
+        const double intervals = counters.presented - 1;
+        stats.mean_interval_ms = interval_sum_ms / intervals;
+        stats.jitter_ms = std::sqrt(std::max(0.0, interval_square_sum_ms / intervals - stats.mean_interval_ms * stats.mean_interval_ms));
+    }
+    pthread_mutex_unlock(&mutex);
+    return stats;
+}
+
+/**
+ * Print the counters
+ * @param out Stream to print to
+ */
+void Presenter::report(std::ostream& out)
+{
+    PresenterStats s = stats();
+    out << "presenter: " << s.presented << " of " << s.submitted << " frames presented, " << s.dropped << " dropped, " << s.idle_ticks
+        << " idle refreshes at " << options.fps << " fps" << std::endl;
+    out << "presenter: first frame " << s.startup_ms << " ms after process start" << std::endl;
+    out << "presenter: interval " << s.mean_interval_ms << " ms mean, " << s.jitter_ms << " ms jitter, " << s.max_interval_ms << " ms max"
+        << std::endl;
+}
+
+/**
+ * Stop internal thread and close the window
+ */
+void Presenter::stop()
+{
+    pthread_mutex_lock(&mutex);
+    if (!stopped) {
+        stopped = true;
+        pthread_mutex_unlock(&mutex);
+        pthread_join(thread, NULL);
+    } else {
+        pthread_mutex_unlock(&mutex);
+    }
+}
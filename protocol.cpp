@@ -0,0 +1,134 @@
+#include "protocol.h"
+#include "config.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static const char* status_names[RENDER_STATUS_COUNT] = { "ok", "bad request", "bad input", "failed", "busy" };
+
+/**
+ * Make a request with the magic set and every option at its default
+ * @param op RenderOp
+ * @param id Request id
+ * @return Request
+ */
+RenderRequest render_request(RenderOp op, uint32_t id)
+{
+    RenderRequest request;
+    std::memset(&request, 0, sizeof(request));
+    std::memcpy(request.magic, RENDER_REQUEST_MAGIC, sizeof(request.magic));
+    request.id = id;
+    request.op = op;
+    request.engine = -1;
+    std::strcpy(request.format, ".jpg");
+    return request;
+}
+
+/**
+ * Make a reply with the magic set
+ * @param id Request id
+ * @param status RenderStatus
+ * @return Reply
+ */
+RenderReply render_reply(uint32_t id, RenderStatus status)
+{
+    RenderReply reply;
+    std::memset(&reply, 0, sizeof(reply));
+    std::memcpy(reply.magic, RENDER_REPLY_MAGIC, sizeof(reply.magic));
+    reply.id = id;
+    reply.status = status;
+    return reply;
+}
+
+/**
+ * Get the name of a status
+ * @param status RenderStatus
+ * @return Short lowercase name
+ */
+const char* render_status_name(int status) { return status >= 0 && status < RENDER_STATUS_COUNT ? status_names[status] : "unknown"; }
+
+/**
+ * Get the daemon's socket path from VRVISOR_RENDERD_SOCKET, RENDER_SOCKET by default
+ * @return Socket path
+ */
+std::string render_socket_path() { return config_string("VRVISOR_RENDERD_SOCKET", RENDER_SOCKET); }
+
+/**
+ * Connect to the daemon
+ * @param path Socket path
+ * @return Connected socket, or -1 with errno set
+ */
+int render_connect(const std::string& path)
+{
+    struct sockaddr_un address;
+    if (path.size() >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, path.c_str());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Read exactly size bytes, retrying short reads
+ * @param fd Socket
+ * @param data Buffer
+ * @param size Bytes to read
+ * @return False on error or end of stream
+ */
+bool read_full(int fd, void* data, size_t size)
+{
+    uint8_t* p = (uint8_t*)data;
+    while (size > 0) {
+        ssize_t done = read(fd, p, size);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return false;
+        }
+        p += done;
+        size -= done;
+    }
+    return true;
+}
+
+/**
+ * Write exactly size bytes, retrying short writes. Never raises SIGPIPE.
+ * @param fd Socket
+ * @param data Bytes to write
+ * @param size Bytes to write
+ * @return False on error
+ */
+bool write_full(int fd, const void* data, size_t size)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    while (size > 0) {
+        ssize_t done = send(fd, p, size, MSG_NOSIGNAL);
+        if (done < 0 && errno == EINTR) {
+            continue;
+        }
+        if (done <= 0) {
+            return false;
+        }
+        p += done;
+        size -= done;
+    }
+    return true;
+}
@@ -0,0 +1,593 @@
+#include "recording.h"
+#include "config.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace std::chrono;
+
+static_assert(sizeof(RecordingHeader) == RECORDING_ALIGNMENT, "header must keep frames aligned");
+static_assert(sizeof(FrameRecord) == RECORDING_ALIGNMENT, "frame record must keep pixels aligned");
+static_assert(sizeof(RecordingFooter) == RECORDING_ALIGNMENT, "footer size");
+
+/**
+ * Round a size up to the recording alignment
+ */
+static uint64_t align(uint64_t size) { return (size + RECORDING_ALIGNMENT - 1) & ~(uint64_t)(RECORDING_ALIGNMENT - 1); }
+
+/**
+ * Thread to write the frames queued by FrameRecorder::submit
+ * @param arg FrameRecorder* to parent object
+ * @return NULL
+ */
+void* recorder_thread(void* arg)
+{
+    FrameRecorder* recorder = (FrameRecorder*)arg;
+
+    pthread_mutex_lock(&(recorder->queue_mutex));
+    while (true) {
+        while (recorder->queue.empty() && !recorder->closing) {
+            pthread_cond_wait(&(recorder->queue_cond), &(recorder->queue_mutex));
+        }
+        if (recorder->queue.empty()) {
+            break; // Closing and every queued frame is written
+        }
+        FrameRecorder::QueuedFrame queued = recorder->queue.front();
+        recorder->queue.pop_front();
+        pthread_mutex_unlock(&(recorder->queue_mutex));
+        recorder->write(queued.stream, queued.frame, queued.captured);
+        pthread_mutex_lock(&(recorder->queue_mutex));
+    }
+    pthread_mutex_unlock(&(recorder->queue_mutex));
+    return NULL;
+}
+
+FrameRecorder::FrameRecorder()
+    : fd(-1)
+    , offset(0)
+    , indexed(false)
+    , key_interval(RECORDING_KEY_INTERVAL)
+    , raw_bytes(0)
+    , data_bytes(0)
+    , queue_max(std::max(1, config_int("VRVISOR_RECORD_QUEUE", 8)))
+    , writing(false)
+    , closing(false)
+    , dropped(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_mutex_init(&queue_mutex, NULL);
+    pthread_cond_init(&queue_cond, NULL);
+}
+
+FrameRecorder::~FrameRecorder()
+{
+    close();
+    pthread_mutex_destroy(&mutex);
+    pthread_mutex_destroy(&queue_mutex);
+    pthread_cond_destroy(&queue_cond);
+}
+
+/**
+ * Create a recording file
+ * @param path File path, replaced if it exists
+ * @param indexed Store 8 bit BGR frames palette indexed, for rendered frames
+ * @return True if the file was created
+ */
+bool FrameRecorder::open(const std::string& path, bool indexed)
+{
+    close();
+    pthread_mutex_lock(&mutex);
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool opened = fd >= 0;
+    if (opened) {
+        this->path = path;
+        offset = 0;
+        index.clear();
+        stream_frames.clear();
+        this->indexed = indexed;
+        encoders.clear();
+        raw_bytes = data_bytes = 0;
+
+        RecordingHeader header = {};
+        std::memcpy(header.magic, RECORDING_MAGIC, sizeof(header.magic));
+        header.version = RECORDING_VERSION;
+        opened = append(&header, sizeof(header));
+    }
+    if (!opened) {
+        std::perror(("recorder: " + path).c_str());
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (opened) {
+        pthread_mutex_lock(&queue_mutex);
+        writing = true;
+        closing = false;
+        dropped = 0;
+        pthread_create(&writer, NULL, &recorder_thread, this);
+        pthread_mutex_unlock(&queue_mutex);
+    }
+    return opened;
+}
+
+/**
+ * Create the recording file named by VRVISOR_RECORD, if set
+ * @return True if recording
+ */
+bool FrameRecorder::openFromEnvironment()
+{
+    std::string path = config_string("VRVISOR_RECORD", "");
+    if (path.empty() || !open(path)) {
+        return false;
+    }
+    std::cout << "recorder: recording raw frames to " << path << std::endl;
+    return true;
+}
+
+/**
+ * Create the palette indexed recording of rendered frames named by VRVISOR_RECORD_OUTPUT,
+ *      if set, with a key frame every VRVISOR_INDEXED_KEYFRAME frames
+ * @return True if recording
+ */
+bool FrameRecorder::openOutputFromEnvironment()
+{
+    std::string path = config_string("VRVISOR_RECORD_OUTPUT", "");
+    if (path.empty() || !open(path, true)) {
+        return false;
+    }
+    key_interval = std::max(1, config_int("VRVISOR_INDEXED_KEYFRAME", RECORDING_KEY_INTERVAL));
+    std::cout << "recorder: recording indexed output frames to " << path << ", key frame every " << key_interval << std::endl;
+    return true;
+}
+
+/**
+ * Check whether frames are being recorded
+ * @return True if a file is open
+ */
+bool FrameRecorder::isOpen()
+{
+    pthread_mutex_lock(&mutex);
+    bool open = fd >= 0;
+    pthread_mutex_unlock(&mutex);
+    return open;
+}
+
+/**
+ * Write all bytes at the end of the file
+ * @return True on success
+ */
+bool FrameRecorder::append(const void* data, size_t size)
+{
+    struct iovec part = { (void*)data, size };
+    return append(&part, 1);
+}
+
+/**
+ * Write several buffers at the end of the file with as few system calls as possible
+ * @param parts Buffers to write in order, changed by partial writes
+ * @param count Number of buffers
+ * @return True on success
+ */
+bool FrameRecorder::append(struct iovec* parts, size_t count)
+{
+    while (count > 0) {
+        if (parts->iov_len == 0) {
+            ++parts;
+            --count;
+            continue;
+        }
+        ssize_t written = ::writev(fd, parts, std::min(count, (size_t)IOV_MAX));
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        offset += written;
+        // Skip what was written, a short write resumes within a buffer
+        while (count > 0 && (size_t)written >= parts->iov_len) {
+            written -= parts->iov_len;
+            ++parts;
+            --count;
+        }
+        if (count > 0) {
+            parts->iov_base = (uint8_t*)parts->iov_base + written;
+            parts->iov_len -= written;
+        }
+    }
+    return true;
+}
+
+/**
+ * Append a frame, waiting for the file
+ * @param stream Camera of the frame
+ * @param frame Raw camera frame, or rendered frame of an indexed recording
+ * @param captured When the frame was grabbed
+ */
+void FrameRecorder::write(int stream, const cv::Mat& frame, steady_clock::time_point captured)
+{
+    static const uint8_t padding[RECORDING_ALIGNMENT] = {};
+
+    pthread_mutex_lock(&mutex);
+    if (fd < 0 || stream < 0 || frame.empty()) {
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+    if ((size_t)stream >= stream_frames.size()) {
+        stream_frames.resize(stream + 1, 0);
+        encoders.resize(indexed ? stream + 1 : 0);
+    }
+
+    FrameRecord record = {};
+    record.magic = RECORDING_FRAME_MAGIC;
+    record.stream = stream;
+    record.index = stream_frames[stream];
+    record.capture_ns = duration_cast<nanoseconds>(captured.time_since_epoch()).count();
+    record.rows = frame.rows;
+    record.cols = frame.cols;
+    record.type = frame.type();
+    record.step = frame.cols * frame.elemSize();
+    record.data_size = (uint64_t)record.step * frame.rows;
+    record.encoding = RECORDING_ENCODING_RAW;
+    record.flags = RECORDING_KEY_FRAME;
+    raw_bytes += record.data_size;
+    if (indexed && frame.type() == CV_8UC3) {
+        // Key frames let replay start or seek without decoding the whole stream
+        bool key = record.index % key_interval == 0;
+        encoders[stream].encode(frame.data, frame.rows, frame.cols, frame.step, !key, encoded);
+        IndexedHeader header;
+        IndexedDecoder::peek(encoded.data(), encoded.size(), header);
+        record.encoding = RECORDING_ENCODING_INDEXED;
+        record.flags = (header.flags & INDEXED_DELTA) ? 0 : RECORDING_KEY_FRAME;
+        record.data_size = encoded.size();
+    }
+    data_bytes += record.data_size;
+
+    RecordingIndexEntry entry = { record.stream, 0, record.index, record.capture_ns, offset };
+    // Record, pixels and padding go out in one writev, a continuous frame as a single buffer
+    parts.clear();
+    parts.push_back({ &record, sizeof(record) });
+    if (record.encoding == RECORDING_ENCODING_INDEXED) {
+        parts.push_back({ encoded.data(), encoded.size() });
+    } else if (frame.isContinuous()) {
+        parts.push_back({ frame.data, record.data_size });
+    } else {
+        for (int row = 0; row < frame.rows; ++row) {
+            parts.push_back({ (void*)frame.ptr(row), record.step });
+        }
+    }
+    parts.push_back({ (void*)padding, align(record.data_size) - record.data_size });
+    bool written = append(parts.data(), parts.size());
+
+    if (written) {
+        index.push_back(entry);
+        stream_frames[stream] += 1;
+    } else {
+        // Stop rather than leave a gap, replay can still use every complete frame
+        std::perror(("recorder: " + path).c_str());
+        ::close(fd);
+        fd = -1;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Queue a frame for the writer thread without waiting for the file. The frame is shared,
+ *      not copied, so it must not be written into while queued. If VRVISOR_RECORD_QUEUE
+ *      frames are already waiting the frame is dropped and counted instead.
+ * @param stream Camera of the frame
+ * @param frame Raw camera frame, or rendered frame of an indexed recording
+ * @param captured When the frame was grabbed
+ * @return False if the frame was dropped or no file is open
+ */
+bool FrameRecorder::submit(int stream, const cv::Mat& frame, steady_clock::time_point captured)
+{
+    pthread_mutex_lock(&queue_mutex);
+    bool queued = writing && !closing && queue.size() < queue_max;
+    if (queued) {
+        // Pixels the Mat does not own, like a camera driver buffer, may change once it returns
+        queue.push_back({ stream, frame.u != NULL ? frame : frame.clone(), captured });
+        pthread_cond_signal(&queue_cond);
+    } else if (writing && !closing) {
+        dropped += 1;
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    return queued;
+}
+
+/**
+ * Write the queued frames, the index and footer and close the file
+ */
+void FrameRecorder::close()
+{
+    pthread_mutex_lock(&queue_mutex);
+    bool joining = writing && !closing;
+    closing = true;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+    if (joining) {
+        pthread_join(writer, NULL);
+        pthread_mutex_lock(&queue_mutex);
+        writing = false;
+        pthread_mutex_unlock(&queue_mutex);
+    }
+
+    pthread_mutex_lock(&mutex);
+    if (fd >= 0) {
+        RecordingFooter footer = {};
+        footer.index_offset = offset;
+        footer.index_count = index.size();
+        std::memcpy(footer.magic, RECORDING_FOOTER_MAGIC, sizeof(footer.magic));
+        if (!append(index.data(), index.size() * sizeof(RecordingIndexEntry)) || !append(&footer, sizeof(footer))) {
+            std::perror(("recorder: " + path).c_str());
+        }
+        ::close(fd);
+        fd = -1;
+        std::cout << "recorder: " << index.size() << " frames written to " << path;
+        if (indexed && raw_bytes > 0) {
+            std::cout << ", indexed to " << 100.0 * data_bytes / raw_bytes << "% of the raw bytes";
+        }
+        if (dropped > 0) {
+            std::cout << ", " << dropped << " dropped while the writer fell behind";
+        }
+        std::cout << std::endl;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+ReplayFile::ReplayFile()
+    : fd(-1)
+    , map(NULL)
+    , size(0)
+    , replay_mode(REPLAY_REALTIME)
+    , first_ns(0)
+    , started(false)
+{
+    pthread_mutex_init(&mutex, NULL);
+}
+
+ReplayFile::~ReplayFile() { close(); }
+
+/**
+ * Add a frame record to the per stream index
+ * @return False if the record is not valid
+ */
+bool ReplayFile::addRecord(uint64_t offset)
+{
+    if (offset + sizeof(FrameRecord) > size) {
+        return false;
+    }
+    const FrameRecord* record = (const FrameRecord*)(map + offset);
+    if (record->magic != RECORDING_FRAME_MAGIC || offset + sizeof(FrameRecord) + record->data_size > size) {
+        return false;
+    }
+    if (record->encoding == RECORDING_ENCODING_INDEXED) {
+        // Only the header is checked here, the frame data when it is decoded
+        IndexedHeader header;
+        if (!IndexedDecoder::peek((const uint8_t*)(record + 1), record->data_size, header) || header.rows != record->rows
+            || header.cols != record->cols || record->type != CV_8UC3) {
+            return false;
+        }
+    } else if (record->encoding != RECORDING_ENCODING_RAW || record->data_size != (uint64_t)record->step * record->rows) {
+        return false;
+    }
+    if (record->stream >= streams.size()) {
+        streams.resize(record->stream + 1);
+    }
+    streams[record->stream].push_back(offset);
+    // Whichever camera wrote first, replay starts from the earliest capture time of any stream
+    first_ns = std::min(first_ns, record->capture_ns);
+    return true;
+}
+
+/**
+ * Map a recording and index its frames
+ * @param path Recording file
+ * @param mode Replay pacing
+ * @return True if the file is a recording
+ */
+bool ReplayFile::open(const std::string& path, ReplayMode mode)
+{
+    close();
+    fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        std::perror(("replay: " + path).c_str());
+        close();
+        return false;
+    }
+    size = st.st_size;
+    if (size < sizeof(RecordingHeader)) {
+        std::cerr << "replay: " << path << " is not a recording" << std::endl;
+        close();
+        return false;
+    }
+    map = (uint8_t*)mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        std::perror(("replay: " + path).c_str());
+        close();
+        return false;
+    }
+    const RecordingHeader* header = (const RecordingHeader*)map;
+    if (std::memcmp(header->magic, RECORDING_MAGIC, sizeof(header->magic)) != 0 || header->version < 1
+        || header->version > RECORDING_VERSION) {
+        std::cerr << "replay: " << path << " is not a recording" << std::endl;
+        close();
+        return false;
+    }
+    replay_mode = mode;
+    first_ns = INT64_MAX;
+    streams.clear();
+
+    // Use the index if the recording was closed, otherwise walk the frame records
+    bool indexed = false;
+    if (size >= 2 * sizeof(RecordingHeader) + sizeof(RecordingFooter)) {
+        const RecordingFooter* footer = (const RecordingFooter*)(map + size - sizeof(RecordingFooter));
+        if (std::memcmp(footer->magic, RECORDING_FOOTER_MAGIC, sizeof(footer->magic)) == 0
+            && footer->index_offset + footer->index_count * sizeof(RecordingIndexEntry) <= size - sizeof(RecordingFooter)) {
+            const RecordingIndexEntry* entries = (const RecordingIndexEntry*)(map + footer->index_offset);
+            indexed = true;
+            for (uint64_t i = 0; indexed && i < footer->index_count; ++i) {
+                indexed = addRecord(entries[i].offset);
+            }
+        }
+    }
+    if (!indexed) {
+        streams.clear();
+        first_ns = INT64_MAX;
+        uint64_t offset = sizeof(RecordingHeader);
+        while (addRecord(offset)) {
+            offset += sizeof(FrameRecord) + align(((const FrameRecord*)(map + offset))->data_size);
+        }
+        std::cerr << "replay: " << path << " has no index, recovered " << offset << " bytes of frames" << std::endl;
+    }
+    decoders.assign(streams.size(), IndexedDecoder());
+    decoded.assign(streams.size(), SIZE_MAX);
+
+    // Pages are read once in order
+    madvise(map, size, MADV_SEQUENTIAL);
+    std::cout << "replay: " << path << ", " << streams.size() << " streams,";
+    for (size_t stream = 0; stream < streams.size(); ++stream) {
+        std::cout << " " << streams[stream].size();
+    }
+    std::cout << " frames, " << (mode == REPLAY_FAST ? "fast" : "realtime") << std::endl;
+    return true;
+}
+
+/**
+ * Open the recording named by VRVISOR_REPLAY, if set, paced by VRVISOR_REPLAY_MODE (realtime or fast)
+ * @return True if replaying
+ */
+bool ReplayFile::openFromEnvironment()
+{
+    std::string path = config_string("VRVISOR_REPLAY", "");
+    if (path.empty()) {
+        return false;
+    }
+    ReplayMode mode = config_string("VRVISOR_REPLAY_MODE", "realtime") == "fast" ? REPLAY_FAST : REPLAY_REALTIME;
+    return open(path, mode);
+}
+
+/**
+ * Check whether a recording is open
+ * @return True if a file is open
+ */
+bool ReplayFile::isOpen() const { return map != NULL; }
+
+/**
+ * Get the replay pacing
+ * @return Replay mode
+ */
+ReplayMode ReplayFile::mode() const { return replay_mode; }
+
+/**
+ * Get the number of frames of one stream
+ * @param stream Camera of the frames
+ * @return Number of frames
+ */
+size_t ReplayFile::frameCount(int stream) const { return stream >= 0 && (size_t)stream < streams.size() ? streams[stream].size() : 0; }
+
+/**
+ * Get a frame, without copying it if it is raw. Indexed frames decode fastest in order.
+ * @param stream Camera of the frame
+ * @param index Frame number within the stream
+ * @param image Set to a Mat pointing into the mapping, or to the decoded frame
+ * @param capture_ns Set to the recorded capture time
+ * @return False past the last frame or if the frame cannot be decoded
+ */
+bool ReplayFile::frame(int stream, size_t index, cv::Mat& image, int64_t& capture_ns) const
+{
+    if (index >= frameCount(stream)) {
+        return false;
+    }
+    const FrameRecord* record = (const FrameRecord*)(map + streams[stream][index]);
+    if (record->encoding == RECORDING_ENCODING_INDEXED) {
+        if (!decode(stream, index, image)) {
+            std::cerr << "replay: frame " << index << " of stream " << stream << " is corrupt" << std::endl;
+            return false;
+        }
+    } else {
+        image = cv::Mat(record->rows, record->cols, record->type, (void*)(record + 1), record->step);
+    }
+    capture_ns = record->capture_ns;
+    return true;
+}
+
+/**
+ * Decode an indexed frame, first decoding the frames it builds on
+ * @param stream Camera of the frame
+ * @param index Frame number within the stream
+ * @param image Set to the decoded frame
+ * @return False if a frame could not be decoded
+ */
+bool ReplayFile::decode(int stream, size_t index, cv::Mat& image) const
+{
+    auto record_at = [this, stream](size_t i) { return (const FrameRecord*)(map + streams[stream][i]); };
+
+    pthread_mutex_lock(&mutex);
+    // Start from the last key frame, unless the decoder is already on the way there
+    size_t first = index;
+    while (first > 0 && !(record_at(first)->flags & RECORDING_KEY_FRAME) && first != decoded[stream] + 1) {
+        --first;
+    }
+    IndexedDecoder& decoder = decoders[stream];
+    bool ok = true;
+    for (size_t i = first; ok && i < index; ++i) {
+        ok = decoder.decode((const uint8_t*)(record_at(i) + 1), record_at(i)->data_size, NULL, 0, 0, 0);
+    }
+    // A new Mat each time, consumers may still hold the previous frame
+    const FrameRecord* record = record_at(index);
+    image = cv::Mat(record->rows, record->cols, CV_8UC3);
+    ok = ok && decoder.decode((const uint8_t*)(record + 1), record->data_size, image.data, image.rows, image.cols, image.step);
+    decoded[stream] = ok ? index : SIZE_MAX;
+    pthread_mutex_unlock(&mutex);
+    return ok;
+}
+
+/**
+ * Sleep until a recorded capture time comes around again. Every stream shares the
+ *      same starting point, so stereo frames stay in step.
+ * @param capture_ns Recorded capture time
+ */
+void ReplayFile::waitUntil(int64_t capture_ns)
+{
+    pthread_mutex_lock(&mutex);
+    if (!started) {
+        start = steady_clock::now();
+        started = true;
+    }
+    steady_clock::time_point due = start + nanoseconds(capture_ns - first_ns);
+    pthread_mutex_unlock(&mutex);
+    std::this_thread::sleep_until(due);
+}
+
+/**
+ * Unmap the recording
+ */
+void ReplayFile::close()
+{
+    if (map != NULL) {
+        munmap(map, size);
+        map = NULL;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    streams.clear();
+    decoders.clear();
+    decoded.clear();
+    started = false;
+}
@@ -0,0 +1,313 @@
+#include "protocol.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <iterator>
+#include <opencv2/opencv.hpp>
+#include <pthread.h>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * render-client.cpp
+ * Send images to renderd and save the results. All requests are sent without waiting,
+ *      so the daemon can batch them, and the throughput and latencies are printed.
+ *      Usage: render-client [-s socket] [-k colors] [-i iterations] [-e effects]
+ *             [-f format] [-q quality] [-r width x height] [-n repeat] [-o dir]
+ *             [-p] [-m] [-c] [-S] image...
+ */
+
+using namespace std::chrono;
+
+/**
+ * State shared by the sending main thread and the reply thread
+ */
+struct client_state {
+    int fd;
+    std::vector<std::string> images;
+    std::string out_dir;
+    std::string format;
+    bool shm; // Results come back in shared memory
+    size_t expected; // Replies to read
+    pthread_mutex_t mutex;
+    std::vector<steady_clock::time_point> sent; // Send time of each request id
+    std::vector<double> round_trip_ms;
+    double queue_ms, render_ms, batch; // Sums reported by the daemon
+    size_t failed;
+    bool lost; // Connection closed early
+};
+
+/**
+ * Name the result of an image
+ * @param state Client state
+ * @param image Input path
+ * @return Output path in out_dir
+ */
+static std::string output_path(const client_state& state, const std::string& image)
+{
+    std::string name = image.substr(image.rfind('/') + 1);
+    name = name.substr(0, name.rfind('.'));
+    return state.out_dir + "/" + name + ".comic" + state.format;
+}
+
+/**
+ * Save a result left in shared memory and remove the object
+ * @param name Shared memory object name
+ * @param reply Reply describing the image
+ * @param path Where to save the image, empty to only remove it
+ * @return False if the object could not be read
+ */
+static bool take_shm(const std::string& name, const RenderReply& reply, const std::string& path)
+{
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    shm_unlink(name.c_str()); // The name is ours alone, the mapping stays valid
+    if (fd < 0) {
+        return false;
+    }
+    cv::Mat header(reply.rows, reply.cols, reply.type);
+    size_t size = header.total() * header.elemSize();
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    if (!path.empty()) {
+        cv::imwrite(path, cv::Mat(reply.rows, reply.cols, reply.type, map));
+    }
+    munmap(map, size);
+    return true;
+}
+
+/**
+ * Thread to read replies and save results
+ * @param arg client_state*
+ * @return NULL
+ */
+static void* reply_thread(void* arg)
+{
+    client_state* state = (client_state*)arg;
+    std::vector<char> payload;
+    for (size_t i = 0; i < state->expected; ++i) {
+        RenderReply reply;
+        if (!read_full(state->fd, &reply, sizeof(reply)) || std::memcmp(reply.magic, RENDER_REPLY_MAGIC, sizeof(reply.magic)) != 0) {
+            state->lost = true;
+            break;
+        }
+        payload.resize(reply.payload_size);
+        if (!read_full(state->fd, payload.data(), payload.size())) {
+            state->lost = true;
+            break;
+        }
+        auto now = steady_clock::now();
+
+        pthread_mutex_lock(&(state->mutex));
+        bool known = reply.id < state->sent.size();
+        if (known) {
+            state->round_trip_ms.push_back(duration<double, std::milli>(now - state->sent[reply.id]).count());
+        }
+        state->queue_ms += reply.queue_ms;
+        state->render_ms += reply.render_ms;
+        state->batch += reply.batch;
+        pthread_mutex_unlock(&(state->mutex));
+
+        std::string text(payload.begin(), payload.end());
+        if (reply.status != RENDER_OK || !known) {
+            std::cerr << "render-client: request " << reply.id << ": " << render_status_name(reply.status) << " " << text << std::endl;
+            state->failed += 1;
+            continue;
+        }
+        // The first round of requests is saved, repeats only measure
+        std::string path = reply.id < state->images.size() ? output_path(*state, state->images[reply.id]) : "";
+        if (state->shm) {
+            if (!take_shm(text, reply, path)) {
+                std::cerr << "render-client: cannot read " << text << ": " << std::strerror(errno) << std::endl;
+                state->failed += 1;
+            }
+        } else if (!path.empty()) {
+            std::ofstream(path, std::ios::binary).write(payload.data(), payload.size());
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Read a whole file
+ * @param path File path
+ * @param bytes Set to the contents
+ * @return False if unreadable
+ */
+static bool read_file(const std::string& path, std::vector<uint8_t>& bytes)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    bytes.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    std::string socket_path = render_socket_path();
+    RenderRequest options = render_request(RENDER_OP_RENDER, 0);
+    options.input = RENDER_INPUT_ENCODED;
+    int repeat = 1;
+    bool stats = false;
+    client_state state;
+    state.out_dir = ".";
+
+    int option;
+    while ((option = getopt(argc, argv, "s:k:i:e:f:q:r:n:o:pmcS")) != -1) {
+        switch (option) {
+        case 's':
+            socket_path = optarg;
+            break;
+        case 'k':
+            options.k = std::atoi(optarg);
+            break;
+        case 'i':
+            options.iterations = std::atoi(optarg);
+            break;
+        case 'e': {
+            // Same names as VRVISOR_EFFECTS
+            std::stringstream list(optarg);
+            std::string name;
+            options.effects = 0;
+            while (std::getline(list, name, ',')) {
+                if (name == "edges") {
+                    options.effects |= RENDER_EFFECT_EDGES;
+                } else if (name == "halftone") {
+                    options.effects |= RENDER_EFFECT_HALFTONE;
+                } else if (name == "posterize") {
+                    options.effects |= RENDER_EFFECT_POSTERIZE;
+                }
+            }
+            break;
+        }
+        case 'f':
+            std::strncpy(options.format, optarg, sizeof(options.format) - 1);
+            break;
+        case 'q':
+            options.quality = std::atoi(optarg);
+            break;
+        case 'r':
+            std::sscanf(optarg, "%dx%d", &options.width, &options.height);
+            break;
+        case 'n':
+            repeat = std::max(1, std::atoi(optarg));
+            break;
+        case 'o':
+            state.out_dir = optarg;
+            break;
+        case 'p':
+            options.input = RENDER_INPUT_PATH;
+            break;
+        case 'm':
+            options.output = RENDER_OUTPUT_SHM;
+            break;
+        case 'c':
+            options.flags |= RENDER_FLAG_COLD_PALETTE;
+            break;
+        case 'S':
+            stats = true;
+            break;
+        default:
+            std::cerr << "usage: [-s socket] [-k colors] [-i iterations] [-e effects] [-f format] [-q quality] "
+                         "[-r widthxheight] [-n repeat] [-o dir] [-p] [-m] [-c] [-S] image..."
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = optind; i < argc; ++i) {
+        state.images.push_back(argv[i]);
+    }
+    if (state.images.empty() && !stats) {
+        std::cerr << "render-client: no images" << std::endl;
+        return EXIT_FAILURE;
+    }
+    state.format = options.format;
+    state.shm = options.output == RENDER_OUTPUT_SHM;
+
+    // Paths are read by the daemon, which may run in another directory
+    std::vector<std::vector<uint8_t>> payloads(state.images.size());
+    for (size_t i = 0; i < state.images.size(); ++i) {
+        if (options.input == RENDER_INPUT_PATH) {
+            char resolved[PATH_MAX];
+            std::string path = realpath(state.images[i].c_str(), resolved) != NULL ? resolved : state.images[i];
+            payloads[i].assign(path.begin(), path.end());
+        } else if (!read_file(state.images[i], payloads[i])) {
+            std::cerr << "render-client: cannot read " << state.images[i] << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    state.fd = render_connect(socket_path);
+    if (state.fd < 0) {
+        std::cerr << "render-client: cannot connect to " << socket_path << ": " << std::strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+    pthread_mutex_init(&(state.mutex), NULL);
+    state.expected = state.images.size() * repeat;
+    state.sent.resize(state.expected);
+    state.queue_ms = state.render_ms = state.batch = 0;
+    state.failed = 0;
+    state.lost = false;
+
+    // Replies are read on their own thread, the daemon drops a client that only writes once its replies pile up
+    pthread_t thread;
+    pthread_create(&thread, NULL, &reply_thread, &state);
+    auto begin = steady_clock::now();
+    for (size_t id = 0; id < state.expected; ++id) {
+        const std::vector<uint8_t>& payload = payloads[id % state.images.size()];
+        RenderRequest request = options;
+        request.id = id;
+        request.payload_size = payload.size();
+        pthread_mutex_lock(&(state.mutex));
+        state.sent[id] = steady_clock::now();
+        pthread_mutex_unlock(&(state.mutex));
+        if (!write_full(state.fd, &request, sizeof(request)) || !write_full(state.fd, payload.data(), payload.size())) {
+            std::cerr << "render-client: connection lost" << std::endl;
+            break;
+        }
+    }
+    pthread_join(thread, NULL);
+    double seconds = duration<double>(steady_clock::now() - begin).count();
+
+    size_t replies = state.round_trip_ms.size();
+    if (state.expected > 0) {
+        std::sort(state.round_trip_ms.begin(), state.round_trip_ms.end());
+        double p50 = replies > 0 ? state.round_trip_ms[replies / 2] : 0;
+        double p99 = replies > 0 ? state.round_trip_ms[std::min(replies * 99 / 100, replies - 1)] : 0;
+        size_t n = std::max<size_t>(replies, 1);
+        std::printf(
+            "render-client: %zu requests in %.2f s, %.1f images/s, %zu failed\n", replies, seconds, replies / seconds, state.failed);
+        std::printf("render-client: round trip p50 %.1f p99 %.1f ms, daemon queue %.1f render %.1f ms mean, batches of %.1f mean\n", p50,
+            p99, state.queue_ms / n, state.render_ms / n, state.batch / n);
+    }
+
+    if (stats && !state.lost) {
+        RenderRequest request = render_request(RENDER_OP_STATS, UINT32_MAX);
+        RenderReply reply;
+        std::vector<char> text;
+        if (write_full(state.fd, &request, sizeof(request)) && read_full(state.fd, &reply, sizeof(reply))) {
+            text.resize(reply.payload_size);
+            if (read_full(state.fd, text.data(), text.size())) {
+                std::cout << std::string(text.begin(), text.end());
+            }
+        }
+    }
+    close(state.fd);
+    pthread_mutex_destroy(&(state.mutex));
+    return state.lost || state.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,37 @@
+#include "placement.h"
+#include "protocol.h"
+#include "server.h"
+
+#include <csignal>
+#include <opencv2/opencv.hpp>
+
+/**
+ * renderd.cpp
+ * Render daemon for still images, the long running replacement for forking offline per
+ *      image. Serves render requests on a UNIX socket until interrupted.
+ *      Usage: renderd [socket]
+ */
+
+int main(int argc, char** argv)
+{
+    // Server threads inherit the blocked signals, so only the main thread sees them
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    Placement::configure(Placement::fromEnvironment());
+    Placement::report(std::cout);
+
+    RenderServer server;
+    if (!server.open(argc > 1 ? argv[1] : render_socket_path())) {
+        return EXIT_FAILURE;
+    }
+    int signal;
+    sigwait(&signals, &signal);
+    std::cout << "renderd: stopping, finishing queued requests" << std::endl;
+    server.stop();
+    server.report(std::cout);
+    return 0;
+}
@@ -0,0 +1,739 @@
+#include "server.h"
+#include "config.h"
+#include "kernels.h"
+#include "kmeans.h"
+#include "placement.h"
+#include "workers.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Latencies of this many recent requests are kept for the report
+#define RENDER_LATENCY_WINDOW 1024
+
+using namespace std::chrono;
+
+// Started before their definitions, friends of RenderServer
+void* connection_thread(void* arg);
+void* render_thread(void* arg);
+
+/**
+ * Get a percentile of samples
+ * @param values Samples, sorted in place
+ * @param fraction Percentile as a fraction
+ * @return Value at the percentile, 0 without samples
+ */
+static float percentile(std::vector<float>& values, double fraction)
+{
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[std::min((size_t)(fraction * values.size()), values.size() - 1)];
+}
+
+/**
+ * Keep a sample in a window of recent samples
+ */
+static void keep(std::deque<float>& window, float value)
+{
+    window.push_back(value);
+    if (window.size() > RENDER_LATENCY_WINDOW) {
+        window.pop_front();
+    }
+}
+
+/**
+ * Copy an image into a new shared memory object, rows back to back
+ * @param name Object name
+ * @param image Image
+ * @return False if the object could not be created
+ */
+static bool write_shm(const std::string& name, const cv::Mat& image)
+{
+    size_t row_bytes = image.cols * image.elemSize();
+    size_t size = row_bytes * image.rows;
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        return false;
+    }
+    void* map = MAP_FAILED;
+    if (ftruncate(fd, size) == 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        return false;
+    }
+    for (int row = 0; row < image.rows; ++row) {
+        std::memcpy((uint8_t*)map + row * row_bytes, image.ptr(row), row_bytes);
+    }
+    munmap(map, size);
+    return true;
+}
+
+/**
+ * Thread to write the queued replies of one client
+ * @param arg RenderOutbox* of the client
+ * @return NULL
+ */
+static void* writer_thread(void* arg)
+{
+    RenderOutbox* outbox = (RenderOutbox*)arg;
+    pthread_mutex_lock(&(outbox->mutex));
+    while (true) {
+        while ((outbox->replies.empty() || outbox->dropped) && !outbox->closing) {
+            pthread_cond_wait(&(outbox->cond), &(outbox->mutex));
+        }
+        if (outbox->replies.empty() || outbox->dropped) {
+            break; // Closing, the reader is gone so the descriptor can be closed
+        }
+        RenderOutgoing outgoing = std::move(outbox->replies.front());
+        outbox->replies.pop_front();
+        outbox->bytes -= outgoing.bytes.size();
+        pthread_mutex_unlock(&(outbox->mutex));
+
+        // Blocks for at most the send timeout, a client that stops reading is dropped
+        bool written = write_full(outbox->fd, outgoing.bytes.data(), outgoing.bytes.size());
+
+        pthread_mutex_lock(&(outbox->mutex));
+        if (!written) {
+            if (!outgoing.shm_name.empty()) {
+                shm_unlink(outgoing.shm_name.c_str());
+            }
+            outbox->drop();
+        }
+    }
+    close(outbox->fd);
+    outbox->finished = true;
+    pthread_mutex_unlock(&(outbox->mutex));
+    return NULL;
+}
+
+RenderOutbox::RenderOutbox(int fd, size_t max_bytes)
+    : fd(fd)
+    , max_bytes(max_bytes)
+    , bytes(0)
+    , closing(false)
+    , dropped(false)
+    , finished(false)
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+RenderOutbox::~RenderOutbox()
+{
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond);
+}
+
+/**
+ * Stop writing, unlink the results of queued replies and wake both sides of the socket,
+ *      call with mutex held
+ */
+void RenderOutbox::drop()
+{
+    if (!dropped) {
+        dropped = true;
+        shutdown(fd, SHUT_RDWR); // The reader sees the end of the stream
+    }
+    for (const RenderOutgoing& outgoing : replies) {
+        if (!outgoing.shm_name.empty()) {
+            shm_unlink(outgoing.shm_name.c_str()); // Nobody is left to unlink it
+        }
+    }
+    replies.clear();
+    bytes = 0;
+    pthread_cond_broadcast(&cond);
+}
+
+RenderConnection::RenderConnection(RenderServer* server, int fd, std::shared_ptr<RenderOutbox> outbox)
+    : server(server)
+    , fd(fd)
+    , outbox(outbox)
+    , done(false)
+{
+}
+
+/**
+ * Let the writer finish the queued replies and exit
+ */
+RenderConnection::~RenderConnection()
+{
+    pthread_mutex_lock(&(outbox->mutex));
+    outbox->closing = true;
+    pthread_cond_broadcast(&(outbox->cond));
+    pthread_mutex_unlock(&(outbox->mutex));
+}
+
+/**
+ * Queue a reply and its payload, never blocks on the socket. A client whose queue
+ *      overflows is dropped.
+ * @param reply Reply, payload_size is set here
+ * @param payload Payload bytes
+ * @param size Payload size
+ * @param shm_name Shared memory result named by the payload, unlinked if the reply is never written
+ * @return False if the client went away or was dropped
+ */
+bool RenderConnection::send(RenderReply& reply, const void* payload, size_t size, const std::string& shm_name)
+{
+    reply.payload_size = size;
+    RenderOutgoing outgoing;
+    outgoing.bytes.resize(sizeof(reply) + size);
+    std::memcpy(outgoing.bytes.data(), &reply, sizeof(reply));
+    if (size > 0) {
+        std::memcpy(outgoing.bytes.data() + sizeof(reply), payload, size);
+    }
+    outgoing.shm_name = shm_name;
+
+    pthread_mutex_lock(&(outbox->mutex));
+    bool overflow = !outbox->dropped && outbox->bytes + outgoing.bytes.size() > outbox->max_bytes;
+    if (overflow) {
+        outbox->drop();
+    }
+    bool queued = !outbox->dropped;
+    if (queued) {
+        outbox->bytes += outgoing.bytes.size();
+        outbox->replies.push_back(std::move(outgoing));
+        pthread_cond_broadcast(&(outbox->cond));
+    }
+    pthread_mutex_unlock(&(outbox->mutex));
+
+    if (!queued && !shm_name.empty()) {
+        shm_unlink(shm_name.c_str());
+    }
+    if (overflow) {
+        std::cerr << "renderd: dropping a client that is not reading its replies" << std::endl;
+        pthread_mutex_lock(&(server->mutex));
+        server->dropped += 1;
+        pthread_mutex_unlock(&(server->mutex));
+    }
+    return queued;
+}
+
+/**
+ * Thread to accept client connections
+ * @param arg RenderServer* to parent object
+ * @return NULL
+ */
+void* accept_thread(void* arg)
+{
+    RenderServer* server = (RenderServer*)arg;
+    while (true) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        int error = errno;
+
+        pthread_mutex_lock(&(server->mutex));
+        if (server->stopped) {
+            pthread_mutex_unlock(&(server->mutex));
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+        // Join the readers of clients that hung up, their replies may still be in flight
+        for (auto it = server->connections.begin(); it != server->connections.end();) {
+            if ((*it)->done) {
+                pthread_join((*it)->thread, NULL);
+                it = server->connections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        // And the writers that finished those replies
+        for (auto it = server->outboxes.begin(); it != server->outboxes.end();) {
+            pthread_mutex_lock(&((*it)->mutex));
+            bool finished = (*it)->finished;
+            pthread_mutex_unlock(&((*it)->mutex));
+            if (finished) {
+                pthread_join((*it)->thread, NULL);
+                it = server->outboxes.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (fd >= 0) {
+            // A writer blocked longer than the timeout fails its write and drops the client
+            struct timeval timeout = { server->send_timeout_s, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            auto outbox = std::make_shared<RenderOutbox>(fd, server->outbox_max);
+            server->outboxes.push_back(outbox);
+            pthread_create(&(outbox->thread), NULL, &writer_thread, outbox.get());
+            auto connection = std::make_shared<RenderConnection>(server, fd, outbox);
+            server->connections.push_back(connection);
+            pthread_create(&(connection->thread), NULL, &connection_thread, connection.get());
+        }
+        pthread_mutex_unlock(&(server->mutex));
+
+        if (fd < 0 && error != EINTR && error != ECONNABORTED) {
+            std::cerr << "renderd: accept: " << std::strerror(error) << std::endl;
+            usleep(10000); // Out of descriptors, give replies a chance to close some
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Thread to read the requests of one client
+ * @param arg RenderConnection* of the client
+ * @return NULL
+ */
+void* connection_thread(void* arg)
+{
+    RenderConnection* connection = (RenderConnection*)arg;
+    RenderServer* server = connection->server;
+
+    RenderRequest request;
+    while (read_full(connection->fd, &request, sizeof(request))) {
+        if (std::memcmp(request.magic, RENDER_REQUEST_MAGIC, sizeof(request.magic)) != 0 || request.payload_size > server->payload_max) {
+            // Nothing after a bad header can be trusted, so the client is dropped
+            std::string reason = "bad magic or payload over " + std::to_string(server->payload_max) + " bytes";
+            RenderReply reply = render_reply(request.id, RENDER_BAD_REQUEST);
+            connection->send(reply, reason.data(), reason.size());
+            break;
+        }
+
+        RenderJob* job = new RenderJob();
+        job->request = request;
+        job->payload.resize(request.payload_size);
+        if (!read_full(connection->fd, job->payload.data(), job->payload.size())) {
+            delete job;
+            break;
+        }
+        job->received = steady_clock::now();
+        job->connection = connection->shared_from_this();
+        job->queue_depth = 0;
+
+        if (request.op == RENDER_OP_STATS) {
+            // Answered right away, it should not wait behind the renders it reports on
+            std::ostringstream text;
+            server->report(text);
+            RenderReply reply = render_reply(request.id, RENDER_OK);
+            connection->send(reply, text.str().data(), text.str().size());
+            delete job;
+            continue;
+        }
+        server->enqueue(job);
+    }
+
+    pthread_mutex_lock(&(server->mutex));
+    connection->done = true;
+    pthread_mutex_unlock(&(server->mutex));
+    return NULL;
+}
+
+/**
+ * Thread to take batches of requests off the queue and render them
+ * @param arg RenderServer* to parent object
+ * @return NULL
+ */
+void* batch_thread(void* arg)
+{
+    RenderServer* server = (RenderServer*)arg;
+    Placement::apply(ROLE_RENDER);
+
+    std::vector<RenderServer::render_args> args;
+    pthread_mutex_lock(&(server->mutex));
+    while (true) {
+        while (server->queue.empty() && !server->stopped) {
+            pthread_cond_wait(&(server->cond), &(server->mutex));
+        }
+        if (server->queue.empty()) {
+            break; // Stopped and every queued request is done
+        }
+
+        // Give a burst of requests a moment to arrive so they are rendered together
+        if (server->batch_window_ms > 0 && server->queue.size() < server->batch_max && !server->stopped) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            long nsec = deadline.tv_nsec + (long)(server->batch_window_ms * 1e6);
+            deadline.tv_sec += nsec / 1000000000;
+            deadline.tv_nsec = nsec % 1000000000;
+            while (server->queue.size() < server->batch_max && !server->stopped
+                && pthread_cond_timedwait(&(server->cond), &(server->mutex), &deadline) != ETIMEDOUT) {
+            }
+        }
+
+        size_t count = std::min(server->queue.size(), server->batch_max);
+        args.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            RenderJob* job = server->queue.front();
+            server->queue.pop_front();
+            job->queue_depth = server->queue.size();
+            args[i] = { server, job, server->slots[i], (int)count };
+        }
+        server->batches += 1;
+        server->batched += count;
+        pthread_mutex_unlock(&(server->mutex));
+
+        // Each request runs on its own worker, its effect graph nodes go to the same pool
+        WorkerPool::shared().run(&render_thread, args.data(), count);
+        for (size_t i = 0; i < count; ++i) {
+            delete args[i].job;
+        }
+
+        pthread_mutex_lock(&(server->mutex));
+    }
+    pthread_mutex_unlock(&(server->mutex));
+    return NULL;
+}
+
+/**
+ * Internal task for RenderServer to render one request of a batch
+ * @param arg render_args*
+ * @return NULL
+ */
+void* render_thread(void* arg)
+{
+    auto args = (struct RenderServer::render_args*)arg;
+    args->server->render(*(args->job), *(args->slot), args->batch);
+    return NULL;
+}
+
+RenderServer::RenderServer()
+    : batch_max(std::max(1, config_int("VRVISOR_RENDERD_BATCH", WorkerPool::shared().size())))
+    , batch_window_ms(config_double("VRVISOR_RENDERD_BATCH_MS", 1))
+    , queue_max(std::max(1, config_int("VRVISOR_RENDERD_QUEUE", 256)))
+    , payload_max((size_t)std::max(1, config_int("VRVISOR_RENDERD_MAX_PAYLOAD_MB", 64)) << 20)
+    , outbox_max((size_t)std::max(1, config_int("VRVISOR_RENDERD_REPLY_QUEUE_MB", 256)) << 20)
+    , send_timeout_s(std::max(1, config_int("VRVISOR_RENDERD_SEND_TIMEOUT_S", 10)))
+    , default_options(EffectOptions::fromEnvironment())
+    , default_engine(edge_engine_from_environment())
+    , listen_fd(-1)
+    , started(false)
+    , shm_count(0)
+    , stopped(false)
+    , requests(0)
+    , failures(0)
+    , rejected(0)
+    , dropped(0)
+    , batches(0)
+    , batched(0)
+    , queue_peak(0)
+{
+    pthread_mutex_init(&mutex, NULL);
+    // The batch window is timed on the monotonic clock, wall clock steps must not stretch it
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    for (size_t i = 0; i < batch_max; ++i) {
+        slots.push_back(new RenderSlot());
+    }
+}
+
+RenderServer::~RenderServer()
+{
+    stop();
+    for (RenderSlot* slot : slots) {
+        for (auto& entry : slot->graphs) {
+            delete entry.second;
+        }
+        delete slot;
+    }
+    pthread_mutex_destroy(&mutex);
+    pthread_cond_destroy(&cond);
+}
+
+/**
+ * Listen on a socket and start serving
+ * @param path Socket path, a stale socket left by a crashed daemon is replaced
+ * @return False if the socket could not be created or another daemon is using it
+ */
+bool RenderServer::open(const std::string& path)
+{
+    struct sockaddr_un address;
+    if (started || path.empty() || path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "renderd: invalid socket path " << path << std::endl;
+        return false;
+    }
+
+    // A socket nobody answers on was left behind by a daemon that did not shut down
+    int probe = render_connect(path);
+    if (probe >= 0) {
+        close(probe);
+        std::cerr << "renderd: another daemon is listening on " << path << std::endl;
+        return false;
+    }
+    if (errno == ECONNREFUSED) {
+        unlink(path.c_str());
+    }
+
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strcpy(address.sun_path, path.c_str());
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        std::cerr << "renderd: cannot bind " << path << ": " << std::strerror(errno) << std::endl;
+        if (listen_fd >= 0) {
+            close(listen_fd);
+            listen_fd = -1;
+        }
+        return false;
+    }
+    // Requests name files to read, so only the daemon's own user may connect
+    chmod(path.c_str(), 0600);
+    if (listen(listen_fd, SOMAXCONN) != 0) {
+        std::cerr << "renderd: cannot listen on " << path << ": " << std::strerror(errno) << std::endl;
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(path.c_str());
+        return false;
+    }
+
+    this->path = path;
+    started = true;
+    pthread_create(&accept_thread_id, NULL, &accept_thread, this);
+    pthread_create(&batch_thread_id, NULL, &batch_thread, this);
+    std::cout << "renderd: listening on " << path << ", batches of up to " << batch_max << " on " << WorkerPool::shared().size()
+              << " workers" << std::endl;
+    return true;
+}
+
+/**
+ * Stop accepting requests, finish the queued ones and remove the socket
+ */
+void RenderServer::stop()
+{
+    pthread_mutex_lock(&mutex);
+    if (!started || stopped) {
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+    stopped = true;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+
+    // Wakes accept() with an error
+    shutdown(listen_fd, SHUT_RDWR);
+    pthread_join(accept_thread_id, NULL);
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(path.c_str());
+
+    // Readers stop at their next read, queued replies can still be written
+    pthread_mutex_lock(&mutex);
+    std::vector<std::shared_ptr<RenderConnection>> open_connections;
+    open_connections.swap(connections);
+    pthread_mutex_unlock(&mutex);
+    for (auto& connection : open_connections) {
+        shutdown(connection->fd, SHUT_RD);
+        pthread_join(connection->thread, NULL);
+    }
+
+    pthread_join(batch_thread_id, NULL);
+
+    // Every reply is queued now, writers finish theirs within the send timeout and exit
+    open_connections.clear();
+    pthread_mutex_lock(&mutex);
+    std::vector<std::shared_ptr<RenderOutbox>> writers;
+    writers.swap(outboxes);
+    pthread_mutex_unlock(&mutex);
+    for (auto& outbox : writers) {
+        pthread_join(outbox->thread, NULL);
+    }
+}
+
+/**
+ * Queue a request, or reject it if the queue is full
+ * @param job Request, owned by the server from here on
+ */
+void RenderServer::enqueue(RenderJob* job)
+{
+    pthread_mutex_lock(&mutex);
+    if (stopped || queue.size() >= queue_max) {
+        rejected += 1;
+        pthread_mutex_unlock(&mutex);
+        RenderReply reply = render_reply(job->request.id, RENDER_BUSY);
+        job->connection->send(reply, NULL, 0);
+        delete job;
+        return;
+    }
+    queue.push_back(job);
+    requests += 1;
+    queue_peak = std::max(queue_peak, queue.size());
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Render one request and send its reply
+ * @param job Request
+ * @param slot Warm buffers to render with
+ * @param batch Requests in this batch
+ */
+void RenderServer::render(RenderJob& job, RenderSlot& slot, int batch)
+{
+    auto start = steady_clock::now();
+    const RenderRequest& request = job.request;
+    RenderReply reply = render_reply(request.id, RENDER_OK);
+    reply.batch = batch;
+    reply.queue_depth = job.queue_depth;
+    reply.queue_ms = duration<float, std::milli>(start - job.received).count();
+
+    int k = request.k > 0 ? request.k : 8;
+    int iterations = request.iterations > 0 ? request.iterations : 100;
+    bool sized = request.width > 0 && request.height > 0;
+    if (request.op != RENDER_OP_RENDER || request.input > RENDER_INPUT_RAW || request.output > RENDER_OUTPUT_SHM || k > KERNEL_MAX_COLORS
+        || request.engine >= EDGES_COUNT || request.width < 0 || request.height < 0 || (request.width > 0) != sized
+        || request.scale > 8) {
+        std::string reason = "unsupported option";
+        reply.status = RENDER_BAD_REQUEST;
+        finish(job, reply, reason.data(), reason.size());
+        return;
+    }
+
+    std::string shm_name;
+    try {
+        // Decode into the slot's buffer, which is reused while images keep their size
+        cv::Mat image;
+        if (request.input == RENDER_INPUT_PATH) {
+            image = cv::imread(std::string(job.payload.begin(), job.payload.end()), cv::IMREAD_COLOR);
+        } else if (request.input == RENDER_INPUT_ENCODED) {
+            cv::Mat bytes(1, (int)job.payload.size(), CV_8UC1, job.payload.data());
+            image = cv::imdecode(bytes, cv::IMREAD_COLOR, &slot.decoded);
+        } else if (request.raw_rows > 0 && request.raw_cols > 0
+            && (uint64_t)request.raw_rows * request.raw_cols * 3 == job.payload.size()) {
+            image = cv::Mat(request.raw_rows, request.raw_cols, CV_8UC3, job.payload.data());
+        }
+        if (image.empty()) {
+            std::string reason = "cannot read image";
+            reply.status = RENDER_BAD_INPUT;
+            finish(job, reply, reason.data(), reason.size());
+            return;
+        }
+        if (sized) {
+            cv::resize(image, slot.input, cv::Size(request.width, request.height));
+            image = slot.input;
+        }
+
+        // Refine the last palette for k, a similar image converges in a few iterations
+        cv::Mat means;
+        if (!(request.flags & RENDER_FLAG_COLD_PALETTE)) {
+            pthread_mutex_lock(&mutex);
+            auto palette = palettes.find(k);
+            if (palette != palettes.end()) {
+                means = palette->second;
+            }
+            pthread_mutex_unlock(&mutex);
+        }
+        means = kmeans(image, means, k, iterations);
+        pthread_mutex_lock(&mutex);
+        palettes[k] = means;
+        pthread_mutex_unlock(&mutex);
+
+        EffectOptions options = default_options;
+        if (request.effects != 0) {
+            options.edges = request.effects & RENDER_EFFECT_EDGES;
+            options.halftone = request.effects & RENDER_EFFECT_HALFTONE;
+            options.posterize = request.effects & RENDER_EFFECT_POSTERIZE;
+        }
+        if (request.scale > 0) {
+            options.scale = request.scale;
+        }
+        unsigned key = options.edges | options.halftone << 1 | options.posterize << 2 | (unsigned)(options.scale * 16) << 3;
+        EffectGraph*& graph = slot.graphs[key];
+        if (graph == NULL) {
+            graph = new EffectGraph(options);
+        }
+        cv::Mat output = graph->run(image, means, request.engine >= 0 ? (EdgeEngine)request.engine : default_engine);
+        reply.rows = output.rows;
+        reply.cols = output.cols;
+        reply.type = output.type();
+
+        if (request.output == RENDER_OUTPUT_ENCODED) {
+            std::string format(request.format, strnlen(request.format, sizeof(request.format)));
+            std::vector<int> params;
+            if (request.quality > 0) {
+                params = { cv::IMWRITE_JPEG_QUALITY, request.quality };
+            }
+            if (!cv::imencode(format, output, slot.encoded, params)) {
+                throw std::runtime_error("cannot encode as " + format);
+            }
+        } else {
+            pthread_mutex_lock(&mutex);
+            shm_name = "/vrvisor-render-" + std::to_string(getpid()) + "-" + std::to_string(shm_count++);
+            pthread_mutex_unlock(&mutex);
+            if (!write_shm(shm_name, output)) {
+                throw std::runtime_error("cannot create " + shm_name + ": " + std::strerror(errno));
+            }
+        }
+    } catch (std::exception& e) {
+        // cv::Exception too, a request that breaks OpenCV must not take the daemon down
+        std::string reason = e.what();
+        reply.status = RENDER_FAILED;
+        reply.rows = reply.cols = reply.type = 0;
+        reply.render_ms = duration<float, std::milli>(steady_clock::now() - start).count();
+        finish(job, reply, reason.data(), reason.size());
+        return;
+    }
+
+    reply.render_ms = duration<float, std::milli>(steady_clock::now() - start).count();
+    if (request.output == RENDER_OUTPUT_ENCODED) {
+        finish(job, reply, slot.encoded.data(), slot.encoded.size());
+    } else {
+        finish(job, reply, shm_name.data(), shm_name.size());
+    }
+}
+
+/**
+ * Send a reply and count it
+ * @param job Request
+ * @param reply Reply, timings are set here
+ * @param payload Payload bytes
+ * @param size Payload size
+ */
+void RenderServer::finish(RenderJob& job, RenderReply& reply, const void* payload, size_t size)
+{
+    reply.total_ms = duration<float, std::milli>(steady_clock::now() - job.received).count();
+    // Only queued here, the connection's writer sends it and unlinks the result if it cannot
+    bool shm = reply.status == RENDER_OK && job.request.output == RENDER_OUTPUT_SHM;
+    job.connection->send(reply, payload, size, shm ? std::string((const char*)payload, size) : std::string());
+
+    pthread_mutex_lock(&mutex);
+    failures += reply.status != RENDER_OK;
+    keep(queue_ms, reply.queue_ms);
+    keep(render_ms, reply.render_ms);
+    keep(total_ms, reply.total_ms);
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Print request counts, queue depth, batch sizes and latency percentiles
+ * @param out Stream to print to
+ */
+void RenderServer::report(std::ostream& out)
+{
+    pthread_mutex_lock(&mutex);
+    out << "renderd: " << requests << " requests, " << failures << " failed, " << rejected << " rejected, " << dropped
+        << " clients dropped, " << batches
+        << " batches of " << (batches > 0 ? (double)batched / batches : 0) << " mean, queue " << queue.size() << " now, "
+        << queue_peak << " peak" << std::endl;
+    std::vector<float> queued(queue_ms.begin(), queue_ms.end());
+    std::vector<float> rendered(render_ms.begin(), render_ms.end());
+    std::vector<float> total(total_ms.begin(), total_ms.end());
+    out << "renderd: warm palettes for k =";
+    for (const auto& palette : palettes) {
+        out << " " << palette.first;
+    }
+    out << std::endl;
+    pthread_mutex_unlock(&mutex);
+
+    out << "renderd: last " << total.size() << " requests, queue p50 " << percentile(queued, 0.5) << " p99 " << percentile(queued, 0.99)
+        << " ms, render p50 " << percentile(rendered, 0.5) << " p99 " << percentile(rendered, 0.99) << " ms, total p50 "
+        << percentile(total, 0.5) << " p99 " << percentile(total, 0.99) << " ms" << std::endl;
+}
@@ -0,0 +1,137 @@
+#include "indexed.h"
+#include "shmring.h"
+
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include <thread>
+#include <vector>
+
+/**
+ * shm-reader.cpp
+ * Sample consumer of the shared memory ring published with VRVISOR_SHM. Reads the
+ *      latest frames in place, decoding indexed frames, and prints the frame rate, latency
+ *      and stage timings.
+ *      Usage: shm-reader [name] [seconds] [snapshot.png]
+ */
+
+using namespace std::chrono;
+
+bool stop = false;
+
+void stop_handler(int s) { stop = true; }
+
+/**
+ * Read every cache line of a frame, the way a consumer uploading it would
+ * @param image Frame in shared memory
+ * @return Sum of one byte per cache line
+ */
+static uint64_t touch(const cv::Mat& image)
+{
+    uint64_t sum = 0;
+    size_t row_bytes = image.cols * image.elemSize();
+    for (int row = 0; row < image.rows; ++row) {
+        const uint8_t* p = image.ptr(row);
+        for (size_t i = 0; i < row_bytes; i += SHM_RING_ALIGNMENT) {
+            sum += p[i];
+        }
+    }
+    return sum;
+}
+
+int main(int argc, char** argv)
+{
+    struct sigaction sigIntHandler;
+    sigIntHandler.sa_handler = stop_handler;
+    sigemptyset(&sigIntHandler.sa_mask);
+    sigIntHandler.sa_flags = 0;
+    sigaction(SIGINT, &sigIntHandler, NULL);
+
+    std::string name = argc > 1 ? argv[1] : "/vrvisor";
+    double run_seconds = argc > 2 ? atof(argv[2]) : 0;
+    std::string snapshot_path = argc > 3 ? argv[3] : "";
+
+    ShmRingReader reader;
+    ShmFrameView view;
+    IndexedDecoder decoder;
+    std::vector<uint8_t> encoded;
+    cv::Mat decoded, snapshot;
+    uint64_t last_seq = 0;
+    uint64_t checksum = 0;
+    size_t frames = 0, skipped = 0, torn = 0;
+    double publish_age_sum = 0, capture_age_sum = 0;
+    auto begin = steady_clock::now();
+    auto report_at = begin + std::chrono::seconds(1);
+
+    while (!stop && (run_seconds <= 0 || steady_clock::now() - begin < duration<double>(run_seconds))) {
+        // The writer creates the ring with its first frame and removes it on exit
+        if (reader.closed()) {
+            if (!reader.open(name)) {
+                std::this_thread::sleep_for(milliseconds(100));
+                continue;
+            }
+            std::cout << "shm-reader: mapped " << name << std::endl;
+            last_seq = 0;
+        }
+        if (!reader.latest(view, last_seq)) {
+            std::this_thread::sleep_for(microseconds(500));
+            continue;
+        }
+
+        // Indexed frames are copied out of the ring and only decoded once the copy is known
+        //      to be whole, the writer may be overwriting the slot while it is read
+        bool readable = true;
+        cv::Mat image = view.image;
+        if (view.meta.encoding == SHM_ENCODING_INDEXED) {
+            encoded.assign(view.data, view.data + view.meta.data_size);
+        } else {
+            checksum += touch(image);
+            if (!snapshot_path.empty()) {
+                image.copyTo(snapshot);
+            }
+        }
+        if (reader.valid(view) && view.meta.encoding == SHM_ENCODING_INDEXED) {
+            decoded.create(view.meta.rows, view.meta.cols, CV_8UC3);
+            readable = decoder.decode(encoded.data(), encoded.size(), decoded.data, decoded.rows, decoded.cols, decoded.step);
+            image = decoded;
+            if (readable) {
+                checksum += touch(image);
+                if (!snapshot_path.empty()) {
+                    image.copyTo(snapshot);
+                }
+            }
+        }
+        if (!reader.valid(view) || !readable) {
+            torn += 1; // Overwritten while reading, a real consumer would drop it
+            snapshot.release();
+            continue;
+        }
+        int64_t now_ns = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+        skipped += last_seq > 0 ? view.seq - last_seq - 1 : 0;
+        last_seq = view.seq;
+        frames += 1;
+        publish_age_sum += (now_ns - view.meta.publish_ns) / 1e6;
+        capture_age_sum += (now_ns - view.meta.capture_ns) / 1e6;
+
+        if (steady_clock::now() >= report_at) {
+            std::cout << "shm-reader: " << frames << " fps, " << skipped << " skipped, " << torn << " torn, "
+                      << view.meta.cols << "x" << view.meta.rows << ", " << publish_age_sum / frames << " ms after publish, "
+                      << capture_age_sum / frames << " ms after capture, frame " << view.meta.frame_num << ":";
+            for (uint32_t i = 0; i < view.meta.stage_count; ++i) {
+                std::cout << " " << view.meta.stage_names[i] << " " << view.meta.stage_ms[i] << " ms";
+            }
+            std::cout << std::endl;
+            frames = skipped = torn = 0;
+            publish_age_sum = capture_age_sum = 0;
+            report_at += std::chrono::seconds(1);
+        }
+    }
+
+    if (!snapshot_path.empty() && !snapshot.empty()) {
+        cv::imwrite(snapshot_path, snapshot);
+        std::cout << "shm-reader: saved last frame to " << snapshot_path << std::endl;
+    }
+    std::cout << "shm-reader: checksum " << checksum << std::endl; // Keeps the reads from being optimised away
+    return 0;
+}
@@ -0,0 +1,348 @@
+#include "shmring.h"
+#include "config.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std::chrono;
+
+/**
+ * Round a size up to the ring alignment
+ */
+static uint64_t align(uint64_t size) { return (size + SHM_RING_ALIGNMENT - 1) & ~(uint64_t)(SHM_RING_ALIGNMENT - 1); }
+
+/**
+ * Find a slot of a mapped ring
+ */
+static ShmSlot* slot_at(uint8_t* map, uint64_t seq)
+{
+    const ShmRingHeader* header = (const ShmRingHeader*)map;
+    return (ShmSlot*)(map + sizeof(ShmRingHeader) + (seq % header->slot_count) * header->slot_size);
+}
+
+ShmRingWriter::ShmRingWriter()
+    : slot_count(SHM_RING_SLOTS)
+    , map(NULL)
+    , size(0)
+    , next(1)
+    , dropped(0)
+    , indexed(false)
+    , raw_bytes(0)
+    , data_bytes(0)
+{
+}
+
+ShmRingWriter::~ShmRingWriter() { close(); }
+
+/**
+ * Create the ring. It is sized by the first published frame.
+ * @param name Shared memory object name, e.g. /vrvisor
+ * @param slots Number of frames kept
+ * @param indexed Publish 8 bit BGR frames as palette indexed frames
+ * @return True if the name is usable
+ */
+bool ShmRingWriter::open(const std::string& name, int slots, bool indexed)
+{
+    close();
+    if (name.empty() || name.find('/', 1) != std::string::npos || slots < 2) {
+        std::cerr << "shm: invalid ring " << name << " with " << slots << " slots" << std::endl;
+        return false;
+    }
+    this->name = name[0] == '/' ? name : "/" + name;
+    slot_count = slots;
+    next = 1;
+    dropped = 0;
+    this->indexed = indexed;
+    encoder.reset();
+    raw_bytes = data_bytes = 0;
+    return true;
+}
+
+/**
+ * Create the ring named by VRVISOR_SHM, if set, with VRVISOR_SHM_SLOTS slots, indexed
+ *      if VRVISOR_SHM_INDEXED is set
+ * @return True if publishing
+ */
+bool ShmRingWriter::openFromEnvironment()
+{
+    std::string name = config_string("VRVISOR_SHM", "");
+    if (name.empty() || !open(name, config_int("VRVISOR_SHM_SLOTS", SHM_RING_SLOTS), config_bool("VRVISOR_SHM_INDEXED", false))) {
+        return false;
+    }
+    std::cout << "shm: publishing " << (indexed ? "indexed " : "") << "frames to " << this->name << " with " << slot_count << " slots"
+              << std::endl;
+    return true;
+}
+
+/**
+ * Check whether frames are published
+ * @return True if open
+ */
+bool ShmRingWriter::isOpen() const { return !name.empty(); }
+
+/**
+ * Check whether frames are published palette indexed
+ * @return True if indexed
+ */
+bool ShmRingWriter::isIndexed() const { return indexed; }
+
+/**
+ * Create and map the shared memory object
+ * @param capacity Largest frame data in bytes
+ * @return True on success
+ */
+bool ShmRingWriter::create(uint64_t capacity)
+{
+    uint64_t slot_size = sizeof(ShmSlot) + align(capacity);
+    size = sizeof(ShmRingHeader) + slot_count * slot_size;
+
+    // Replace a ring left behind by a crashed writer, its readers keep their old mapping
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        std::perror(("shm: " + name).c_str());
+        if (fd >= 0) {
+            ::close(fd);
+            shm_unlink(name.c_str());
+        }
+        return false;
+    }
+    void* mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd); // The mapping keeps the object alive
+    if (mapped == MAP_FAILED) {
+        std::perror(("shm: " + name).c_str());
+        shm_unlink(name.c_str());
+        return false;
+    }
+    map = (uint8_t*)mapped;
+
+    // The object starts zeroed, so every sequence and latest are already 0
+    ShmRingHeader* header = (ShmRingHeader*)map;
+    header->version = SHM_RING_VERSION;
+    header->slot_count = slot_count;
+    header->slot_size = slot_size;
+    header->capacity = capacity;
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(header->magic, SHM_RING_MAGIC, sizeof(header->magic)); // Readers wait for the magic
+    return true;
+}
+
+/**
+ * Copy a frame into the next slot and make it the latest
+ * @param frame Finished frame
+ * @param frame_num Capture frame number
+ * @param captured When the camera frame was grabbed
+ * @param stages Stage timings, at most SHM_RING_STAGES are kept
+ */
+void ShmRingWriter::publish(const cv::Mat& frame, size_t frame_num, steady_clock::time_point captured, const std::vector<ShmStage>& stages)
+{
+    if (name.empty() || frame.empty()) {
+        return;
+    }
+    uint64_t row_bytes = frame.cols * frame.elemSize();
+    uint64_t bytes = row_bytes * frame.rows;
+    bool encode = indexed && frame.type() == CV_8UC3;
+    if (map == NULL && !create(indexed ? IndexedEncoder::maxSize(frame.rows, frame.cols) : bytes)) {
+        name.clear(); // Give up rather than retry every frame
+        return;
+    }
+    ShmRingHeader* header = (ShmRingHeader*)map;
+
+    // Encoded before taking the slot, so the slot is only being written for the copy
+    if (encode) {
+        encoder.encode(frame.data, frame.rows, frame.cols, frame.step, false, encoded);
+    }
+    uint64_t data_size = encode ? encoded.size() : bytes;
+    if (data_size > header->capacity) {
+        dropped += 1;
+        return;
+    }
+    raw_bytes += bytes;
+    data_bytes += data_size;
+
+    uint64_t seq = next++;
+    ShmSlot* slot = slot_at(map, seq);
+    slot->seq.store(2 * seq - 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    ShmFrameMeta& meta = slot->meta;
+    meta.frame_num = frame_num;
+    meta.capture_ns = duration_cast<nanoseconds>(captured.time_since_epoch()).count();
+    meta.rows = frame.rows;
+    meta.cols = frame.cols;
+    meta.type = frame.type();
+    meta.step = row_bytes;
+    meta.encoding = encode ? SHM_ENCODING_INDEXED : SHM_ENCODING_RAW;
+    meta.data_size = data_size;
+    meta.stage_count = std::min(stages.size(), (size_t)SHM_RING_STAGES);
+    for (uint32_t i = 0; i < meta.stage_count; ++i) {
+        meta.stage_ms[i] = stages[i].ms;
+        std::strncpy(meta.stage_names[i], stages[i].name, SHM_RING_STAGE_NAME - 1);
+        meta.stage_names[i][SHM_RING_STAGE_NAME - 1] = '\0';
+    }
+    uint8_t* pixels = (uint8_t*)(slot + 1);
+    if (encode) {
+        std::memcpy(pixels, encoded.data(), data_size);
+    } else if (frame.isContinuous()) {
+        std::memcpy(pixels, frame.data, bytes);
+    } else {
+        for (int row = 0; row < frame.rows; ++row) {
+            std::memcpy(pixels + row * row_bytes, frame.ptr(row), row_bytes);
+        }
+    }
+    meta.publish_ns = duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+
+    slot->seq.store(2 * seq, std::memory_order_release);
+    header->latest.store(seq, std::memory_order_release);
+}
+
+/**
+ * Print published and dropped frame counts
+ * @param out Stream to print to
+ */
+void ShmRingWriter::report(std::ostream& out)
+{
+    if (!name.empty()) {
+        out << "shm: " << next - 1 << " frames published to " << name << ", " << dropped << " too big for the ring";
+        if (indexed && data_bytes > 0) {
+            out << ", indexed to " << 100.0 * data_bytes / raw_bytes << "% of the raw bytes";
+        }
+        out << std::endl;
+    }
+}
+
+/**
+ * Mark the ring closed and remove it
+ */
+void ShmRingWriter::close()
+{
+    if (map != NULL) {
+        ((ShmRingHeader*)map)->closed.store(1, std::memory_order_release);
+        munmap(map, size);
+        map = NULL;
+        shm_unlink(name.c_str());
+    }
+    name.clear();
+}
+
+ShmRingReader::ShmRingReader()
+    : fd(-1)
+    , map(NULL)
+    , size(0)
+{
+}
+
+ShmRingReader::~ShmRingReader() { close(); }
+
+/**
+ * Map a ring read only
+ * @param name Shared memory object name
+ * @return True if the ring exists and has a frame size
+ */
+bool ShmRingReader::open(const std::string& name)
+{
+    close();
+    std::string path = name[0] == '/' ? name : "/" + name;
+    fd = shm_open(path.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmRingHeader)) {
+        close();
+        return false;
+    }
+    size = st.st_size;
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        close();
+        return false;
+    }
+    map = (uint8_t*)mapped;
+
+    const ShmRingHeader* header = (const ShmRingHeader*)map;
+    if (std::memcmp(header->magic, SHM_RING_MAGIC, sizeof(header->magic)) != 0) {
+        close(); // Not initialised yet
+        return false;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (header->version != SHM_RING_VERSION || header->slot_count == 0
+        || sizeof(ShmRingHeader) + header->slot_count * header->slot_size > size) {
+        std::cerr << "shm: " << path << " is not a compatible ring" << std::endl;
+        close();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Check whether the writer has closed the ring
+ * @return True if the ring should be reopened
+ */
+bool ShmRingReader::closed() const { return map == NULL || ((const ShmRingHeader*)map)->closed.load(std::memory_order_acquire) != 0; }
+
+/**
+ * Get the newest frame without copying its pixels
+ * @param view Set to the frame
+ * @param after Only return frames newer than this ring frame number
+ * @return False if there is no newer complete frame
+ */
+bool ShmRingReader::latest(ShmFrameView& view, uint64_t after) const
+{
+    if (map == NULL) {
+        return false;
+    }
+    const ShmRingHeader* header = (const ShmRingHeader*)map;
+    uint64_t seq = header->latest.load(std::memory_order_acquire);
+    if (seq == 0 || seq <= after) {
+        return false;
+    }
+    const ShmSlot* slot = slot_at(map, seq);
+    if (slot->seq.load(std::memory_order_acquire) != 2 * seq) {
+        return false; // Overtaken by the writer already
+    }
+    ShmFrameMeta meta;
+    std::memcpy(&meta, &slot->meta, sizeof(meta));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot->seq.load(std::memory_order_relaxed) != 2 * seq || meta.data_size > header->capacity
+        || (meta.encoding == SHM_ENCODING_RAW && meta.data_size != (uint64_t)meta.step * meta.rows)) {
+        return false;
+    }
+    view.seq = seq;
+    view.meta = meta;
+    view.data = (const uint8_t*)(slot + 1);
+    if (meta.encoding == SHM_ENCODING_RAW) {
+        view.image = cv::Mat(meta.rows, meta.cols, meta.type, (void*)view.data, meta.step);
+    } else {
+        view.image.release();
+    }
+    return true;
+}
+
+/**
+ * Check that a frame was not overwritten while it was being used. Call after
+ *      reading the pixels, anything read is garbage if this returns false.
+ * @param view Frame from latest
+ * @return True if the pixels read were the published frame
+ */
+bool ShmRingReader::valid(const ShmFrameView& view) const
+{
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return map != NULL && slot_at(map, view.seq)->seq.load(std::memory_order_relaxed) == 2 * view.seq;
+}
+
+/**
+ * Unmap the ring
+ */
+void ShmRingReader::close()
+{
+    if (map != NULL) {
+        munmap(map, size);
+        map = NULL;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
@@ -0,0 +1,465 @@
+#include "capture.h"
+#include "config.h"
+#include "kmeans.h"
+#include "pipeline.h"
+#include "placement.h"
+#include "recording.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
+#include <opencv2/opencv.hpp>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * soak.cpp
+ * Run the capture, k-means and pipeline stack for a long time while streams are
+ *      started, stopped and restarted at random. Memory, threads, latency and dropped
+ *      frames are sampled periodically and the run fails if they drift past limits.
+ *      Usage: soak [seconds] [streams]
+ */
+
+using namespace std::chrono;
+
+bool stop = false;
+
+void stop_handler(int s) { stop = true; }
+
+/**
+ * Limits a sample may not exceed, relative to the first sample where noted
+ */
+struct SoakLimits {
+    double rss_growth_mb; // VRVISOR_SOAK_MAX_RSS_GROWTH_MB
+    int thread_growth; // VRVISOR_SOAK_MAX_THREAD_GROWTH
+    double latency_growth; // VRVISOR_SOAK_MAX_LATENCY_GROWTH, factor on p99 latency
+    double latency_slack_ms; // VRVISOR_SOAK_LATENCY_SLACK_MS, growth below this is ignored
+    double stage_slack_ms; // VRVISOR_SOAK_STAGE_SLACK_MS, growth of one effect node's p99 below this is ignored
+    double drop_rate; // VRVISOR_SOAK_MAX_DROP_RATE, fraction of frames, not relative
+};
+
+/**
+ * One stream of the stack, replaying its own copy of the source so restarts begin at
+ *      the first frame
+ */
+struct SoakStream {
+    int id; // Stream in the recording
+    bool active;
+    ReplayFile replay;
+    ImageCapture* capture;
+    Pipeline* pipeline;
+    size_t delivered, skipped; // Pipeline deliveries of stopped captures
+};
+
+/**
+ * Process wide metrics and the latencies of one sample period
+ */
+struct SoakSample {
+    double rss_mb;
+    int threads;
+    double latency_p50, latency_p99, latency_max; // Capture to finished frame
+    double process_p50, process_p99; // Pipeline processing
+    double stage_p50[NODE_COUNT], stage_p99[NODE_COUNT]; // Each effect node, 0 for pruned nodes
+    double drop_rate;
+    size_t frames;
+};
+
+/**
+ * Read a field of /proc/self/status
+ * @param key Field name including the colon, e.g. VmRSS:
+ * @return Its number, 0 if missing
+ */
+static long proc_status(const std::string& key)
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (std::getline(status, line)) {
+        if (line.compare(0, key.size(), key) == 0) {
+            return std::atol(line.c_str() + key.size());
+        }
+    }
+    return 0;
+}
+
+/**
+ * Get a percentile of samples
+ * @param values Samples, sorted in place
+ * @param fraction Percentile as a fraction
+ * @return Value at the percentile, 0 without samples
+ */
+static double percentile(std::vector<double>& values, double fraction)
+{
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[std::min((size_t)(fraction * values.size()), values.size() - 1)];
+}
+
+/**
+ * Write a synthetic recording of moving shapes, one stream per camera
+ * @param path Recording file
+ * @param streams Number of streams
+ * @param frames Frames per stream
+ * @return True if written
+ */
+static bool write_synthetic(const std::string& path, int streams, int frames)
+{
+    FrameRecorder recorder;
+    if (!recorder.open(path)) {
+        return false;
+    }
+    const auto frame_time = microseconds(33333);
+    steady_clock::time_point start = steady_clock::now();
+    cv::Mat frame(240, 320, CV_8UC3);
+    for (int i = 0; i < frames; ++i) {
+        for (int stream = 0; stream < streams; ++stream) {
+            // Slowly changing background with colored discs crossing it, so every effect has work to do
+            frame.setTo(cv::Scalar((i * 3) % 256, (i * 5 + stream * 60) % 256, 128));
+            for (int disc = 0; disc < 6; ++disc) {
+                cv::Point center((i * (disc + 2) + disc * 53) % 320, (disc * 40 + i * (disc % 3)) % 240);
+                cv::circle(frame, center, 12 + disc * 4, cv::Scalar(disc * 40, 255 - disc * 40, (disc * 90) % 256), -1);
+            }
+            recorder.write(stream, frame, start + i * frame_time);
+        }
+    }
+    recorder.close();
+    return true;
+}
+
+/**
+ * Start a stream replaying from its first frame
+ */
+static void start_stream(SoakStream* stream, const std::string& path)
+{
+    stream->replay.open(path, REPLAY_REALTIME);
+    stream->capture = new ImageCapture(stream->id, &stream->replay);
+    stream->active = true;
+}
+
+/**
+ * Stop a stream whose pipeline is already gone, keeping its delivery counters
+ */
+static void stop_stream(SoakStream* stream)
+{
+    stream->capture->stop();
+    for (const ConsumerStats& stats : stream->capture->consumerStats()) {
+        if (stats.name == "pipeline") {
+            stream->delivered += stats.delivered;
+            stream->skipped += stats.skipped;
+        }
+    }
+    delete stream->capture;
+    stream->capture = NULL;
+    stream->replay.close();
+    stream->active = false;
+}
+
+/**
+ * Count pipeline deliveries of every stream so far
+ */
+static void count_deliveries(const std::vector<SoakStream*>& streams, size_t& delivered, size_t& skipped)
+{
+    delivered = skipped = 0;
+    for (SoakStream* stream : streams) {
+        delivered += stream->delivered;
+        skipped += stream->skipped;
+        if (stream->active) {
+            for (const ConsumerStats& stats : stream->capture->consumerStats()) {
+                if (stats.name == "pipeline") {
+                    delivered += stats.delivered;
+                    skipped += stats.skipped;
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Compare a sample against the first one
+ * @return Descriptions of every limit exceeded
+ */
+static std::vector<std::string> check_sample(const SoakSample& first, const SoakSample& sample, const SoakLimits& limits)
+{
+    std::vector<std::string> failures;
+    char text[160];
+    if (sample.rss_mb - first.rss_mb > limits.rss_growth_mb) {
+        std::snprintf(text, sizeof(text), "rss grew %.1f MB, limit %.1f MB", sample.rss_mb - first.rss_mb, limits.rss_growth_mb);
+        failures.push_back(text);
+    }
+    if (sample.threads - first.threads > limits.thread_growth) {
+        std::snprintf(text, sizeof(text), "threads grew from %d to %d, limit +%d", first.threads, sample.threads, limits.thread_growth);
+        failures.push_back(text);
+    }
+    double latency_limit = std::max(first.latency_p99 * limits.latency_growth, first.latency_p99 + limits.latency_slack_ms);
+    if (sample.frames > 0 && sample.latency_p99 > latency_limit) {
+        std::snprintf(text, sizeof(text), "p99 latency %.1f ms, limit %.1f ms", sample.latency_p99, latency_limit);
+        failures.push_back(text);
+    }
+    // A single stage drifting can hide in the end to end latency of a parallel graph
+    for (int node = 0; node < NODE_COUNT; ++node) {
+        double stage_limit = std::max(first.stage_p99[node] * limits.latency_growth, first.stage_p99[node] + limits.stage_slack_ms);
+        if (sample.frames > 0 && first.stage_p99[node] > 0 && sample.stage_p99[node] > stage_limit) {
+            std::snprintf(text, sizeof(text), "%s p99 %.2f ms, limit %.2f ms", effect_node_name((EffectNode)node), sample.stage_p99[node],
+                stage_limit);
+            failures.push_back(text);
+        }
+    }
+    if (sample.drop_rate > limits.drop_rate) {
+        std::snprintf(text, sizeof(text), "dropped %.1f%% of frames, limit %.1f%%", 100 * sample.drop_rate, 100 * limits.drop_rate);
+        failures.push_back(text);
+    }
+    return failures;
+}
+
+int main(int argc, char** argv)
+{
+    struct sigaction sigIntHandler;
+    sigIntHandler.sa_handler = stop_handler;
+    sigemptyset(&sigIntHandler.sa_mask);
+    sigIntHandler.sa_flags = 0;
+    sigaction(SIGINT, &sigIntHandler, NULL);
+
+    double duration_s = argc > 1 ? std::atof(argv[1]) : config_double("VRVISOR_SOAK_SECONDS", 600);
+    int stream_count = argc > 2 ? std::atoi(argv[2]) : config_int("VRVISOR_SOAK_STREAMS", 2);
+    double sample_s = config_double("VRVISOR_SOAK_SAMPLE_S", 10);
+    double churn_s = config_double("VRVISOR_SOAK_CHURN_S", 20);
+    unsigned seed = config_int("VRVISOR_SOAK_SEED", (int)std::random_device()());
+    SoakLimits limits = { config_double("VRVISOR_SOAK_MAX_RSS_GROWTH_MB", 64), config_int("VRVISOR_SOAK_MAX_THREAD_GROWTH", 4),
+        config_double("VRVISOR_SOAK_MAX_LATENCY_GROWTH", 1.5), config_double("VRVISOR_SOAK_LATENCY_SLACK_MS", 10),
+        config_double("VRVISOR_SOAK_STAGE_SLACK_MS", 2), config_double("VRVISOR_SOAK_MAX_DROP_RATE", 0.5) };
+    if (duration_s <= 0 || stream_count < 1 || sample_s <= 0) {
+        std::cerr << "usage: [seconds] [streams]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    setenv("VRVISOR_PALETTE_CACHE", "none", 0); // Restarted k-means must not overwrite the user's palette
+
+    Placement::configure(Placement::fromEnvironment());
+    Placement::report(std::cout);
+
+    // Replay a recording if given, otherwise generate one
+    std::string path = config_string("VRVISOR_REPLAY", "");
+    bool synthetic = path.empty();
+    if (synthetic) {
+        path = config_string("VRVISOR_SOAK_RECORDING", "/tmp/vrvisor-soak.rec");
+        if (!write_synthetic(path, stream_count, config_int("VRVISOR_SOAK_FRAMES", 150))) {
+            return EXIT_FAILURE;
+        }
+    }
+    ReplayFile probe;
+    if (!probe.open(path, REPLAY_REALTIME)) {
+        return EXIT_FAILURE;
+    }
+    int recorded_streams = 0;
+    while (probe.frameCount(recorded_streams) > 0) {
+        recorded_streams += 1;
+    }
+    probe.close();
+    if (recorded_streams == 0) {
+        std::cerr << "soak: " << path << " has no frames in stream 0" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "soak: " << duration_s << " s, " << stream_count << " streams, seed " << seed << std::endl;
+
+    std::mt19937 random(seed);
+    std::exponential_distribution<double> churn_wait(1.0 / churn_s);
+    EffectOptions options = EffectOptions::fromEnvironment();
+
+    std::vector<SoakStream*> streams;
+    for (int i = 0; i < stream_count; ++i) {
+        SoakStream* stream = new SoakStream();
+        stream->id = i % recorded_streams;
+        stream->active = false;
+        stream->capture = NULL;
+        stream->pipeline = NULL;
+        stream->delivered = stream->skipped = 0;
+        start_stream(stream, path);
+        streams.push_back(stream);
+    }
+    SoakStream* kmeans_host = streams[0];
+    Kmeans* kmeans = new Kmeans(8, 100, kmeans_host->capture);
+    for (SoakStream* stream : streams) {
+        stream->pipeline = new Pipeline(stream->capture, kmeans, QualityController::fromEnvironment(), options);
+    }
+
+    auto begin = steady_clock::now();
+    auto next_sample = begin + duration<double>(sample_s);
+    auto next_churn = begin + duration<double>(churn_wait(random));
+    std::vector<double> latencies, process_times;
+    std::vector<double> stage_times[NODE_COUNT];
+    size_t last_delivered = 0, last_skipped = 0, churns = 0, restarts = 0;
+    SoakSample first = {};
+    bool have_first = false;
+    std::vector<std::string> failures;
+
+    while (!stop && steady_clock::now() - begin < duration<double>(duration_s)) {
+        // One frame from every active stream, the way dual runs its two
+        for (SoakStream* stream : streams) {
+            if (stream->active) {
+                stream->pipeline->start();
+            }
+        }
+        for (SoakStream* stream : streams) {
+            if (stream->active) {
+                try {
+                    stream->pipeline->join();
+                } catch (cv::Exception& e) {
+                    std::cout << "soak: FAIL processing threw " << e.what() << std::endl;
+                    failures.push_back(std::string("processing threw ") + e.what());
+                    continue;
+                }
+                steady_clock::time_point captured;
+                double process_ms, node_ms[NODE_COUNT];
+                stream->pipeline->lastFrame(captured, process_ms, node_ms);
+                latencies.push_back(duration<double, std::milli>(steady_clock::now() - captured).count());
+                process_times.push_back(process_ms);
+                for (int node = 0; node < NODE_COUNT; ++node) {
+                    stage_times[node].push_back(node_ms[node]);
+                }
+            }
+        }
+
+        // Streams at the end of the recording start over, other changes happen at random times
+        int action = -1;
+        SoakStream* target = NULL;
+        for (SoakStream* stream : streams) {
+            if (stream->active && stream->capture->finished()) {
+                action = 0;
+                target = stream;
+                break;
+            }
+        }
+        if (target == NULL && steady_clock::now() >= next_churn) {
+            next_churn = steady_clock::now() + duration<double>(churn_wait(random));
+            action = std::uniform_int_distribution<int>(0, 5)(random);
+            target = streams[std::uniform_int_distribution<int>(0, stream_count - 1)(random)];
+            churns += 1;
+        }
+        if (target != NULL) {
+            int active_count = std::count_if(streams.begin(), streams.end(), [](SoakStream* s) { return s->active; });
+            bool restart = (action == 0 || action == 5) && target->active;
+            bool stop_one = action == 1 && target->active && active_count > 1;
+            bool start_one = action == 2 && !target->active;
+            bool restart_kmeans = action == 3 || ((restart || stop_one) && target == kmeans_host);
+
+            // Actions 4 and 5 delete the pipeline of the target while it processes a frame, 5 also
+            //      stops its capture under it first
+            if (action >= 4 && target->active) {
+                target->pipeline->start();
+                if (action == 5) {
+                    target->capture->stop();
+                }
+                delete target->pipeline;
+                target->pipeline = NULL;
+            }
+
+            // Pipelines hold the Kmeans and k-means holds its capture, so restarting k-means tears
+            //      down every pipeline from the top, other changes only rebuild the target's
+            for (SoakStream* stream : streams) {
+                if (restart_kmeans || stream == target) {
+                    delete stream->pipeline; // Finishes a frame in flight first
+                    stream->pipeline = NULL;
+                }
+            }
+            if (restart_kmeans) {
+                delete kmeans; // Stops its thread
+                kmeans = NULL;
+            }
+            if (restart || stop_one) {
+                stop_stream(target);
+            }
+            if (restart || start_one) {
+                start_stream(target, path);
+            }
+            restarts += restart;
+            if (kmeans == NULL) {
+                kmeans_host = *std::find_if(streams.begin(), streams.end(), [](SoakStream* s) { return s->active; });
+                kmeans = new Kmeans(8, 100, kmeans_host->capture);
+            }
+            for (SoakStream* stream : streams) {
+                if (stream->active && stream->pipeline == NULL) {
+                    stream->pipeline = new Pipeline(stream->capture, kmeans, QualityController::fromEnvironment(), options);
+                }
+            }
+        }
+
+        if (steady_clock::now() >= next_sample) {
+            next_sample += duration<double>(sample_s);
+            size_t delivered, skipped;
+            count_deliveries(streams, delivered, skipped);
+            size_t window_delivered = delivered - last_delivered, window_skipped = skipped - last_skipped;
+            last_delivered = delivered;
+            last_skipped = skipped;
+
+            SoakSample sample;
+            sample.rss_mb = proc_status("VmRSS:") / 1024.0;
+            sample.threads = proc_status("Threads:");
+            sample.frames = latencies.size();
+            sample.latency_p50 = percentile(latencies, 0.5);
+            sample.latency_p99 = percentile(latencies, 0.99);
+            sample.latency_max = percentile(latencies, 1);
+            sample.process_p50 = percentile(process_times, 0.5);
+            sample.process_p99 = percentile(process_times, 0.99);
+            sample.drop_rate = window_delivered + window_skipped > 0 ? (double)window_skipped / (window_delivered + window_skipped) : 0;
+            latencies.clear();
+            process_times.clear();
+            for (int node = 0; node < NODE_COUNT; ++node) {
+                sample.stage_p50[node] = percentile(stage_times[node], 0.5);
+                sample.stage_p99[node] = percentile(stage_times[node], 0.99);
+                stage_times[node].clear();
+            }
+
+            int active_count = std::count_if(streams.begin(), streams.end(), [](SoakStream* s) { return s->active; });
+            std::printf("soak: %6.0f s, %d streams, rss %.1f MB, %d threads, %zu frames, latency p50 %.1f p99 %.1f max %.1f ms, "
+                        "process p50 %.1f p99 %.1f ms, dropped %.1f%%, %zu churns, %zu restarts\n",
+                duration<double>(steady_clock::now() - begin).count(), active_count, sample.rss_mb, sample.threads, sample.frames,
+                sample.latency_p50, sample.latency_p99, sample.latency_max, sample.process_p50, sample.process_p99,
+                100 * sample.drop_rate, churns, restarts);
+            std::printf("soak:          stages p50/p99 ms");
+            for (int node = 0; node < NODE_COUNT; ++node) {
+                if (sample.stage_p99[node] > 0) {
+                    std::printf(", %s %.2f/%.2f", effect_node_name((EffectNode)node), sample.stage_p50[node], sample.stage_p99[node]);
+                }
+            }
+            std::printf("\n");
+            std::fflush(stdout);
+
+            // The first sample is the baseline, so start up and warm caches do not count as drift
+            if (!have_first) {
+                first = sample;
+                have_first = true;
+            } else {
+                for (const std::string& failure : check_sample(first, sample, limits)) {
+                    std::cout << "soak: FAIL " << failure << std::endl;
+                    failures.push_back(failure);
+                }
+            }
+        }
+    }
+
+    // Shut down in the same order as the other executables, pipelines first
+    auto shutdown_begin = steady_clock::now();
+    for (SoakStream* stream : streams) {
+        delete stream->pipeline;
+    }
+    delete kmeans;
+    for (SoakStream* stream : streams) {
+        if (stream->active) {
+            stop_stream(stream);
+        }
+        delete stream;
+    }
+    std::cout << "soak: shutdown took " << duration<double, std::milli>(steady_clock::now() - shutdown_begin).count() << " ms" << std::endl;
+    if (synthetic) {
+        std::remove(path.c_str());
+    }
+
+    if (!have_first) {
+        std::cout << "soak: run shorter than one sample period, nothing checked" << std::endl;
+    }
+    std::cout << "soak: " << (failures.empty() ? "PASS" : "FAIL") << ", " << failures.size() << " limit violations" << std::endl;
+    return failures.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
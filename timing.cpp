@@ -0,0 +1,34 @@
+#include "timing.h"
+
+#include <fstream>
+#include <sstream>
+#include <time.h>
+#include <unistd.h>
+
+// Fallback start time if /proc is not available, taken when the program is loaded
+static const steady_clock::time_point load_time = steady_clock::now();
+
+/**
+ * Get the time since this process started, including exec and loading before main
+ * @return Milliseconds since process start
+ */
+double process_uptime_ms()
+{
+    // Field 22 of /proc/self/stat is the start time in clock ticks since boot
+    std::ifstream stat("/proc/self/stat");
+    std::string line;
+    struct timespec now;
+    if (std::getline(stat, line) && line.rfind(')') != std::string::npos && clock_gettime(CLOCK_BOOTTIME, &now) == 0) {
+        std::istringstream fields(line.substr(line.rfind(')') + 2));
+        std::string field;
+        for (int i = 3; i < 22; ++i) {
+            fields >> field; // Skip to field 22, the fields start at 3 after the command name
+        }
+        unsigned long long start_ticks;
+        if (fields >> start_ticks) {
+            double start_ms = 1000.0 * start_ticks / sysconf(_SC_CLK_TCK);
+            return now.tv_sec * 1000.0 + now.tv_nsec / 1e6 - start_ms;
+        }
+    }
+    return duration<double, std::milli>(steady_clock::now() - load_time).count();
+}
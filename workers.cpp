@@ -0,0 +1,160 @@
+#include "workers.h"
+#include "config.h"
+#include "placement.h"
+
+#include <algorithm>
+#include <thread>
+
+/**
+ * Internal thread for WorkerPool to run queued tasks
+ * @param arg WorkerPool* to parent object
+ * @return NULL
+ */
+void* worker_thread(void* arg)
+{
+    WorkerPool* pool = (WorkerPool*)arg;
+    Placement::apply(ROLE_RENDER);
+
+    pthread_mutex_lock(&(pool->mutex));
+    while (!pool->stopped || !pool->queue.empty()) {
+        if (pool->queue.empty()) {
+            pthread_cond_wait(&(pool->cond), &(pool->mutex));
+            continue;
+        }
+        WorkerPool::Task task = pool->queue.front();
+        pool->queue.pop_front();
+        pool->execute(task);
+    }
+    pthread_mutex_unlock(&(pool->mutex));
+    return NULL;
+}
+
+/**
+ * Start worker threads
+ * @param threads Number of threads
+ */
+WorkerPool::WorkerPool(int threads)
+    : threads(threads > 0 ? threads : 1)
+    , stopped(false)
+{
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+    for (pthread_t& thread : this->threads) {
+        pthread_create(&thread, NULL, &worker_thread, this);
+    }
+}
+
+WorkerPool::~WorkerPool() { stop(); }
+
+/**
+ * Get the pool shared by every effect, sized by VRVISOR_WORKERS or the number of CPUs
+ * @return Shared pool
+ */
+WorkerPool& WorkerPool::shared()
+{
+    static WorkerPool pool(config_int("VRVISOR_WORKERS", std::max((int)std::thread::hardware_concurrency(), 2)));
+    return pool;
+}
+
+/**
+ * Queue a task
+ * @param group Group the task belongs to
+ * @param fn Task function
+ * @param arg Argument to fn
+ */
+void WorkerPool::submit(TaskGroup& group, void* (*fn)(void*), void* arg)
+{
+    pthread_mutex_lock(&mutex);
+    group.pending += 1;
+    queue.push_back({ fn, arg, &group });
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Run queued tasks until every task of a group has finished
+ * @param group Group to wait for
+ * @throws First exception thrown by a task of the group, once all of them have finished
+ */
+void WorkerPool::wait(TaskGroup& group)
+{
+    pthread_mutex_lock(&mutex);
+    while (group.pending > 0) {
+        if (queue.empty()) {
+            pthread_cond_wait(&cond, &mutex);
+            continue;
+        }
+        // Help rather than block, the task may belong to another group
+        Task task = queue.front();
+        queue.pop_front();
+        execute(task);
+    }
+    std::exception_ptr error = group.error;
+    group.error = NULL; // Groups may be reused
+    pthread_mutex_unlock(&mutex);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+/**
+ * Run one task and mark it finished, call with mutex held
+ * @param task Task taken off the queue
+ */
+void WorkerPool::execute(const Task& task)
+{
+    pthread_mutex_unlock(&mutex);
+    std::exception_ptr error;
+    try {
+        task.fn(task.arg);
+    } catch (...) {
+        // Would end the process on a pool thread, the waiter rethrows it instead
+        error = std::current_exception();
+    }
+    pthread_mutex_lock(&mutex);
+    if (error && !task.group->error) {
+        task.group->error = error;
+    }
+    task.group->pending -= 1;
+    if (task.group->pending == 0) {
+        pthread_cond_broadcast(&cond); // Wake whoever waits for the group
+    }
+}
+
+/**
+ * Keep the first exception thrown by a task of a group
+ * @param group Group the task belongs to
+ * @param error Exception thrown
+ */
+void WorkerPool::fail(TaskGroup& group, std::exception_ptr error)
+{
+    pthread_mutex_lock(&mutex);
+    if (!group.error) {
+        group.error = error;
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+/**
+ * Get the number of worker threads
+ * @return Number of threads
+ */
+int WorkerPool::size() const { return threads.size(); }
+
+/**
+ * Stop worker threads, queued tasks are still run
+ */
+void WorkerPool::stop()
+{
+    pthread_mutex_lock(&mutex);
+    if (!stopped) {
+        stopped = true;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+        for (pthread_t& thread : threads) {
+            pthread_join(thread, NULL);
+        }
+    } else {
+        pthread_mutex_unlock(&mutex);
+    }
+}